@@ -31,6 +31,7 @@
 #include <kern/errno.h>
 #include <kern/syscall.h>
 #include <lib.h>
+#include <copyinout.h>
 #include <mips/trapframe.h>
 #include <thread.h>
 #include <current.h>
@@ -83,6 +84,8 @@ syscall(struct trapframe *tf)
 	int callno;
 	int32_t retval;
 	int err;
+	int32_t fd;
+	off_t offset;
 
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
@@ -110,6 +113,36 @@ syscall(struct trapframe *tf)
 		err = sys___time((userptr_t)tf->tf_a0,
 				 (userptr_t)tf->tf_a1);
 		break;
+
+	    case SYS_futex_wait:
+		err = sys_futex_wait((userptr_t)tf->tf_a0, (int)tf->tf_a1);
+		break;
+
+	    case SYS_futex_wake:
+		err = sys_futex_wake((userptr_t)tf->tf_a0, (int)tf->tf_a1,
+				     &retval);
+		break;
+
+	    case SYS_mmap:
+		/* fd is on the stack at sp+16, and offset, aligned, at sp+24 */
+		err = copyin((const_userptr_t)(tf->tf_sp + 16), &fd,
+			     sizeof(fd));
+		if (err) {
+			break;
+		}
+		err = copyin((const_userptr_t)(tf->tf_sp + 24), &offset,
+			     sizeof(offset));
+		if (err) {
+			break;
+		}
+		err = sys_mmap((userptr_t)tf->tf_a0, (size_t)tf->tf_a1,
+			       (int)tf->tf_a2, (int)tf->tf_a3, fd, offset,
+			       &retval);
+		break;
+
+	    case SYS_munmap:
+		err = sys_munmap((userptr_t)tf->tf_a0, (size_t)tf->tf_a1);
+		break;
 #ifdef UW
 	case SYS_write:
 	  err = sys_write((int)tf->tf_a0,
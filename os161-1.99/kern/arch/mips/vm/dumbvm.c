@@ -34,9 +34,11 @@
 #include <spinlock.h>
 #include <proc.h>
 #include <current.h>
+#include <thread.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <vnode.h>
 
 #include "opt-A3.h"
 
@@ -48,6 +50,10 @@
 /* under dumbvm, always have 48k of user stack */
 #define DUMBVM_STACKPAGES    12
 
+/* mmap()ed files go between here and the stack */
+#define DUMBVM_MAPBASE       0x40000000
+#define DUMBVM_MAPTOP        (USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE)
+
 
 #if OPT_A3
 
@@ -128,6 +134,12 @@ getppages(unsigned long npages)
             }
         }
         
+        if (avaliable < (int) npages){
+            // no run of free frames long enough
+            spinlock_release(&stealmem_lock);
+            return 0;
+        }
+        
         int start = i - (avaliable - 1);
         framelist[start].continuous_memory = avaliable-1;
         
@@ -200,6 +212,73 @@ vm_tlbshootdown(const struct tlbshootdown *ts)
 	panic("dumbvm tried to do tlb shootdown?!\n");
 }
 
+/*
+ * Find the mapping, if any, that ADDR is in.
+ */
+static
+struct as_mapping *
+as_findmap(struct addrspace *as, vaddr_t addr)
+{
+	struct as_mapping *map;
+
+	for (map = as->as_maps; map != NULL; map = map->am_next) {
+		if (addr >= map->am_base &&
+		    addr < map->am_base + map->am_npages * PAGE_SIZE) {
+			return map;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Fault in the page at FAULTADDRESS of mapped file MAP. The page is
+ * the file's own, so it's entered read-only.
+ *
+ * A fault in copyin may come from the middle of a file system
+ * operation, with the file's locks held, perhaps even the file's own.
+ * Such callers bump t_nomapfill around the copy, after putting the
+ * pages in memory with as_prefault, and the fault then only gets
+ * pages the file already has. Any other fault may read the page in.
+ */
+static
+int
+vm_mapfault(struct as_mapping *map, int faulttype, vaddr_t faultaddress)
+{
+	paddr_t paddr;
+	uint32_t ehi, elo;
+	bool fill;
+	int i, spl, result;
+
+	if (faulttype != VM_FAULT_READ) {
+		return EFAULT;
+	}
+
+	fill = curthread->t_nomapfill == 0;
+	result = VOP_MMAP(map->am_vn,
+			  map->am_offset + (faultaddress - map->am_base),
+			  fill, &paddr);
+	if (result) {
+		return result;
+	}
+	KASSERT((paddr & PAGE_FRAME) == paddr);
+
+	spl = splhigh();
+	for (i=0; i<NUM_TLB; i++) {
+		tlb_read(&ehi, &elo, i);
+		if (elo & TLBLO_VALID) {
+			continue;
+		}
+		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x (mapped)\n",
+		      faultaddress, paddr);
+		tlb_write(faultaddress, paddr | TLBLO_VALID, i);
+		splx(spl);
+		return 0;
+	}
+	tlb_random(faultaddress, paddr | TLBLO_VALID);
+	splx(spl);
+	return 0;
+}
+
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
@@ -208,6 +287,7 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	int i;
 	uint32_t ehi, elo;
 	struct addrspace *as;
+	struct as_mapping *map;
 	int spl;
 
 	faultaddress &= PAGE_FRAME;
@@ -243,6 +323,12 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 		return EFAULT;
 	}
 
+	/* Pages of mmap()ed files come from the file */
+	map = as_findmap(as, faultaddress);
+	if (map != NULL) {
+		return vm_mapfault(map, faulttype, faultaddress);
+	}
+
 	/* Assert that the address space has been set up properly. */
 	KASSERT(as->as_vbase1 != 0);
 	KASSERT(as->as_pbase1 != 0);
@@ -343,6 +429,7 @@ as_create(void)
 	as->as_pbase2 = 0;
 	as->as_npages2 = 0;
 	as->as_stackpbase = 0;
+	as->as_maps = NULL;
     
 #if OPT_A3
     as->loaded = false;
@@ -353,10 +440,26 @@ as_create(void)
 void
 as_destroy(struct addrspace *as)
 {
+	struct as_mapping *map;
+
+	while (as->as_maps != NULL) {
+		map = as->as_maps;
+		as->as_maps = map->am_next;
+		VOP_DECREF(map->am_vn);
+		kfree(map);
+	}
+
 #if OPT_A3
- 	kfree((void *)PADDR_TO_KVADDR(as->as_pbase1));
- 	kfree((void *)PADDR_TO_KVADDR(as->as_pbase2));
- 	kfree((void *)PADDR_TO_KVADDR(as->as_stackpbase));
+	/* A space that never got loaded has no regions to free */
+	if (as->as_pbase1 != 0) {
+		kfree((void *)PADDR_TO_KVADDR(as->as_pbase1));
+	}
+	if (as->as_pbase2 != 0) {
+		kfree((void *)PADDR_TO_KVADDR(as->as_pbase2));
+	}
+	if (as->as_stackpbase != 0) {
+		kfree((void *)PADDR_TO_KVADDR(as->as_stackpbase));
+	}
 #endif
  	kfree(as);
 }
@@ -484,10 +587,165 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+/*
+ * Does [START, END) overlap either region?
+ */
+static
+bool
+as_overlapsregion(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	if (as->as_vbase1 != 0 && start < as->as_vbase1 +
+	    as->as_npages1 * PAGE_SIZE && end > as->as_vbase1) {
+		return true;
+	}
+	if (as->as_vbase2 != 0 && start < as->as_vbase2 +
+	    as->as_npages2 * PAGE_SIZE && end > as->as_vbase2) {
+		return true;
+	}
+	return false;
+}
+
+int
+as_map(struct addrspace *as, size_t len, struct vnode *vn, off_t offset,
+       vaddr_t *ret)
+{
+	struct as_mapping *map, **pp;
+	vaddr_t base;
+	size_t npages;
+
+	KASSERT(offset % PAGE_SIZE == 0);
+
+	if (len == 0) {
+		return EINVAL;
+	}
+	npages = DIVROUNDUP(len, PAGE_SIZE);
+
+	/* First fit, keeping the list in address order */
+	base = DUMBVM_MAPBASE;
+	for (pp = &as->as_maps; *pp != NULL; pp = &(*pp)->am_next) {
+		if (npages <= ((*pp)->am_base - base) / PAGE_SIZE) {
+			break;
+		}
+		base = (*pp)->am_base + (*pp)->am_npages * PAGE_SIZE;
+	}
+	if (npages > (DUMBVM_MAPTOP - base) / PAGE_SIZE ||
+	    as_overlapsregion(as, base, base + npages * PAGE_SIZE)) {
+		return ENOMEM;
+	}
+
+	map = kmalloc(sizeof(*map));
+	if (map == NULL) {
+		return ENOMEM;
+	}
+	map->am_base = base;
+	map->am_npages = npages;
+	VOP_INCREF(vn);
+	map->am_vn = vn;
+	map->am_offset = offset;
+	map->am_next = *pp;
+	*pp = map;
+
+	*ret = base;
+	return 0;
+}
+
+void
+as_prefault(struct addrspace *as, vaddr_t addr, size_t len)
+{
+	struct as_mapping *map;
+	vaddr_t start, end, mapend, va;
+	paddr_t paddr;
+
+	if (len == 0 || addr >= USERSPACETOP) {
+		return;
+	}
+	start = addr & PAGE_FRAME;
+	end = len > USERSPACETOP - addr ? USERSPACETOP : addr + len;
+
+	for (map = as->as_maps; map != NULL; map = map->am_next) {
+		mapend = map->am_base + map->am_npages * PAGE_SIZE;
+		if (mapend <= start || map->am_base >= end) {
+			continue;
+		}
+		va = start > map->am_base ? start : map->am_base;
+		for (; va < end && va < mapend; va += PAGE_SIZE) {
+			/* Errors show up again when the page is touched */
+			(void)VOP_MMAP(map->am_vn,
+				       map->am_offset + (va - map->am_base),
+				       true, &paddr);
+		}
+	}
+}
+
+int
+as_unmap(struct addrspace *as, vaddr_t addr, size_t len)
+{
+	struct as_mapping *map, *rest, **pp;
+	vaddr_t end, mapend;
+	int result = 0;
+
+	if (addr % PAGE_SIZE != 0 || len == 0 || addr >= USERSPACETOP ||
+	    len > USERSPACETOP - addr) {
+		return EINVAL;
+	}
+	end = addr + ROUNDUP(len, PAGE_SIZE);
+
+	pp = &as->as_maps;
+	while ((map = *pp) != NULL) {
+		mapend = map->am_base + map->am_npages * PAGE_SIZE;
+		if (mapend <= addr || map->am_base >= end) {
+			/* not touched */
+			pp = &map->am_next;
+		}
+		else if (map->am_base < addr && mapend > end) {
+			/* hole in the middle; split off the part after it */
+			rest = kmalloc(sizeof(*rest));
+			if (rest == NULL) {
+				result = ENOMEM;
+				break;
+			}
+			rest->am_base = end;
+			rest->am_npages = (mapend - end) / PAGE_SIZE;
+			VOP_INCREF(map->am_vn);
+			rest->am_vn = map->am_vn;
+			rest->am_offset = map->am_offset + (end - map->am_base);
+			rest->am_next = map->am_next;
+			map->am_next = rest;
+			map->am_npages = (addr - map->am_base) / PAGE_SIZE;
+			pp = &rest->am_next;
+		}
+		else if (map->am_base < addr) {
+			/* keep the front */
+			map->am_npages = (addr - map->am_base) / PAGE_SIZE;
+			pp = &map->am_next;
+		}
+		else if (mapend > end) {
+			/* keep the back */
+			map->am_offset += end - map->am_base;
+			map->am_npages = (mapend - end) / PAGE_SIZE;
+			map->am_base = end;
+			pp = &map->am_next;
+		}
+		else {
+			/* all of it */
+			*pp = map->am_next;
+			VOP_DECREF(map->am_vn);
+			kfree(map);
+		}
+	}
+
+	/* Forget the translations (as_activate just empties the TLB) */
+	if (as == curproc_getas()) {
+		as_activate();
+	}
+	return result;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
 	struct addrspace *new;
+	struct as_mapping *map, *newmap, **tail;
 
 	new = as_create();
 	if (new==NULL) {
@@ -520,6 +778,21 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase),
 		(const void *)PADDR_TO_KVADDR(old->as_stackpbase),
 		DUMBVM_STACKPAGES*PAGE_SIZE);
+
+	/* Mappings are shared: the pages belong to the file */
+	tail = &new->as_maps;
+	for (map = old->as_maps; map != NULL; map = map->am_next) {
+		newmap = kmalloc(sizeof(*newmap));
+		if (newmap == NULL) {
+			as_destroy(new);
+			return ENOMEM;
+		}
+		*newmap = *map;
+		VOP_INCREF(newmap->am_vn);
+		newmap->am_next = NULL;
+		*tail = newmap;
+		tail = &newmap->am_next;
+	}
 	
 	*ret = new;
 	return 0;
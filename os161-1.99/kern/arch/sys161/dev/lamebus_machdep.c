@@ -30,10 +30,12 @@
 #include <types.h>
 #include <kern/unistd.h>
 #include <lib.h>
+#include <mips/specialreg.h>
 #include <mips/trapframe.h>
 #include <cpu.h>
 #include <spl.h>
 #include <clock.h>
+#include <prof.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
@@ -270,6 +272,8 @@ mainbus_interrupt(struct trapframe *tf)
 	else if (cause & MIPS_TIMER_BIT) {
 		/* Reset the timer (this clears the interrupt) */
 		mips_timer_set(CPU_FREQUENCY / HZ);
+		/* sample where we were, for the profiler */
+		prof_sample(tf->tf_epc, (tf->tf_status & CST_KUp) != 0);
 		/* and call hardclock */
 		hardclock();
 	}
@@ -48,6 +48,14 @@
  *
  * Note that we have no input buffering; characters typed too rapidly
  * will be lost.
+ *
+ * Output in interrupt mode is buffered: characters go into a ring of
+ * CONSOLE_OUTPUT_BUFFER_SIZE, and the device's write-done interrupt
+ * (con_start) sends the next one, so writers only wait when the ring
+ * is full. Writes to con: copy the user's data in large pieces and
+ * queue them a piece at a time. Before printing by polling, the ring
+ * is drained (also by polling), so output comes out in order, and
+ * what was queued before a panic or shutdown isn't lost.
  */
 
 #include <types.h>
@@ -57,6 +65,7 @@
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
 #include <generic/console.h>
 #include <vfs.h>
 #include <device.h>
@@ -109,6 +118,84 @@ flush_delay_buf(void)
 	delayed_outbuf_pos = 0;
 }
 
+/*
+ * Size of the pieces writes to con: are copied in by.
+ */
+#define CON_WRITECHUNK  128
+
+//////////////////////////////////////////////////
+
+/* Number of characters in the output ring */
+static
+unsigned
+con_outcount(struct con_softc *cs)
+{
+	return (cs->cs_outchars_head + CONSOLE_OUTPUT_BUFFER_SIZE
+		- cs->cs_outchars_tail) % CONSOLE_OUTPUT_BUFFER_SIZE;
+}
+
+/*
+ * Take the next character off the output ring; it must not be empty.
+ */
+static
+int
+con_outnext(struct con_softc *cs)
+{
+	unsigned char ch;
+
+	KASSERT(spinlock_do_i_hold(&cs->cs_outlock));
+	KASSERT(cs->cs_outchars_head != cs->cs_outchars_tail);
+
+	ch = cs->cs_outchars[cs->cs_outchars_tail];
+	cs->cs_outchars_tail =
+		(cs->cs_outchars_tail + 1) % CONSOLE_OUTPUT_BUFFER_SIZE;
+	return ch;
+}
+
+/*
+ * Print LEN characters from BUF through the output ring, waiting for
+ * room as needed. If CRLF is set, turn newlines into CR-LF pairs.
+ */
+static
+void
+con_write_intr(struct con_softc *cs, const char *buf, size_t len, bool crlf)
+{
+	unsigned nexthead;
+	size_t i;
+	bool needcr = false;
+
+	spinlock_acquire(&cs->cs_outlock);
+	i = 0;
+	while (i < len) {
+		nexthead = (cs->cs_outchars_head + 1)
+			% CONSOLE_OUTPUT_BUFFER_SIZE;
+		if (nexthead == cs->cs_outchars_tail) {
+			/* Full; con_start wakes us when it's half empty */
+			KASSERT(cs->cs_outbusy);
+			wchan_sleep(cs->cs_outwchan);
+			spinlock_acquire(&cs->cs_outlock);
+			continue;
+		}
+
+		if (crlf && buf[i] == '\n' && !needcr) {
+			cs->cs_outchars[cs->cs_outchars_head] = '\r';
+			needcr = true;
+		}
+		else {
+			cs->cs_outchars[cs->cs_outchars_head] = buf[i];
+			needcr = false;
+			i++;
+		}
+		cs->cs_outchars_head = nexthead;
+
+		if (!cs->cs_outbusy) {
+			cs->cs_outbusy = true;
+			cs->cs_send(cs->cs_devdata, con_outnext(cs));
+		}
+	}
+	spinlock_release(&cs->cs_outlock);
+}
+
 //////////////////////////////////////////////////
 
 /*
@@ -129,6 +216,18 @@ putch_prepare_polled(struct con_softc *cs)
 	if (cs->cs_startpolling != NULL) {
 		cs->cs_startpolling(cs->cs_devdata);
 	}
+
+	/*
+	 * Send whatever is still in the output ring first. (Unless
+	 * we're here because something went wrong in the ring code.)
+	 */
+	if (!spinlock_do_i_hold(&cs->cs_outlock)) {
+		spinlock_acquire(&cs->cs_outlock);
+		while (cs->cs_outchars_head != cs->cs_outchars_tail) {
+			putch_polled(cs, con_outnext(cs));
+		}
+		spinlock_release(&cs->cs_outlock);
+	}
 }
 
 static
@@ -149,8 +248,9 @@ static
 void
 putch_intr(struct con_softc *cs, int ch)
 {
-	P(cs->cs_wsem);
-	cs->cs_send(cs->cs_devdata, ch);
+	char c = ch;
+
+	con_write_intr(cs, &c, 1, false);
 }
 
 /*
@@ -204,7 +304,17 @@ con_start(void *vcs)
 {
 	struct con_softc *cs = vcs;
 
-	V(cs->cs_wsem);
+	spinlock_acquire(&cs->cs_outlock);
+	if (cs->cs_outchars_head == cs->cs_outchars_tail) {
+		cs->cs_outbusy = false;
+	}
+	else {
+		cs->cs_send(cs->cs_devdata, con_outnext(cs));
+	}
+	if (con_outcount(cs) <= CONSOLE_OUTPUT_BUFFER_SIZE / 2) {
+		wchan_wakeall(cs->cs_outwchan);
+	}
+	spinlock_release(&cs->cs_outlock);
 }
 
 //////////////////////////////////////////////////
@@ -304,9 +414,10 @@ con_io(struct device *dev, struct uio *uio)
 {
 	int result;
 	char ch;
+	char buf[CON_WRITECHUNK];
+	size_t len;
 	struct lock *lk;
-
-	(void)dev;  // unused
+	struct con_softc *cs = dev->d_data;
 
 	if (uio->uio_rw==UIO_READ) {
 		lk = con_userlock_read;
@@ -334,15 +445,16 @@ con_io(struct device *dev, struct uio *uio)
 			}
 		}
 		else {
-			result = uiomove(&ch, 1, uio);
+			len = uio->uio_resid;
+			if (len > sizeof(buf)) {
+				len = sizeof(buf);
+			}
+			result = uiomove(buf, len, uio);
 			if (result) {
 				lock_release(lk);
 				return result;
 			}
-			if (ch=='\n') {
-				putch('\r');
-			}
-			putch(ch);
+			con_write_intr(cs, buf, len, true);
 		}
 	}
 	lock_release(lk);
@@ -375,6 +487,7 @@ attach_console_to_vfs(struct con_softc *cs)
 	dev->d_open = con_open;
 	dev->d_close = con_close;
 	dev->d_io = con_io;
+	dev->d_aio = NULL;
 	dev->d_ioctl = con_ioctl;
 	dev->d_blocks = 0;
 	dev->d_blocksize = 1;
@@ -398,7 +511,8 @@ attach_console_to_vfs(struct con_softc *cs)
 int
 config_con(struct con_softc *cs, int unit)
 {
-	struct semaphore *rsem, *wsem;
+	struct semaphore *rsem;
+	struct wchan *wc;
 	struct lock *rlk, *wlk;
 
 	/*
@@ -418,29 +532,36 @@ config_con(struct con_softc *cs, int unit)
 	if (rsem == NULL) {
 		return ENOMEM;
 	}
-	wsem = sem_create("console write", 1);
-	if (wsem == NULL) {
+	spinlock_init(&cs->cs_outlock);
+	wc = wchan_create_interlocked("console write", &cs->cs_outlock);
+	if (wc == NULL) {
+		spinlock_cleanup(&cs->cs_outlock);
 		sem_destroy(rsem);
 		return ENOMEM;
 	}
 	rlk = lock_create("console-lock-read");
 	if (rlk == NULL) {
 		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(wc);
+		spinlock_cleanup(&cs->cs_outlock);
 		return ENOMEM;
 	}
 	wlk = lock_create("console-lock-write");
 	if (wlk == NULL) {
 		lock_destroy(rlk);
 		sem_destroy(rsem);
-		sem_destroy(wsem);
+		wchan_destroy(wc);
+		spinlock_cleanup(&cs->cs_outlock);
 		return ENOMEM;
 	}
 
 	cs->cs_rsem = rsem; 
-	cs->cs_wsem = wsem; 
 	cs->cs_gotchars_head = 0;
 	cs->cs_gotchars_tail = 0;
+	cs->cs_outwchan = wc;
+	cs->cs_outchars_head = 0;
+	cs->cs_outchars_tail = 0;
+	cs->cs_outbusy = false;
 
 	the_console = cs;
 	con_userlock_read = rlk;
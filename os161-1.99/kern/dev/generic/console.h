@@ -37,7 +37,10 @@
  * device, and are to be initialized by the attach routine.
  */
 
+#include <spinlock.h>
+
 #define CONSOLE_INPUT_BUFFER_SIZE 32
+#define CONSOLE_OUTPUT_BUFFER_SIZE 1024
 
 struct con_softc {
 	/* initialized by attach routine */
@@ -49,10 +52,17 @@ struct con_softc {
 
 	/* initialized by config routine */
 	struct semaphore *cs_rsem;
-	struct semaphore *cs_wsem;
 	unsigned char cs_gotchars[CONSOLE_INPUT_BUFFER_SIZE];
 	unsigned cs_gotchars_head;	/* next slot to put a char in */
 	unsigned cs_gotchars_tail;	/* next slot to take a char out */
+
+	/* output ring; protected by cs_outlock */
+	struct spinlock cs_outlock;
+	struct wchan *cs_outwchan;	/* waiting for room in the ring */
+	unsigned char cs_outchars[CONSOLE_OUTPUT_BUFFER_SIZE];
+	unsigned cs_outchars_head;	/* next slot to put a char in */
+	unsigned cs_outchars_tail;	/* next slot to take a char out */
+	bool cs_outbusy;		/* device is sending a char */
 };
 
 /*
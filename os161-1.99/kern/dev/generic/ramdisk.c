@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * RAM-backed block device.
+ *
+ * A ramdisk is a run of physical pages taken from the coremap with
+ * alloc_kpages and used as a disk: rd0, rd1, ..., mountable like
+ * lhd0 (and formatted in the kernel with the menu's mkfs command,
+ * since there's nowhere to run mksfs on it from before it exists).
+ * Transfers are a uiomove straight to or from the pages, so there is
+ * no seek or rotational delay, and no interrupt to wait for; there's
+ * no d_aio, since dev_aio doing the copy on the spot is as good as it
+ * gets. Concurrent transfers need no locking: like a real disk, what
+ * overlapping writes leave behind is the file system's problem.
+ *
+ * Ramdisks are created from the kernel menu (or, being menu commands,
+ * the kernel's boot arguments) and last until shutdown.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <vm.h>
+#include <vfs.h>
+#include <generic/ramdisk.h>
+
+/* Next unit number; protected by the vfs big lock */
+static unsigned ramdisk_nextunit;
+
+static
+int
+ramdisk_open(struct device *d, int openflags)
+{
+	(void)d;
+	(void)openflags;
+	return 0;
+}
+
+static
+int
+ramdisk_close(struct device *d)
+{
+	(void)d;
+	return 0;
+}
+
+/*
+ * I/O function (for both reads and writes)
+ */
+static
+int
+ramdisk_io(struct device *d, struct uio *uio)
+{
+	struct ramdisk_softc *rd = d->d_data;
+	uint32_t sector, nsects;
+
+	/* Don't allow I/O that isn't sector-aligned. */
+	if (uio->uio_offset % RAMDISK_SECTSIZE != 0 ||
+	    uio->uio_resid % RAMDISK_SECTSIZE != 0) {
+		return EINVAL;
+	}
+
+	/* Don't allow I/O past the end of the disk. */
+	sector = uio->uio_offset / RAMDISK_SECTSIZE;
+	nsects = uio->uio_resid / RAMDISK_SECTSIZE;
+	if (sector > rd->rd_nsects || nsects > rd->rd_nsects - sector) {
+		return EINVAL;
+	}
+
+	return uiomove(rd->rd_data + (size_t)sector * RAMDISK_SECTSIZE,
+		       uio->uio_resid, uio);
+}
+
+static
+int
+ramdisk_ioctl(struct device *d, int op, userptr_t data)
+{
+	(void)d;
+	(void)op;
+	(void)data;
+	return EIOCTL;
+}
+
+/*
+ * Create a ramdisk; see ramdisk.h.
+ */
+int
+ramdisk_create(uint32_t nsects)
+{
+	struct ramdisk_softc *rd;
+	unsigned npages;
+	vaddr_t data;
+	char name[32];
+	int result;
+
+	if (nsects == 0 || nsects > 0xffffffff / RAMDISK_SECTSIZE) {
+		return EINVAL;
+	}
+	npages = DIVROUNDUP((size_t)nsects * RAMDISK_SECTSIZE, PAGE_SIZE);
+
+	rd = kmalloc(sizeof(*rd));
+	if (rd == NULL) {
+		return ENOMEM;
+	}
+	data = alloc_kpages(npages);
+	if (data == 0) {
+		kfree(rd);
+		return ENOMEM;
+	}
+	rd->rd_data = (char *)data;
+	rd->rd_nsects = nsects;
+	bzero(rd->rd_data, (size_t)nsects * RAMDISK_SECTSIZE);
+
+	rd->rd_dev.d_open = ramdisk_open;
+	rd->rd_dev.d_close = ramdisk_close;
+	rd->rd_dev.d_io = ramdisk_io;
+	rd->rd_dev.d_aio = NULL;
+	rd->rd_dev.d_ioctl = ramdisk_ioctl;
+	rd->rd_dev.d_blocks = nsects;
+	rd->rd_dev.d_blocksize = RAMDISK_SECTSIZE;
+	rd->rd_dev.d_data = rd;
+
+	vfs_biglock_acquire();
+	rd->rd_unit = ramdisk_nextunit;
+	snprintf(name, sizeof(name), "rd%u", rd->rd_unit);
+	result = vfs_adddev(name, &rd->rd_dev, 1);
+	if (result) {
+		vfs_biglock_release();
+		free_kpages(data);
+		kfree(rd);
+		return result;
+	}
+	ramdisk_nextunit++;
+	vfs_biglock_release();
+
+	kprintf("%s: %u sectors (%uK) of memory\n", name, nsects,
+		nsects * RAMDISK_SECTSIZE / 1024);
+	return 0;
+}
@@ -0,0 +1,506 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Striped (RAID-0) block device.
+ *
+ * Presents several mountable disks as one device, stripeN, whose
+ * sectors are dealt out to the disks in turn, st_unitsize at a time:
+ * stripe unit U (sectors U*unitsize up to (U+1)*unitsize) is unit
+ * U/ndisks on disk U%ndisks. Each disk contributes the same number of
+ * whole units, so any extra space on larger disks goes unused.
+ *
+ * A transfer is split into one piece per stripe unit it touches, and
+ * all the pieces are started at once with dev_aio, so the disks work
+ * in parallel; the transfer is done when the last piece is. d_io
+ * does this through a kernel buffer, since the pieces are finished
+ * from interrupt handlers that can't get at a user buffer, a window
+ * of up to STRIPE_MAXIO bytes at a time.
+ *
+ * The disks are claimed from the VFS (vfs_claimdev) so they can't be
+ * mounted by themselves, but their raw devices remain reachable;
+ * writing to them directly will corrupt the stripe set.
+ *
+ * Stripe sets are created from the kernel menu and last until
+ * shutdown.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <vfs.h>
+#include <generic/stripe.h>
+
+/* Biggest window for synchronous transfers, in bytes */
+#define STRIPE_MAXIO	(64 * 1024)
+
+/* Next unit number; protected by the vfs big lock */
+static unsigned stripe_nextunit;
+
+/*
+ * One asynchronous transfer in progress, and its pieces.
+ */
+struct stripe_io {
+	struct spinlock si_lock;
+	unsigned si_pending;		/* pieces not done, +1 while starting */
+	int si_result;			/* first error */
+	struct device_aio *si_aio;	/* the whole transfer */
+	struct device_aio *si_pieces;	/* one per stripe unit touched */
+};
+
+/*
+ * Find where sector SECTOR of stripe set ST lives: the disk, the
+ * sector on that disk, and how many sectors from there on are on the
+ * same disk before the next stripe unit.
+ */
+static
+void
+stripe_map(struct stripe_softc *st, uint32_t sector,
+	   unsigned *disk, uint32_t *dsector, uint32_t *run)
+{
+	uint32_t unit, within;
+
+	unit = sector / st->st_unitsize;
+	within = sector % st->st_unitsize;
+
+	*disk = unit % st->st_ndisks;
+	*dsector = (unit / st->st_ndisks) * st->st_unitsize + within;
+	*run = st->st_unitsize - within;
+}
+
+/*
+ * Check that a transfer of LEN bytes at OFFSET is sector-aligned and
+ * within the device, and convert it to sectors.
+ */
+static
+int
+stripe_checkio(struct stripe_softc *st, off_t offset, size_t len,
+	       uint32_t *sector, uint32_t *nsects)
+{
+	uint32_t bsize = st->st_dev.d_blocksize;
+
+	if (offset % bsize != 0 || len % bsize != 0) {
+		return EINVAL;
+	}
+	*sector = offset / bsize;
+	*nsects = len / bsize;
+	if (*sector > st->st_dev.d_blocks ||
+	    *nsects > st->st_dev.d_blocks - *sector) {
+		return EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * Note that one piece of SI is done (or, once all are started, that
+ * starting them is), and if that was the last, finish the transfer.
+ * May be called from an interrupt handler.
+ */
+static
+void
+stripe_finish(struct stripe_io *si, int result)
+{
+	struct device_aio *aio;
+	bool last;
+
+	spinlock_acquire(&si->si_lock);
+	if (result != 0 && si->si_result == 0) {
+		si->si_result = result;
+	}
+	KASSERT(si->si_pending > 0);
+	si->si_pending--;
+	last = (si->si_pending == 0);
+	spinlock_release(&si->si_lock);
+
+	if (!last) {
+		return;
+	}
+
+	aio = si->si_aio;
+	result = si->si_result;
+	spinlock_cleanup(&si->si_lock);
+	kfree(si->si_pieces);
+	kfree(si);
+
+	aio->da_done(aio, result);
+}
+
+/*
+ * Completion function for the pieces.
+ */
+static
+void
+stripe_piecedone(struct device_aio *piece, int result)
+{
+	stripe_finish(piece->da_data, result);
+}
+
+/*
+ * Asynchronous I/O function: start all the pieces of AIO.
+ */
+static
+int
+stripe_aio(struct device *d, struct device_aio *aio)
+{
+	struct stripe_softc *st = d->d_data;
+	uint32_t bsize = st->st_dev.d_blocksize;
+	struct stripe_io *si;
+	struct device_aio *p;
+	uint32_t sector, nsects, left, dsector, run;
+	unsigned i, npieces, disk;
+	char *buf;
+	int result;
+
+	result = stripe_checkio(st, aio->da_offset, aio->da_len,
+				&sector, &nsects);
+	if (result) {
+		return result;
+	}
+	if (nsects == 0) {
+		return EINVAL;
+	}
+
+	/* Count the stripe units touched */
+	npieces = 0;
+	for (left = nsects; left > 0; left -= run) {
+		run = st->st_unitsize - (sector + nsects - left) %
+			st->st_unitsize;
+		if (run > left) {
+			run = left;
+		}
+		npieces++;
+	}
+
+	si = kmalloc(sizeof(*si));
+	if (si == NULL) {
+		return ENOMEM;
+	}
+	si->si_pieces = kmalloc(npieces * sizeof(struct device_aio));
+	if (si->si_pieces == NULL) {
+		kfree(si);
+		return ENOMEM;
+	}
+	spinlock_init(&si->si_lock);
+	si->si_pending = npieces + 1;
+	si->si_result = 0;
+	si->si_aio = aio;
+
+	/*
+	 * Start the pieces. Some may finish before we're done here;
+	 * the extra count in si_pending keeps SI around until then.
+	 */
+	buf = aio->da_buf;
+	left = nsects;
+	for (i=0; i<npieces; i++) {
+		stripe_map(st, sector, &disk, &dsector, &run);
+		if (run > left) {
+			run = left;
+		}
+
+		p = &si->si_pieces[i];
+		p->da_buf = buf;
+		p->da_offset = (off_t)dsector * bsize;
+		p->da_len = run * bsize;
+		p->da_write = aio->da_write;
+		p->da_done = stripe_piecedone;
+		p->da_data = si;
+
+		result = dev_aio(st->st_disks[disk], p);
+		if (result) {
+			stripe_finish(si, result);
+		}
+
+		buf += run * bsize;
+		sector += run;
+		left -= run;
+	}
+	KASSERT(left == 0);
+
+	stripe_finish(si, 0);
+	return 0;
+}
+
+/*
+ * Waiting for a synchronous transfer.
+ */
+struct stripe_wait {
+	struct semaphore *sw_sem;
+	int sw_result;
+};
+
+static
+void
+stripe_syncdone(struct device_aio *aio, int result)
+{
+	struct stripe_wait *sw = aio->da_data;
+
+	sw->sw_result = result;
+	V(sw->sw_sem);
+}
+
+/*
+ * I/O function (for both reads and writes)
+ *
+ * The caller's uio is only advanced over data that has actually been
+ * transferred. For a read that's natural; for a write the data has
+ * to be copied into the buffer before the disks see it, so it's
+ * copied through a scratch uio with its own copy of the iovecs, and
+ * the caller's uio is brought up to date from that once the disks
+ * are done.
+ */
+static
+int
+stripe_io(struct device *d, struct uio *uio)
+{
+	struct stripe_softc *st = d->d_data;
+	struct stripe_wait sw;
+	struct device_aio aio;
+	struct uio wuio;
+	struct iovec *wiov = NULL;
+	uint32_t sector, nsects;
+	size_t bufsize, len;
+	bool iswrite = (uio->uio_rw == UIO_WRITE);
+	char *buf;
+	int result;
+
+	result = stripe_checkio(st, uio->uio_offset, uio->uio_resid,
+				&sector, &nsects);
+	if (result) {
+		return result;
+	}
+	if (nsects == 0) {
+		return 0;
+	}
+
+	/* A full stripe at a time, if it fits, keeps all disks busy */
+	bufsize = st->st_unitsize * st->st_ndisks * st->st_dev.d_blocksize;
+	if (bufsize > STRIPE_MAXIO) {
+		bufsize = STRIPE_MAXIO;
+	}
+	if (bufsize > uio->uio_resid) {
+		bufsize = uio->uio_resid;
+	}
+
+	buf = kmalloc(bufsize);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+	if (iswrite) {
+		wiov = kmalloc(uio->uio_iovcnt * sizeof(struct iovec));
+		if (wiov == NULL) {
+			kfree(buf);
+			return ENOMEM;
+		}
+	}
+	sw.sw_sem = sem_create("stripe", 0);
+	if (sw.sw_sem == NULL) {
+		if (wiov != NULL) {
+			kfree(wiov);
+		}
+		kfree(buf);
+		return ENOMEM;
+	}
+
+	while (uio->uio_resid > 0) {
+		len = uio->uio_resid < bufsize ? uio->uio_resid : bufsize;
+
+		aio.da_buf = buf;
+		aio.da_offset = uio->uio_offset;
+		aio.da_len = len;
+		aio.da_write = iswrite;
+		aio.da_done = stripe_syncdone;
+		aio.da_data = &sw;
+
+		if (iswrite) {
+			/* wiov has room: uio_iovcnt only ever goes down */
+			memcpy(wiov, uio->uio_iov,
+			       uio->uio_iovcnt * sizeof(struct iovec));
+			wuio = *uio;
+			wuio.uio_iov = wiov;
+			result = uiomove(buf, len, &wuio);
+			if (result) {
+				break;
+			}
+		}
+
+		result = stripe_aio(d, &aio);
+		if (result) {
+			break;
+		}
+		P(sw.sw_sem);
+		result = sw.sw_result;
+		if (result) {
+			break;
+		}
+
+		if (iswrite) {
+			/* Written; now the caller's uio can move on */
+			memcpy(uio->uio_iov, wiov,
+			       uio->uio_iovcnt * sizeof(struct iovec));
+			uio->uio_iov += wuio.uio_iov - wiov;
+			uio->uio_iovcnt = wuio.uio_iovcnt;
+			uio->uio_offset = wuio.uio_offset;
+			uio->uio_resid = wuio.uio_resid;
+		}
+		else {
+			result = uiomove(buf, len, uio);
+			if (result) {
+				break;
+			}
+		}
+	}
+
+	sem_destroy(sw.sw_sem);
+	if (wiov != NULL) {
+		kfree(wiov);
+	}
+	kfree(buf);
+	return result;
+}
+
+static
+int
+stripe_open(struct device *d, int openflags)
+{
+	(void)d;
+	(void)openflags;
+	return 0;
+}
+
+static
+int
+stripe_close(struct device *d)
+{
+	(void)d;
+	return 0;
+}
+
+static
+int
+stripe_ioctl(struct device *d, int op, userptr_t data)
+{
+	(void)d;
+	(void)op;
+	(void)data;
+	return EIOCTL;
+}
+
+/*
+ * Create a stripe set; see stripe.h.
+ */
+int
+stripe_create(uint32_t unitsize, unsigned ndisks, char **names)
+{
+	struct stripe_softc *st;
+	uint32_t bsize, nunits, n;
+	unsigned i, nclaimed = 0;
+	char name[32];
+	int result;
+
+	if (ndisks < 2 || ndisks > STRIPE_MAXDISKS || unitsize == 0) {
+		return EINVAL;
+	}
+
+	st = kmalloc(sizeof(*st));
+	if (st == NULL) {
+		return ENOMEM;
+	}
+
+	vfs_biglock_acquire();
+
+	for (i=0; i<ndisks; i++) {
+		st->st_names[i] = kstrdup(names[i]);
+		if (st->st_names[i] == NULL) {
+			result = ENOMEM;
+			goto fail;
+		}
+		result = vfs_claimdev(names[i], &st->st_disks[i]);
+		if (result) {
+			kfree(st->st_names[i]);
+			goto fail;
+		}
+		nclaimed++;
+	}
+
+	/* Every disk contributes as many units as the smallest has */
+	bsize = st->st_disks[0]->d_blocksize;
+	nunits = st->st_disks[0]->d_blocks / unitsize;
+	for (i=1; i<ndisks; i++) {
+		if (st->st_disks[i]->d_blocksize != bsize) {
+			result = EINVAL;
+			goto fail;
+		}
+		n = st->st_disks[i]->d_blocks / unitsize;
+		if (n < nunits) {
+			nunits = n;
+		}
+	}
+	if (nunits == 0) {
+		result = EINVAL;
+		goto fail;
+	}
+
+	st->st_unit = stripe_nextunit;
+	st->st_ndisks = ndisks;
+	st->st_unitsize = unitsize;
+
+	st->st_dev.d_open = stripe_open;
+	st->st_dev.d_close = stripe_close;
+	st->st_dev.d_io = stripe_io;
+	st->st_dev.d_aio = stripe_aio;
+	st->st_dev.d_ioctl = stripe_ioctl;
+	st->st_dev.d_blocks = nunits * unitsize * ndisks;
+	st->st_dev.d_blocksize = bsize;
+	st->st_dev.d_data = st;
+
+	snprintf(name, sizeof(name), "stripe%u", st->st_unit);
+	result = vfs_adddev(name, &st->st_dev, 1);
+	if (result) {
+		goto fail;
+	}
+	stripe_nextunit++;
+
+	vfs_biglock_release();
+
+	kprintf("%s: %u disks, %u-sector stripe unit, %u sectors\n",
+		name, ndisks, unitsize, (unsigned)st->st_dev.d_blocks);
+	return 0;
+
+ fail:
+	for (i=0; i<nclaimed; i++) {
+		vfs_unclaimdev(st->st_names[i]);
+		kfree(st->st_names[i]);
+	}
+	vfs_biglock_release();
+	kfree(st);
+	return result;
+}
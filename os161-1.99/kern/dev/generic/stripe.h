@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _GENERIC_STRIPE_H_
+#define _GENERIC_STRIPE_H_
+
+/*
+ * Striped (RAID-0) block device: several disks presented as one.
+ */
+
+#include <device.h>
+
+/* Most disks in one stripe set */
+#define STRIPE_MAXDISKS		8
+
+struct stripe_softc {
+	struct device st_dev;
+	unsigned st_unit;		/* we are stripe<unit> */
+	unsigned st_ndisks;
+	uint32_t st_unitsize;		/* sectors per disk per stripe */
+	struct device *st_disks[STRIPE_MAXDISKS];
+	char *st_names[STRIPE_MAXDISKS];
+};
+
+/*
+ * Create the next stripe set, named "stripeN", over the NDISKS
+ * mountable devices named in NAMES (without colons), interleaved
+ * every UNITSIZE sectors.
+ */
+int stripe_create(uint32_t unitsize, unsigned ndisks, char **names);
+
+#endif /* _GENERIC_STRIPE_H_ */
@@ -479,11 +479,21 @@ emufs_reclaim(struct vnode *v)
 	vfs_biglock_acquire();
 	lock_acquire(ef->ef_emu->e_lock);
 
-	if (ev->ev_v.vn_refcount != 1) {
+	/*
+	 * emufs_loadvnode may have handed out another reference after
+	 * VOP_DECREF decided to reclaim; if so, consume the one we
+	 * were given and leave the vnode alone.
+	 */
+	spinlock_acquire(&v->vn_countlock);
+	if (v->vn_refcount != 1) {
+		KASSERT(v->vn_refcount > 1);
+		v->vn_refcount--;
+		spinlock_release(&v->vn_countlock);
 		lock_release(ef->ef_emu->e_lock);
 		vfs_biglock_release();
 		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
 
 	/* emu_close retries on I/O error */
 	result = emu_close(ev->ev_emu, ev->ev_handle);
@@ -837,13 +847,19 @@ emufs_namefile(struct vnode *v, struct uio *uio)
 
 /*
  * VOP_MMAP
+ *
+ * Not supported: the host file can change behind our back, and there
+ * is nowhere to keep pages of it that would stay coherent with that.
  */
 static
 int
-emufs_mmap(struct vnode *v)
+emufs_mmap(struct vnode *v, off_t offset, bool fill, paddr_t *ret)
 {
 	(void)v;
-	return EUNIMP;
+	(void)offset;
+	(void)fill;
+	(void)ret;
+	return ENODEV;
 }
 
 //////////////////////////////
@@ -1068,6 +1084,17 @@ emufs_truncate_isdir(struct vnode *v, off_t len)
 	return ENOTDIR;
 }
 
+static
+int
+emufs_mmap_isdir(struct vnode *v, off_t offset, bool fill, paddr_t *ret)
+{
+	(void)v;
+	(void)offset;
+	(void)fill;
+	(void)ret;
+	return EISDIR;
+}
+
 //////////////////////////////
 
 /*
@@ -1124,7 +1151,7 @@ static const struct vnode_ops emufs_dirops = {
 	emufs_dir_gettype,
 	emufs_dir_tryseek,
 	emufs_void_op_isdir,  /* fsync */
-	emufs_void_op_isdir,  /* mmap */
+	emufs_mmap_isdir,
 	emufs_truncate_isdir,
 	emufs_namefile,
 
@@ -1296,6 +1323,8 @@ emufs_addtovfs(struct emu_softc *sc, const char *devname)
 	ef->ef_fs.fs_getroot = emufs_getroot;
 	ef->ef_fs.fs_unmount = emufs_unmount;
 	ef->ef_fs.fs_data = ef;
+	/* Each host open makes a new vnode */
+	ef->ef_fs.fs_uniquevnodes = false;
 
 	ef->ef_emu = sc;
 	ef->ef_root = NULL;
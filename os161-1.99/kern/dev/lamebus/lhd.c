@@ -29,13 +29,40 @@
 
 /*
  * LAMEbus hard disk (lhd) driver.
+ *
+ * The hardware does one sector at a time. Requests from different
+ * threads wait in a per-disk queue and are served a sector at a time
+ * in C-LOOK order: the next sector done is the lowest wanted at or
+ * after the one just finished, and when there are none above, the
+ * lowest wanted of all, starting a new sweep. So a run of requests
+ * for adjacent sectors is served back to back as if it were one
+ * request, without going back and forth across the disk for whoever
+ * arrived in between.
+ *
+ * A synchronous request's sectors (d_io) are transferred by the thread
+ * that asked for it, since only it can get at its uio (which may be in
+ * user space); it sleeps while the disk works. An asynchronous one's
+ * (d_aio) are transferred by whoever finds it next in line, usually
+ * the interrupt handler finishing the sector before, which copies to
+ * and from the kernel buffer itself and calls the completion function
+ * when the last sector is done. Whoever finishes a sector picks the
+ * next one, and either starts it or wakes up the thread it belongs to.
+ * Each synchronous request has its own wait channel, so only that
+ * thread is woken, not everyone else with a request queued. The
+ * channels are kept in a small per-disk pool rather than created for
+ * every request.
+ *
+ * The queue is protected by a spinlock, since the interrupt handler
+ * uses it too; the requests' wait channels are interlocked with it.
  */
 
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
-#include <synch.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <trace.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -59,6 +86,9 @@
 /* Buffer (offset within slot)  */
 #define LHD_BUFFER      32768
 
+/* All the disks, for lhd_printstats */
+static struct lhd_softc *lhd_all;
+
 /*
  * Shortcut for reading a register.
  */
@@ -94,17 +124,8 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 	return EAGAIN;
 }
 
-/*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
- */
-static
-void
-lhd_iodone(struct lhd_softc *lh, int err)
-{
-	lh->lh_result = err;
-	V(lh->lh_done);
-}
+/* Defined below */
+static void lhd_iodone(struct lhd_softc *lh, int err);
 
 /*
  * Interrupt handler for lhd.
@@ -194,87 +215,424 @@ lhd_reset(struct lhd_softc *lh)
 #endif
 
 /*
- * I/O function (for both reads and writes)
+ * Start the disk on sector SECTOR; the data, for a write, must already
+ * be in the on-card buffer.
  */
 static
-int
-lhd_io(struct device *d, struct uio *uio)
+void
+lhd_start(struct lhd_softc *lh, uint32_t sector, bool iswrite)
 {
-	struct lhd_softc *lh = d->d_data;
-
-	uint32_t sector = uio->uio_offset / LHD_SECTSIZE;
-	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
-	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
-	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
 	uint32_t statval = LHD_WORKING;
-	int result;
 
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (sector != lh->lh_head) {
+		lh->lh_nseeks++;
+		lh->lh_seekdist += sector > lh->lh_head ?
+			sector - lh->lh_head : lh->lh_head - sector;
+	}
+	lh->lh_nsects++;
+
+	TRACE(DB_DEVICE, "lhd%d: %s sector %u\n", lh->lh_unit,
+	      iswrite ? "write" : "read", sector);
+
+	if (iswrite) {
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, sector);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * Choose the request whose sector goes next (C-LOOK; see above), or
+ * NULL if the queue is empty. Among requests wanting the same sector
+ * the earliest arrival goes first.
+ */
+static
+struct lhd_req *
+lhd_pick(struct lhd_softc *lh)
+{
+	struct lhd_req *r, *best = NULL, *lowest = NULL;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	for (r = lh->lh_queue; r != NULL; r = r->r_qnext) {
+		if (lowest == NULL || r->r_next < lowest->r_next) {
+			lowest = r;
+		}
+		if (r->r_next >= lh->lh_head &&
+		    (best == NULL || r->r_next < best->r_next)) {
+			best = r;
+		}
+	}
+	return best != NULL ? best : lowest;
+}
+
+/*
+ * The disk is idle (PREV, if not NULL, having just had a sector done):
+ * pick the next request, and start its sector if it's asynchronous or
+ * wake up its owner if not.
+ */
+static
+void
+lhd_dispatch(struct lhd_softc *lh, struct lhd_req *prev)
+{
+	struct lhd_req *req;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+	KASSERT(lh->lh_active == NULL);
+
+	req = lhd_pick(lh);
+	lh->lh_active = req;
+	if (req == NULL) {
+		return;
+	}
+	if (prev != NULL && req != prev && req->r_next == lh->lh_head) {
+		/* Someone else's sector follows the last one */
+		lh->lh_merged++;
+	}
+
+	if (req->r_aio != NULL) {
+		if (req->r_aio->da_write) {
+			memcpy(lh->lh_buf, req->r_buf, LHD_SECTSIZE);
+		}
+		lhd_start(lh, req->r_next, req->r_aio->da_write);
+	}
+	else if (req != prev) {
+		wchan_wakeone(req->r_wchan);
+	}
+}
+
+/*
+ * Add REQ to the end of the queue and count it, and get the disk
+ * going if it's idle.
+ */
+static
+void
+lhd_enqueue(struct lhd_softc *lh, struct lhd_req *req)
+{
+	struct lhd_req **pp;
+	unsigned depth = 0;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->r_qnext) {
+		depth++;
+	}
+	req->r_qnext = NULL;
+	*pp = req;
+
+	lh->lh_nreqs++;
+	lh->lh_depthsum += depth;
+	if (depth > lh->lh_maxdepth) {
+		lh->lh_maxdepth = depth;
+	}
+
+	if (lh->lh_active == NULL) {
+		lhd_dispatch(lh, NULL);
+	}
+}
+
+static
+void
+lhd_dequeue(struct lhd_softc *lh, struct lhd_req *req)
+{
+	struct lhd_req **pp;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	for (pp = &lh->lh_queue; *pp != req; pp = &(*pp)->r_qnext) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = req->r_qnext;
+	req->r_qnext = NULL;
+}
+
+/*
+ * Record that a sector has been done: for a synchronous request, tell
+ * its owner; for an asynchronous one, copy out the data, and start
+ * the next sector, calling the completion function if that was the
+ * last. Called from the interrupt handler.
+ */
+static
+void
+lhd_iodone(struct lhd_softc *lh, int err)
+{
+	struct lhd_req *req;
+	struct device_aio *aio = NULL;
+
+	spinlock_acquire(&lh->lh_lock);
+	req = lh->lh_active;
+	KASSERT(req != NULL);
+
+	if (req->r_aio == NULL) {
+		req->r_result = err;
+		req->r_sectdone = true;
+		wchan_wakeone(req->r_wchan);
+		spinlock_release(&lh->lh_lock);
+		return;
+	}
+
+	if (err == 0 && !req->r_aio->da_write) {
+		memcpy(req->r_buf, lh->lh_buf, LHD_SECTSIZE);
+	}
+	lh->lh_head = req->r_next + 1;
+	req->r_next++;
+	req->r_buf += LHD_SECTSIZE;
+	if (err != 0 || req->r_next == req->r_end) {
+		lhd_dequeue(lh, req);
+		aio = req->r_aio;
+	}
+	lh->lh_active = NULL;
+	lhd_dispatch(lh, req);
+	spinlock_release(&lh->lh_lock);
+
+	if (aio != NULL) {
+		kfree(req);
+		aio->da_done(aio, err);
+	}
+}
+
+/*
+ * Check that a transfer of LEN bytes at OFFSET is sector-aligned and
+ * within the disk, and convert it to sectors.
+ */
+static
+int
+lhd_checkio(struct lhd_softc *lh, off_t offset, size_t len,
+	    uint32_t *sector, uint32_t *nsects)
+{
 	/* Don't allow I/O that isn't sector-aligned. */
-	if (sectoff != 0 || lenoff != 0) {
+	if (offset % LHD_SECTSIZE != 0 || len % LHD_SECTSIZE != 0) {
 		return EINVAL;
 	}
 
+	*sector = offset / LHD_SECTSIZE;
+	*nsects = len / LHD_SECTSIZE;
+
 	/* Don't allow I/O past the end of the disk. */
-	if (sector+len > lh->lh_dev.d_blocks) {
+	if (*sector + *nsects > lh->lh_dev.d_blocks) {
 		return EINVAL;
 	}
+	return 0;
+}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
+/*
+ * Get a wait channel for a synchronous request, from the pool if
+ * there's one there. Called with lh_lock held; may drop it.
+ */
+static
+struct wchan *
+lhd_getwchan(struct lhd_softc *lh)
+{
+	struct wchan *wc;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (lh->lh_nwchans > 0) {
+		return lh->lh_wchans[--lh->lh_nwchans];
 	}
+	spinlock_release(&lh->lh_lock);
+	wc = wchan_create_interlocked("lhd", &lh->lh_lock);
+	spinlock_acquire(&lh->lh_lock);
+	return wc;
+}
 
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
+/*
+ * Give back a request's wait channel. Called with lh_lock held;
+ * returns true if it's been kept, and otherwise the caller must
+ * destroy it once it lets go of the lock.
+ */
+static
+bool
+lhd_putwchan(struct lhd_softc *lh, struct wchan *wc)
+{
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
 
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
+	if (lh->lh_nwchans < LHD_NWCHANS) {
+		lh->lh_wchans[lh->lh_nwchans++] = wc;
+		return true;
+	}
+	return false;
+}
 
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			if (result) {
-				V(lh->lh_clear);
-				return result;
-			}
-		}
+/*
+ * I/O function (for both reads and writes)
+ */
+static
+int
+lhd_io(struct device *d, struct uio *uio)
+{
+	struct lhd_softc *lh = d->d_data;
+	struct lhd_req req;
+	uint32_t sector, len;
+	bool iswrite = (uio->uio_rw == UIO_WRITE);
+	bool done, kept;
+	int result;
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
+	result = lhd_checkio(lh, uio->uio_offset, uio->uio_resid,
+			     &sector, &len);
+	if (result) {
+		return result;
+	}
+	if (len == 0) {
+		return 0;
+	}
 
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
+	req.r_next = sector;
+	req.r_end = sector + len;
+	req.r_uio = uio;
+	req.r_aio = NULL;
+	req.r_buf = NULL;
 
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
+	spinlock_acquire(&lh->lh_lock);
+	req.r_wchan = lhd_getwchan(lh);
+	if (req.r_wchan == NULL) {
+		spinlock_release(&lh->lh_lock);
+		return ENOMEM;
+	}
+	lhd_enqueue(lh, &req);
 
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
+	do {
+		/* Wait until it's our turn. */
+		while (lh->lh_active != &req) {
+			wchan_sleep(req.r_wchan);
+			spinlock_acquire(&lh->lh_lock);
+		}
+		sector = req.r_next;
 
 		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
+		 * Are we writing? If so, transfer the data to the
+		 * on-card buffer. Nobody else touches it until we
+		 * pick the next request.
 		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
+		result = 0;
+		if (iswrite) {
+			spinlock_release(&lh->lh_lock);
 			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+			spinlock_acquire(&lh->lh_lock);
 		}
 
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
+		if (result == 0) {
+			req.r_sectdone = false;
+			lhd_start(lh, sector, iswrite);
+
+			/* Wait until the interrupt handler says it's done. */
+			while (!req.r_sectdone) {
+				wchan_sleep(req.r_wchan);
+				spinlock_acquire(&lh->lh_lock);
+			}
+			result = req.r_result;
+			lh->lh_head = sector + 1;
+
+			/*
+			 * Are we reading? If so, and if we succeeded,
+			 * transfer the data out of the on-card buffer.
+			 */
+			if (result == 0 && !iswrite) {
+				spinlock_release(&lh->lh_lock);
+				result = uiomove(lh->lh_buf, LHD_SECTSIZE,
+						 uio);
+				spinlock_acquire(&lh->lh_lock);
+			}
+		}
 
-		/* If we failed, return the error. */
-		if (result) {
-			return result;
+		req.r_next++;
+		done = (result != 0 || req.r_next == req.r_end);
+		if (done) {
+			lhd_dequeue(lh, &req);
 		}
+		lh->lh_active = NULL;
+		lhd_dispatch(lh, &req);
+	} while (!done);
+
+	kept = lhd_putwchan(lh, req.r_wchan);
+	spinlock_release(&lh->lh_lock);
+	if (!kept) {
+		wchan_destroy(req.r_wchan);
 	}
 
+	return result;
+}
+
+/*
+ * Asynchronous I/O function: queue AIO, to be done from the interrupt
+ * handler.
+ */
+static
+int
+lhd_aio(struct device *d, struct device_aio *aio)
+{
+	struct lhd_softc *lh = d->d_data;
+	struct lhd_req *req;
+	uint32_t sector, len;
+	int result;
+
+	result = lhd_checkio(lh, aio->da_offset, aio->da_len, &sector, &len);
+	if (result) {
+		return result;
+	}
+	if (len == 0) {
+		return EINVAL;
+	}
+
+	req = kmalloc(sizeof(*req));
+	if (req == NULL) {
+		return ENOMEM;
+	}
+	req->r_next = sector;
+	req->r_end = sector + len;
+	req->r_uio = NULL;
+	req->r_aio = aio;
+	req->r_buf = aio->da_buf;
+	req->r_wchan = NULL;
+
+	spinlock_acquire(&lh->lh_lock);
+	lhd_enqueue(lh, req);
+	spinlock_release(&lh->lh_lock);
+
 	return 0;
 }
 
+/*
+ * Print the queue statistics of every disk.
+ */
+void
+lhd_printstats(void)
+{
+	struct lhd_softc *lh;
+	unsigned nreqs, nsects, merged, depthsum, maxdepth, nseeks;
+	uint64_t seekdist;
+
+	for (lh = lhd_all; lh != NULL; lh = lh->lh_next) {
+		spinlock_acquire(&lh->lh_lock);
+		nreqs = lh->lh_nreqs;
+		nsects = lh->lh_nsects;
+		merged = lh->lh_merged;
+		depthsum = lh->lh_depthsum;
+		maxdepth = lh->lh_maxdepth;
+		nseeks = lh->lh_nseeks;
+		seekdist = lh->lh_seekdist;
+		spinlock_release(&lh->lh_lock);
+
+		kprintf("lhd%d: %u requests, %u sectors, %u sectors "
+			"following another request's\n",
+			lh->lh_unit, nreqs, nsects, merged);
+		kprintf("lhd%d: queue depth at arrival: avg %u.%02u, "
+			"max %u\n", lh->lh_unit,
+			nreqs > 0 ? depthsum / nreqs : 0,
+			nreqs > 0 ? depthsum * 100 / nreqs % 100 : 0,
+			maxdepth);
+		kprintf("lhd%d: %u seeks, avg distance %llu sectors\n",
+			lh->lh_unit, nseeks,
+			nseeks > 0 ? seekdist / nseeks : 0);
+	}
+}
+
 /*
  * Setup routine called by autoconf.c when an lhd is found.
  */
@@ -289,28 +647,32 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
-		return ENOMEM;
-	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
-		return ENOMEM;
-	}
+	/* Set up the queue. */
+	spinlock_init(&lh->lh_lock);
+	lh->lh_queue = NULL;
+	lh->lh_active = NULL;
+	lh->lh_nwchans = 0;
+	lh->lh_head = 0;
+	lh->lh_nreqs = lh->lh_nsects = lh->lh_merged = 0;
+	lh->lh_depthsum = lh->lh_maxdepth = 0;
+	lh->lh_nseeks = 0;
+	lh->lh_seekdist = 0;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_open = lhd_open;
 	lh->lh_dev.d_close = lhd_close;
 	lh->lh_dev.d_io = lhd_io;
+	lh->lh_dev.d_aio = lhd_aio;
 	lh->lh_dev.d_ioctl = lhd_ioctl;
 	lh->lh_dev.d_blocks = bus_read_register(lh->lh_busdata, lh->lh_buspos,
 						LHD_REG_NSECT);
 	lh->lh_dev.d_blocksize = LHD_SECTSIZE;
 	lh->lh_dev.d_data = lh;
 
+	/* Autoconf runs before anything can call lhd_printstats. */
+	lh->lh_next = lhd_all;
+	lhd_all = lh;
+
 	/* Add the VFS device structure to the VFS device list. */
 	return vfs_adddev(name, &lh->lh_dev, 1);
 }
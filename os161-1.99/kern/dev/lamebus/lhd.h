@@ -30,6 +30,7 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
 
 /*
@@ -37,6 +38,29 @@
  */
 #define LHD_SECTSIZE  512
 
+/*
+ * Wait channels kept for reuse by synchronous requests
+ */
+#define LHD_NWCHANS   8
+
+/*
+ * A request waiting in (or being served from) a disk's queue: sectors
+ * r_next through r_end-1 are still to be transferred. A synchronous
+ * request (from d_io) belongs to the thread waiting for it; an
+ * asynchronous one (from d_aio) is served from the interrupt handler.
+ */
+struct lhd_req {
+	uint32_t r_next;		/* next sector to transfer */
+	uint32_t r_end;			/* one past the last sector */
+	struct uio *r_uio;		/* sync: the caller's uio */
+	struct device_aio *r_aio;	/* async: the request, else NULL */
+	char *r_buf;			/* async: where r_next's data is */
+	struct wchan *r_wchan;		/* sync: the owner waits here */
+	bool r_sectdone;		/* sync: sector finished... */
+	int r_result;			/* ...with this result */
+	struct lhd_req *r_qnext;	/* queue link */
+};
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -51,14 +75,32 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+
+	/* Request queue (see lhd.c); protected by lh_lock */
+	struct spinlock lh_lock;
+	struct lhd_req *lh_queue;	/* requests, in arrival order */
+	struct lhd_req *lh_active;	/* whose sector is in progress */
+	struct wchan *lh_wchans[LHD_NWCHANS];	/* spare r_wchans */
+	unsigned lh_nwchans;
+	uint32_t lh_head;		/* sector after the last one done */
+
+	/* Statistics; also protected by lh_lock */
+	unsigned lh_nreqs;		/* requests queued */
+	unsigned lh_nsects;		/* sectors transferred */
+	unsigned lh_merged;		/* ...continuing another request's */
+	unsigned lh_depthsum;		/* queue length at each arrival */
+	unsigned lh_maxdepth;
+	unsigned lh_nseeks;		/* sectors not following the last */
+	uint64_t lh_seekdist;		/* total distance of those */
 
 	struct device lh_dev;		/* VFS device structure */
+	struct lhd_softc *lh_next;	/* list of all lhds */
 };
 
 /* Functions called by lower-level drivers */
 void lhd_irq(/*struct lhd_softc*/ void *);	/* Interrupt handler */
 
+/* Print queue statistics for every disk */
+void lhd_printstats(void);
+
 #endif /* _LAMEBUS_LHD_H_ */
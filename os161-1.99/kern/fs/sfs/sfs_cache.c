@@ -0,0 +1,1017 @@
+/*
+ * SFS buffer cache.
+ *
+ * A fixed pool of SFS_CACHE_NBUFS block-sized buffers shared by all
+ * mounted SFS volumes, indexed by (volume, block number) through a
+ * hash table and recycled in least-recently-used order.
+ *
+ * A buffer handed out by sfs_buf_get is busy: it belongs to the
+ * caller, nobody else can get it, and it can't be evicted, until the
+ * caller calls sfs_buf_release. Anyone else who wants the same block
+ * waits. Callers therefore hold buffers only briefly, and must not
+ * try to get a block they already hold.
+ *
+ * Writes are write-back: a modified buffer is marked dirty, along with
+ * the inode number of the file it belongs to, and goes to disk later.
+ * A flusher thread wakes up every SFS_FLUSH_NAP timer ticks and starts
+ * writing out buffers that have been dirty for SFS_FLUSH_AGE seconds,
+ * and, once more than SFS_FLUSH_HIWAT buffers are dirty, the least
+ * recently used dirty ones until only SFS_FLUSH_LOWAT are. Eviction
+ * takes the
+ * least recently used clean buffer, so as long as the flusher keeps
+ * up, whoever needs a buffer doesn't wait for a write. fsync writes
+ * just the file's buffers (sfs_buf_syncfile) and sync the volume's
+ * (sfs_buf_syncfs).
+ *
+ * The superblock and free block bitmap are kept in memory by sfs_fs
+ * and read and written directly with sfs_rblock/sfs_wblock; they
+ * never go through the cache.
+ *
+ * Read-ahead (sfs_buf_readahead) and the flusher don't wait for the
+ * disk: they hand each buffer to the device with dev_aio and go on,
+ * and the buffer stays busy until the transfer is done. The device
+ * calls back from its interrupt handler, where cache_lock can't be
+ * taken, so the completion is finished by the cache's own completion
+ * thread (sfs_buf_aiowork, from sfs_buf_iodone_thread). This can't
+ * be a shared work queue: work items sync volumes and reclaim vnodes,
+ * which wait for busy buffers, and a completion queued behind such an
+ * item would never run. Blocks read ahead are marked prefetched until
+ * first used; one recycled or dropped while still marked was read for
+ * nothing. Other I/O (cache misses, eviction, sync) is synchronous.
+ *
+ * cache_lock protects the hash chains, the LRU list, the key and
+ * flags of every buffer, and the statistics. It is not held during
+ * disk I/O: a buffer being read or written is busy instead. The list
+ * of finished transfers is protected by the spinlock cache_donelock,
+ * since the interrupt handler adds to it.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <synch.h>
+#include <vfs.h>
+#include <device.h>
+#include <sfs.h>
+
+/* Number of buffers (512 bytes each) */
+#define SFS_CACHE_NBUFS		128
+
+/* Number of hash chains; must be a power of 2 */
+#define SFS_CACHE_HASHSIZE	64
+
+/* Flusher: timer ticks between runs, and when to write what */
+#define SFS_FLUSH_NAP		10
+#define SFS_FLUSH_AGE		3	/* seconds */
+#define SFS_FLUSH_HIWAT		(SFS_CACHE_NBUFS / 2)
+#define SFS_FLUSH_LOWAT		(SFS_CACHE_NBUFS / 4)
+#define SFS_FLUSH_BATCH		16	/* most writes started per run */
+
+struct sfs_buf {
+	struct sfs_fs *b_fs;		/* volume, or NULL if unused */
+	uint32_t b_block;		/* block number on that volume */
+	void *b_data;			/* SFS_BLOCKSIZE bytes */
+	bool b_busy;			/* held by someone */
+	bool b_dirty;			/* modified since read/written */
+	bool b_prefetched;		/* read ahead, not used yet */
+	uint32_t b_ino;			/* if dirty, file it belongs to */
+	time_t b_dirtysince;		/* if dirty, when it got so */
+	struct device_aio b_aio;	/* asynchronous transfer */
+	struct sfs_buf *b_donenext;	/* ...waiting to be finished */
+	int b_ioresult;			/* ...and how it went */
+	bool b_ioathead;		/* ...where it goes in the LRU list */
+	struct sfs_buf *b_hashnext;	/* hash chain */
+	struct sfs_buf *b_lruprev;	/* LRU list (not busy only) */
+	struct sfs_buf *b_lrunext;
+};
+
+static struct lock *cache_lock;
+static struct cv *cache_cv;		/* waiting for a busy buffer */
+static struct sfs_buf *cache_bufs;
+static struct sfs_buf *cache_hash[SFS_CACHE_HASHSIZE];
+static struct sfs_buf *cache_lruhead;	/* least recently used */
+static struct sfs_buf *cache_lrutail;	/* most recently used */
+static unsigned cache_ndirty;		/* dirty buffers */
+static bool cache_flushing;		/* flushing down to SFS_FLUSH_LOWAT */
+
+/* Finished asynchronous transfers, for sfs_buf_iodone_thread */
+static struct spinlock cache_donelock;
+static struct wchan *cache_donewchan;	/* interlocked with cache_donelock */
+static struct sfs_buf *cache_donehead;
+static struct sfs_buf *cache_donetail;
+
+/* Statistics */
+static unsigned cache_hits;
+static unsigned cache_misses;
+static unsigned cache_reads;
+static unsigned cache_writes;
+static unsigned cache_directios;	/* sfs_buf_directio calls */
+static unsigned cache_directblocks;	/* blocks they transferred */
+static unsigned cache_rablocks;		/* blocks read ahead */
+static unsigned cache_rahits;		/* ...then used */
+static unsigned cache_rawaste;		/* ...then dropped unused */
+static unsigned cache_flushes;		/* blocks written by the flusher */
+static unsigned cache_stalls;		/* ...by eviction, while waiting */
+
+////////////////////////////////////////////////////////////
+//
+// Hash chains and LRU list. Called with cache_lock held.
+
+static
+unsigned
+sfs_buf_hash(struct sfs_fs *sfs, uint32_t block)
+{
+	return (block ^ ((uintptr_t)sfs >> 6)) & (SFS_CACHE_HASHSIZE-1);
+}
+
+static
+struct sfs_buf *
+sfs_buf_lookup(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_buf *b;
+
+	for (b = cache_hash[sfs_buf_hash(sfs, block)]; b; b = b->b_hashnext) {
+		if (b->b_fs == sfs && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+sfs_buf_unhash(struct sfs_buf *b)
+{
+	struct sfs_buf **pp;
+
+	KASSERT(b->b_fs != NULL);
+	pp = &cache_hash[sfs_buf_hash(b->b_fs, b->b_block)];
+	while (*pp != b) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->b_hashnext;
+	}
+	*pp = b->b_hashnext;
+	b->b_hashnext = NULL;
+	b->b_fs = NULL;
+
+	if (b->b_prefetched) {
+		cache_rawaste++;
+		b->b_prefetched = false;
+	}
+}
+
+static
+void
+sfs_buf_rehash(struct sfs_buf *b, struct sfs_fs *sfs, uint32_t block)
+{
+	unsigned h;
+
+	if (b->b_fs != NULL) {
+		sfs_buf_unhash(b);
+	}
+	b->b_fs = sfs;
+	b->b_block = block;
+	h = sfs_buf_hash(sfs, block);
+	b->b_hashnext = cache_hash[h];
+	cache_hash[h] = b;
+}
+
+static
+void
+sfs_buf_lruremove(struct sfs_buf *b)
+{
+	if (b->b_lruprev) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		KASSERT(cache_lruhead == b);
+		cache_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		KASSERT(cache_lrutail == b);
+		cache_lrutail = b->b_lruprev;
+	}
+	b->b_lruprev = b->b_lrunext = NULL;
+}
+
+/* Put B at the most-recently-used end, or the other end if ATHEAD. */
+static
+void
+sfs_buf_lruinsert(struct sfs_buf *b, bool athead)
+{
+	if (athead) {
+		b->b_lruprev = NULL;
+		b->b_lrunext = cache_lruhead;
+		if (cache_lruhead) {
+			cache_lruhead->b_lruprev = b;
+		}
+		else {
+			cache_lrutail = b;
+		}
+		cache_lruhead = b;
+	}
+	else {
+		b->b_lrunext = NULL;
+		b->b_lruprev = cache_lrutail;
+		if (cache_lrutail) {
+			cache_lrutail->b_lrunext = b;
+		}
+		else {
+			cache_lruhead = b;
+		}
+		cache_lrutail = b;
+	}
+}
+
+/* Mark B busy; it must not be already. */
+static
+void
+sfs_buf_mark_busy(struct sfs_buf *b)
+{
+	KASSERT(!b->b_busy);
+	sfs_buf_lruremove(b);
+	b->b_busy = true;
+}
+
+/* Unmark B busy, put it on the LRU list, and wake up waiters. */
+static
+void
+sfs_buf_unmark_busy(struct sfs_buf *b, bool athead)
+{
+	KASSERT(b->b_busy);
+	b->b_busy = false;
+	sfs_buf_lruinsert(b, athead);
+	cv_broadcast(cache_cv, cache_lock);
+}
+
+/* Note that B no longer needs writing back. */
+static
+void
+sfs_buf_setclean(struct sfs_buf *b)
+{
+	if (b->b_dirty) {
+		KASSERT(cache_ndirty > 0);
+		cache_ndirty--;
+		b->b_dirty = false;
+	}
+}
+
+/*
+ * Find the least recently used buffer that is clean, and so can be
+ * recycled without writing it first. Returns NULL if there isn't one.
+ */
+static
+struct sfs_buf *
+sfs_buf_victim(void)
+{
+	struct sfs_buf *b;
+
+	for (b = cache_lruhead; b != NULL; b = b->b_lrunext) {
+		if (!b->b_dirty) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Write busy buffer B out, dropping cache_lock meanwhile. Returns
+ * with cache_lock held again and B still busy, and clean unless the
+ * write failed.
+ */
+static
+int
+sfs_buf_writeout(struct sfs_buf *b)
+{
+	int result;
+
+	KASSERT(b->b_busy);
+	KASSERT(b->b_dirty);
+
+	cache_writes++;
+	lock_release(cache_lock);
+	result = sfs_wblock(b->b_fs, b->b_data, b->b_block);
+	lock_acquire(cache_lock);
+	if (result == 0) {
+		sfs_buf_setclean(b);
+	}
+	return result;
+}
+
+/*
+ * Finish an asynchronous transfer of busy buffer B. Runs in the
+ * completion thread. A buffer that failed to read is dropped; one
+ * that failed to write stays dirty, to be tried again later.
+ */
+static
+void
+sfs_buf_aiowork(struct sfs_buf *b)
+{
+	struct sfs_fs *sfs;
+
+	lock_acquire(cache_lock);
+	KASSERT(b->b_busy);
+	sfs = b->b_fs;
+
+	if (b->b_aio.da_write) {
+		if (b->b_ioresult == 0) {
+			sfs_buf_setclean(b);
+		}
+		sfs_buf_unmark_busy(b, b->b_ioathead);
+	}
+	else if (b->b_ioresult) {
+		sfs_buf_unhash(b);
+		sfs_buf_unmark_busy(b, true);
+	}
+	else {
+		b->b_prefetched = true;
+		cache_rablocks++;
+		sfs_buf_unmark_busy(b, false);
+	}
+
+	/* After this the volume may be unmounted; don't touch it again */
+	KASSERT(sfs->sfs_iopending > 0);
+	sfs->sfs_iopending--;
+	cv_broadcast(cache_cv, cache_lock);
+	lock_release(cache_lock);
+}
+
+/*
+ * Completion function for asynchronous transfers. May be called from
+ * an interrupt handler, so just hand off to the completion thread.
+ */
+static
+void
+sfs_buf_aiodone(struct device_aio *aio, int result)
+{
+	struct sfs_buf *b = aio->da_data;
+
+	spinlock_acquire(&cache_donelock);
+	b->b_ioresult = result;
+	b->b_donenext = NULL;
+	if (cache_donetail != NULL) {
+		cache_donetail->b_donenext = b;
+	}
+	else {
+		cache_donehead = b;
+	}
+	cache_donetail = b;
+	wchan_wakeone(cache_donewchan);
+	spinlock_release(&cache_donelock);
+}
+
+/*
+ * The completion thread: finish transfers as they're handed over by
+ * sfs_buf_aiodone. It only ever waits for cache_lock, which nobody
+ * holds while waiting for a transfer, so completions always get done.
+ */
+static
+void
+sfs_buf_iodone_thread(void *unused1, unsigned long unused2)
+{
+	struct sfs_buf *b;
+
+	(void)unused1;
+	(void)unused2;
+
+	spinlock_acquire(&cache_donelock);
+	while (1) {
+		while (cache_donehead == NULL) {
+			/* cache_donelock is the interlock; this drops it */
+			wchan_sleep(cache_donewchan);
+			spinlock_acquire(&cache_donelock);
+		}
+		b = cache_donehead;
+		cache_donehead = b->b_donenext;
+		if (cache_donehead == NULL) {
+			cache_donetail = NULL;
+		}
+		b->b_donenext = NULL;
+		spinlock_release(&cache_donelock);
+
+		sfs_buf_aiowork(b);
+
+		spinlock_acquire(&cache_donelock);
+	}
+}
+
+/*
+ * Start reading or writing busy buffer B, already counted in its
+ * volume's sfs_iopending, without waiting for it. Called without
+ * cache_lock, since the completion may run right away.
+ */
+static
+void
+sfs_buf_aiostart(struct sfs_buf *b, bool iswrite)
+{
+	int result;
+
+	KASSERT(!lock_do_i_hold(cache_lock));
+	KASSERT(b->b_busy);
+
+	b->b_aio.da_buf = b->b_data;
+	b->b_aio.da_offset = (off_t)b->b_block * SFS_BLOCKSIZE;
+	b->b_aio.da_len = SFS_BLOCKSIZE;
+	b->b_aio.da_write = iswrite;
+	result = sfs_aio(b->b_fs, &b->b_aio);
+	if (result) {
+		/* Never started; finish it now */
+		b->b_ioresult = result;
+		sfs_buf_aiowork(b);
+	}
+}
+
+/*
+ * One pass of the flusher: start writing back buffers dirty since
+ * before NOW - SFS_FLUSH_AGE, and, if there are too many dirty
+ * buffers, the least recently used ones, at most SFS_FLUSH_BATCH in
+ * all. Buffers written for being too many go back at the head of the
+ * LRU list, since they're the next to be recycled anyway; old ones
+ * may still be in use and go at the tail. A buffer that fails to
+ * write stays dirty and is tried again by a later pass.
+ */
+static
+void
+sfs_buf_flush(time_t now)
+{
+	struct sfs_buf *b, *next, *bufs[SFS_FLUSH_BATCH];
+	bool toomany;
+	unsigned i, n;
+
+	lock_acquire(cache_lock);
+
+	if (cache_ndirty > SFS_FLUSH_HIWAT) {
+		cache_flushing = true;
+	}
+
+	n = 0;
+	for (b = cache_lruhead; b != NULL && n < SFS_FLUSH_BATCH; b = next) {
+		next = b->b_lrunext;
+		if (!b->b_dirty) {
+			continue;
+		}
+		/* Those already started will be clean soon */
+		if (cache_flushing && cache_ndirty - n <= SFS_FLUSH_LOWAT) {
+			cache_flushing = false;
+		}
+		toomany = cache_flushing;
+		if (!toomany && now - b->b_dirtysince < SFS_FLUSH_AGE) {
+			continue;
+		}
+
+		sfs_buf_mark_busy(b);
+		b->b_ioathead = toomany;
+		b->b_fs->sfs_iopending++;
+		cache_writes++;
+		cache_flushes++;
+		bufs[n++] = b;
+	}
+
+	lock_release(cache_lock);
+
+	for (i=0; i<n; i++) {
+		sfs_buf_aiostart(bufs[i], true);
+	}
+}
+
+/*
+ * The flusher thread.
+ */
+static
+void
+sfs_buf_flusher(void *unused1, unsigned long unused2)
+{
+	time_t now;
+	uint32_t nsecs;
+
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		clocknap(SFS_FLUSH_NAP);
+		gettime(&now, &nsecs);
+		sfs_buf_flush(now);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+/*
+ * Set up the cache. Called on every mount; only the first call does
+ * anything. Mounts are serialized by the vfs big lock.
+ */
+void
+sfs_cache_bootstrap(void)
+{
+	char *data;
+	unsigned i;
+	int result;
+
+	KASSERT(vfs_biglock_do_i_hold());
+
+	if (cache_bufs != NULL) {
+		return;
+	}
+
+	cache_lock = lock_create("sfs cache");
+	cache_cv = cv_create("sfs cache");
+	spinlock_init(&cache_donelock);
+	cache_donewchan = wchan_create_interlocked("sfs iodone",
+						   &cache_donelock);
+	cache_bufs = kmalloc(SFS_CACHE_NBUFS * sizeof(struct sfs_buf));
+	data = kmalloc(SFS_CACHE_NBUFS * SFS_BLOCKSIZE);
+	if (cache_lock == NULL || cache_cv == NULL ||
+	    cache_donewchan == NULL || cache_bufs == NULL || data == NULL) {
+		panic("sfs: Out of memory creating buffer cache\n");
+	}
+
+	for (i=0; i<SFS_CACHE_NBUFS; i++) {
+		cache_bufs[i].b_fs = NULL;
+		cache_bufs[i].b_block = 0;
+		cache_bufs[i].b_data = data + i*SFS_BLOCKSIZE;
+		cache_bufs[i].b_busy = false;
+		cache_bufs[i].b_dirty = false;
+		cache_bufs[i].b_prefetched = false;
+		cache_bufs[i].b_ino = 0;
+		cache_bufs[i].b_dirtysince = 0;
+		cache_bufs[i].b_aio.da_done = sfs_buf_aiodone;
+		cache_bufs[i].b_aio.da_data = &cache_bufs[i];
+		cache_bufs[i].b_donenext = NULL;
+		cache_bufs[i].b_hashnext = NULL;
+		sfs_buf_lruinsert(&cache_bufs[i], false);
+	}
+
+	result = thread_fork("sfs iodone", NULL, sfs_buf_iodone_thread,
+			     NULL, 0);
+	if (result) {
+		panic("sfs: Cannot start completion thread: %s\n",
+		      strerror(result));
+	}
+	result = thread_fork("sfs flusher", NULL, sfs_buf_flusher, NULL, 0);
+	if (result) {
+		panic("sfs: Cannot start flusher thread: %s\n",
+		      strerror(result));
+	}
+}
+
+/*
+ * Get the buffer for block BLOCK of volume SFS, and mark it busy.
+ *
+ * If FILL is true and the block isn't cached, read it from disk. If
+ * FILL is false the caller is about to overwrite the whole block, so
+ * it isn't read; the contents are then unspecified (if the block
+ * wasn't cached) and the caller must fill them in and mark the buffer
+ * dirty.
+ */
+int
+sfs_buf_get(struct sfs_fs *sfs, uint32_t block, bool fill,
+	    struct sfs_buf **ret)
+{
+	struct sfs_buf *b;
+	int result;
+
+	KASSERT(block < sfs->sfs_super.sp_nblocks);
+
+	lock_acquire(cache_lock);
+
+ again:
+	b = sfs_buf_lookup(sfs, block);
+	if (b != NULL) {
+		if (b->b_busy) {
+			cv_wait(cache_cv, cache_lock);
+			goto again;
+		}
+		sfs_buf_mark_busy(b);
+		cache_hits++;
+		if (b->b_prefetched) {
+			cache_rahits++;
+			b->b_prefetched = false;
+		}
+		lock_release(cache_lock);
+		*ret = b;
+		return 0;
+	}
+
+	/*
+	 * Recycle the least recently used clean buffer, or if the
+	 * flusher hasn't kept up, the least recently used one.
+	 */
+	b = sfs_buf_victim();
+	if (b == NULL) {
+		b = cache_lruhead;
+	}
+	if (b == NULL) {
+		/* Everything is busy. */
+		cv_wait(cache_cv, cache_lock);
+		goto again;
+	}
+	sfs_buf_mark_busy(b);
+
+	if (b->b_dirty) {
+		/*
+		 * Write it out first. Someone may have brought our
+		 * block in meanwhile, so put the (now clean) buffer
+		 * back at the head of the LRU list and start over.
+		 */
+		cache_stalls++;
+		result = sfs_buf_writeout(b);
+		sfs_buf_unmark_busy(b, result == 0);
+		if (result) {
+			lock_release(cache_lock);
+			return result;
+		}
+		goto again;
+	}
+
+	/* Take over the buffer; it is busy so nobody can see its data. */
+	sfs_buf_rehash(b, sfs, block);
+	cache_misses++;
+
+	if (!fill) {
+		lock_release(cache_lock);
+		bzero(b->b_data, SFS_BLOCKSIZE);
+		*ret = b;
+		return 0;
+	}
+
+	cache_reads++;
+	lock_release(cache_lock);
+
+	result = sfs_rblock(sfs, b->b_data, block);
+	if (result) {
+		lock_acquire(cache_lock);
+		sfs_buf_unhash(b);
+		sfs_buf_unmark_busy(b, true);
+		lock_release(cache_lock);
+		return result;
+	}
+
+	*ret = b;
+	return 0;
+}
+
+/*
+ * Get a pointer to a busy buffer's data.
+ */
+void *
+sfs_buf_data(struct sfs_buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_data;
+}
+
+/*
+ * Note that a busy buffer has been modified, on behalf of the file
+ * whose inode is INO.
+ */
+void
+sfs_buf_markdirty(struct sfs_buf *b, uint32_t ino)
+{
+	uint32_t nsecs;
+
+	KASSERT(b->b_busy);
+
+	lock_acquire(cache_lock);
+	if (!b->b_dirty) {
+		b->b_dirty = true;
+		cache_ndirty++;
+		gettime(&b->b_dirtysince, &nsecs);
+	}
+	b->b_ino = ino;
+	lock_release(cache_lock);
+}
+
+/*
+ * Give back a buffer gotten with sfs_buf_get.
+ */
+void
+sfs_buf_release(struct sfs_buf *b)
+{
+	lock_acquire(cache_lock);
+	sfs_buf_unmark_busy(b, false);
+	lock_release(cache_lock);
+}
+
+/*
+ * Block BLOCK of volume SFS has been freed; drop it from the cache
+ * without writing it back.
+ */
+void
+sfs_buf_forget(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_buf *b;
+
+	lock_acquire(cache_lock);
+	b = sfs_buf_lookup(sfs, block);
+	if (b != NULL && !b->b_busy) {
+		sfs_buf_unhash(b);
+		sfs_buf_setclean(b);
+		sfs_buf_lruremove(b);
+		sfs_buf_lruinsert(b, true);
+	}
+	lock_release(cache_lock);
+}
+
+/*
+ * Write the dirty buffers of volume SFS to disk: all of them, or if
+ * ONEFILE is true, those belonging to the file with inode INO.
+ * Returns the first error encountered, but keeps going past it.
+ */
+static
+int
+sfs_buf_sync(struct sfs_fs *sfs, bool onefile, uint32_t ino)
+{
+	struct sfs_buf *b;
+	unsigned i;
+	int result, ret = 0;
+
+	lock_acquire(cache_lock);
+	for (i=0; i<SFS_CACHE_NBUFS; i++) {
+		b = &cache_bufs[i];
+		while (b->b_fs == sfs && b->b_dirty && b->b_busy &&
+		       (!onefile || b->b_ino == ino)) {
+			cv_wait(cache_cv, cache_lock);
+		}
+		if (b->b_fs != sfs || !b->b_dirty) {
+			continue;
+		}
+		if (onefile && b->b_ino != ino) {
+			continue;
+		}
+		sfs_buf_mark_busy(b);
+		result = sfs_buf_writeout(b);
+		sfs_buf_unmark_busy(b, false);
+		if (result && ret == 0) {
+			ret = result;
+		}
+	}
+	lock_release(cache_lock);
+
+	return ret;
+}
+
+/*
+ * Write all dirty buffers of volume SFS to disk.
+ */
+int
+sfs_buf_syncfs(struct sfs_fs *sfs)
+{
+	return sfs_buf_sync(sfs, false, 0);
+}
+
+/*
+ * Write the dirty buffers of the file with inode INO on volume SFS
+ * to disk, leaving everyone else's for the flusher.
+ */
+int
+sfs_buf_syncfile(struct sfs_fs *sfs, uint32_t ino)
+{
+	return sfs_buf_sync(sfs, true, ino);
+}
+
+/*
+ * Make the cache consistent with a direct transfer of blocks BLOCK
+ * through BLOCK+NBLOCKS-1 in direction RW: before a read, write back
+ * any dirty copies, since the disk is about to be read; around a
+ * write, drop any copies, since the disk is about to be (or has
+ * just been) overwritten. Waits for busy buffers in the range.
+ * Returns with cache_lock held.
+ */
+static
+int
+sfs_buf_prepdirect(struct sfs_fs *sfs, uint32_t block, uint32_t nblocks,
+		   enum uio_rw rw)
+{
+	struct sfs_buf *b;
+	uint32_t i;
+	int result;
+
+	KASSERT(lock_do_i_hold(cache_lock));
+
+	i = 0;
+	while (i < nblocks) {
+		b = sfs_buf_lookup(sfs, block + i);
+		if (b != NULL && b->b_busy) {
+			/* It may change identity meanwhile; look again */
+			cv_wait(cache_cv, cache_lock);
+			continue;
+		}
+		i++;
+		if (b == NULL) {
+			continue;
+		}
+		if (rw == UIO_WRITE) {
+			sfs_buf_unhash(b);
+			sfs_buf_setclean(b);
+			sfs_buf_lruremove(b);
+			sfs_buf_lruinsert(b, true);
+		}
+		else if (b->b_dirty) {
+			sfs_buf_mark_busy(b);
+			result = sfs_buf_writeout(b);
+			sfs_buf_unmark_busy(b, false);
+			if (result) {
+				return result;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Transfer NBLOCKS whole blocks starting at BLOCK of volume SFS
+ * directly between the disk and UIO, in one device request, without
+ * copying through cache buffers. UIO is advanced as if by uiomove.
+ *
+ * This is for large transfers of file data, which would otherwise
+ * go one block (and one device request) at a time and push everything
+ * else out of the cache besides. Cached copies of the blocks are kept
+ * consistent (see sfs_buf_prepdirect); the caller must make sure
+ * nobody else uses the blocks meanwhile, which for file data the
+ * vnode lock does.
+ */
+int
+sfs_buf_directio(struct sfs_fs *sfs, uint32_t block, uint32_t nblocks,
+		 struct uio *uio)
+{
+	struct uio devuio;
+	size_t len, done;
+	int result;
+
+	KASSERT(nblocks > 0);
+	KASSERT(block + nblocks <= sfs->sfs_super.sp_nblocks);
+
+	len = nblocks * SFS_BLOCKSIZE;
+	KASSERT(uio->uio_resid >= len);
+
+	lock_acquire(cache_lock);
+	result = sfs_buf_prepdirect(sfs, block, nblocks, uio->uio_rw);
+	if (result) {
+		lock_release(cache_lock);
+		return result;
+	}
+	cache_directios++;
+	cache_directblocks += nblocks;
+	lock_release(cache_lock);
+
+	/*
+	 * Point a copy of the uio at the disk. It shares the caller's
+	 * iovecs, which the transfer advances in place; afterwards
+	 * carry the progress back into the caller's uio.
+	 */
+	devuio = *uio;
+	devuio.uio_offset = (off_t)block * SFS_BLOCKSIZE;
+	devuio.uio_resid = len;
+	result = sfs_rwblock(sfs, &devuio);
+
+	done = len - devuio.uio_resid;
+	uio->uio_iov = devuio.uio_iov;
+	uio->uio_iovcnt = devuio.uio_iovcnt;
+	uio->uio_offset += done;
+	uio->uio_resid -= done;
+
+	if (uio->uio_rw == UIO_WRITE) {
+		/*
+		 * Nobody should have cached these meanwhile, but if
+		 * they did, what they got is stale.
+		 */
+		lock_acquire(cache_lock);
+		sfs_buf_prepdirect(sfs, block, nblocks, UIO_WRITE);
+		lock_release(cache_lock);
+	}
+
+	return result;
+}
+
+/*
+ * Start reading NBLOCKS (at most SFS_RAMAX) blocks of volume SFS,
+ * listed in BLOCKS in the order they'll probably be wanted, into the
+ * cache in the background. This is only a hint: blocks already
+ * cached are skipped, and only clean buffers are recycled, since
+ * read-ahead is not worth waiting for a write. The buffers are
+ * entered in the hash table busy, so anyone wanting them waits for
+ * the read.
+ *
+ * The blocks are identified only by number, so by the time they are
+ * read they may no longer belong to the file they were read ahead
+ * for. That's harmless: nothing reads a newly allocated block before
+ * filling it in.
+ */
+void
+sfs_buf_readahead(struct sfs_fs *sfs, const uint32_t *blocks,
+		  unsigned nblocks)
+{
+	struct sfs_buf *b, *bufs[SFS_RAMAX];
+	unsigned i, n;
+
+	KASSERT(nblocks <= SFS_RAMAX);
+
+	lock_acquire(cache_lock);
+	n = 0;
+	for (i=0; i<nblocks; i++) {
+		KASSERT(blocks[i] < sfs->sfs_super.sp_nblocks);
+		if (sfs_buf_lookup(sfs, blocks[i]) != NULL) {
+			continue;
+		}
+		b = sfs_buf_victim();
+		if (b == NULL) {
+			break;
+		}
+		sfs_buf_mark_busy(b);
+		sfs_buf_rehash(b, sfs, blocks[i]);
+		/* Keeps the volume from going away until it's read */
+		sfs->sfs_iopending++;
+		cache_reads++;
+		bufs[n++] = b;
+	}
+	lock_release(cache_lock);
+
+	/* The device sorts them; consecutive blocks go back to back */
+	for (i=0; i<n; i++) {
+		sfs_buf_aiostart(bufs[i], false);
+	}
+}
+
+/*
+ * Drop all buffers of volume SFS, which is being unmounted. They
+ * must all be clean (the volume has been synced) and not in use.
+ */
+void
+sfs_buf_dropfs(struct sfs_fs *sfs)
+{
+	struct sfs_buf *b;
+	unsigned i;
+
+	lock_acquire(cache_lock);
+	while (sfs->sfs_iopending > 0) {
+		cv_wait(cache_cv, cache_lock);
+	}
+	for (i=0; i<SFS_CACHE_NBUFS; i++) {
+		b = &cache_bufs[i];
+		if (b->b_fs != sfs) {
+			continue;
+		}
+		KASSERT(!b->b_busy);
+		KASSERT(!b->b_dirty);
+		sfs_buf_unhash(b);
+		sfs_buf_lruremove(b);
+		sfs_buf_lruinsert(b, true);
+	}
+	lock_release(cache_lock);
+}
+
+/*
+ * Print the cache statistics.
+ */
+void
+sfs_cache_printstats(void)
+{
+	unsigned hits, misses, reads, writes, ndirty;
+	unsigned directios, directblocks;
+	unsigned rablocks, rahits, rawaste;
+	unsigned flushes, stalls;
+
+	if (cache_bufs == NULL) {
+		kprintf("sfs cache: not in use (no sfs mounted yet)\n");
+		return;
+	}
+
+	lock_acquire(cache_lock);
+	hits = cache_hits;
+	misses = cache_misses;
+	reads = cache_reads;
+	writes = cache_writes;
+	directios = cache_directios;
+	directblocks = cache_directblocks;
+	rablocks = cache_rablocks;
+	rahits = cache_rahits;
+	rawaste = cache_rawaste;
+	flushes = cache_flushes;
+	stalls = cache_stalls;
+	ndirty = cache_ndirty;
+	lock_release(cache_lock);
+
+	kprintf("sfs cache: %u buffers, %u dirty\n", SFS_CACHE_NBUFS, ndirty);
+	kprintf("sfs cache: %u hits, %u misses (%u%% hit rate)\n",
+		hits, misses,
+		hits + misses > 0 ? hits * 100 / (hits + misses) : 0);
+	kprintf("sfs cache: %u blocks read, %u blocks written\n",
+		reads, writes);
+	kprintf("sfs cache: %u direct transfers, %u blocks (avg %u)\n",
+		directios, directblocks,
+		directios > 0 ? directblocks / directios : 0);
+	kprintf("sfs cache: %u blocks read ahead, %u used, %u wasted\n",
+		rablocks, rahits, rawaste);
+	kprintf("sfs cache: %u blocks flushed in background, "
+		"%u written back on eviction\n", flushes, stalls);
+}
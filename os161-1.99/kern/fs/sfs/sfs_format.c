@@ -0,0 +1,174 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Making a new SFS volume from inside the kernel, the same as mksfs
+ * does from outside: for devices, like ramdisks, that only exist
+ * while the kernel is running.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <vfs.h>
+#include <device.h>
+#include <sfs.h>
+
+/*
+ * Write one block to DEV.
+ */
+static
+int
+sfs_format_wblock(struct device *dev, void *data, uint32_t block)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
+	result = dev->d_io(dev, &ku);
+	if (result == 0 && ku.uio_resid > 0) {
+		result = EIO;
+	}
+	return result;
+}
+
+/*
+ * Write the free block bitmap for a volume of NBLOCKS blocks: the
+ * superblock, root directory, and bitmap itself are in use, and so
+ * are the bits past the end of the volume.
+ */
+static
+int
+sfs_format_bitmap(struct device *dev, char *buf, uint32_t nblocks)
+{
+	uint32_t i, bit, block, mapblocks;
+	int result;
+
+	mapblocks = SFS_BITBLOCKS(nblocks);
+	for (i=0; i<mapblocks; i++) {
+		bzero(buf, SFS_BLOCKSIZE);
+		for (bit=0; bit<SFS_BLOCKBITS; bit++) {
+			block = i * SFS_BLOCKBITS + bit;
+			if (block == SFS_SB_LOCATION ||
+			    block == SFS_ROOT_LOCATION ||
+			    (block >= SFS_MAP_LOCATION &&
+			     block < SFS_MAP_LOCATION + mapblocks) ||
+			    block >= nblocks) {
+				buf[bit / CHAR_BIT] |= 1 << (bit % CHAR_BIT);
+			}
+		}
+		result = sfs_format_wblock(dev, buf, SFS_MAP_LOCATION + i);
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Make an empty SFS volume named VOLNAME on the device DEVICE (a
+ * name, without colon), which must not be mounted. The root is a
+ * hashed directory, like mksfs makes by default.
+ */
+int
+sfs_format(const char *device, const char *volname)
+{
+	struct device *dev;
+	struct sfs_super *sp;
+	struct sfs_inode *sfi;
+	uint32_t nblocks;
+	char *buf;
+	int result;
+
+	if (*volname == 0 || strlen(volname) >= SFS_VOLNAME_SIZE ||
+	    strchr(volname, ':') != NULL || strchr(volname, '/') != NULL) {
+		return EINVAL;
+	}
+
+	/* Keeps it from being mounted meanwhile */
+	result = vfs_claimdev(device, &dev);
+	if (result) {
+		return result;
+	}
+
+	buf = kmalloc(SFS_BLOCKSIZE);
+	if (buf == NULL) {
+		vfs_unclaimdev(device);
+		return ENOMEM;
+	}
+
+	nblocks = dev->d_blocks;
+	if (dev->d_blocksize != SFS_BLOCKSIZE) {
+		result = EINVAL;
+		goto done;
+	}
+	if (nblocks <= SFS_MAP_LOCATION + SFS_BITBLOCKS(nblocks)) {
+		result = ENOSPC;
+		goto done;
+	}
+
+	result = sfs_format_bitmap(dev, buf, nblocks);
+	if (result) {
+		goto done;
+	}
+
+	/* Root directory; its buckets start out as holes */
+	bzero(buf, SFS_BLOCKSIZE);
+	sfi = (struct sfs_inode *)buf;
+	sfi->sfi_size = SFS_DIRHASH_NBUCKETS * SFS_BLOCKSIZE;
+	sfi->sfi_type = SFS_TYPE_DIR;
+	sfi->sfi_linkcount = 1;
+	sfi->sfi_dirhash = SFS_DIRHASH_NBUCKETS;
+	result = sfs_format_wblock(dev, buf, SFS_ROOT_LOCATION);
+	if (result) {
+		goto done;
+	}
+
+	/* Superblock last, so a volume half made isn't taken for one */
+	bzero(buf, SFS_BLOCKSIZE);
+	sp = (struct sfs_super *)buf;
+	sp->sp_magic = SFS_MAGIC;
+	sp->sp_nblocks = nblocks;
+	strcpy(sp->sp_volname, volname);
+	sp->sp_nfree = nblocks - SFS_MAP_LOCATION - SFS_BITBLOCKS(nblocks);
+	result = sfs_format_wblock(dev, buf, SFS_SB_LOCATION);
+	if (result) {
+		goto done;
+	}
+
+	kprintf("sfs: Made %s on %s: (%u blocks)\n", volname, device,
+		nblocks);
+
+ done:
+	kfree(buf);
+	vfs_unclaimdev(device);
+	return result;
+}
@@ -39,6 +39,7 @@
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <synch.h>
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
@@ -48,9 +49,7 @@
 #define SFS_FS_BITBLOCKS(sfs)   SFS_BITBLOCKS((sfs)->sfs_super.sp_nblocks)
 
 /*
- * Routine for doing I/O (reads or writes) on the free block bitmap.
- * We always do the whole bitmap at once; writing individual sectors
- * might or might not be a worthwhile optimization.
+ * Routines for I/O on the free block bitmap.
  *
  * The free block bitmap consists of SFS_BITBLOCKS 512-byte sectors of
  * bits, one bit for each sector on the filesystem. The number of
@@ -63,41 +62,135 @@
  *
  * The sectors used by the superblock and the bitmap itself are
  * likewise marked in use by mksfs.
+ *
+ * The whole bitmap is allocated at mount, but its sectors are only
+ * read in when something first looks at a bit in them, so mounting
+ * a large volume doesn't read the whole map. Likewise only sectors
+ * with bits changed since the last sync are written back. Together
+ * with the free block count kept in the superblock, this means nobody
+ * needs to go through the whole map just to mount, sync, or find out
+ * how full the volume is.
+ */
+
+/*
+ * Make sure the bitmap sector holding the bit for disk block BLOCK
+ * has been read in.
  */
+int
+sfs_freemap_load(struct sfs_fs *sfs, uint32_t block)
+{
+	uint32_t j;
+	char *bitdata;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	KASSERT(block < SFS_FS_BITMAPSIZE(sfs));
+
+	j = block / SFS_BLOCKBITS;
+	if (bitmap_isset(sfs->sfs_maploaded, j)) {
+		return 0;
+	}
+
+	/* The bitmap starts at sector 2. */
+	bitdata = bitmap_getdata(sfs->sfs_freemap);
+	result = sfs_rblock(sfs, bitdata + j*SFS_BLOCKSIZE,
+			    SFS_MAP_LOCATION+j);
+	if (result) {
+		return result;
+	}
+	bitmap_mark(sfs->sfs_maploaded, j);
+	return 0;
+}
+
+/*
+ * Mark disk block BLOCK in use (if INUSE is true) or free in the
+ * bitmap, whose sector for it must have been loaded, and keep the
+ * free block count up to date.
+ */
+void
+sfs_freemap_update(struct sfs_fs *sfs, uint32_t block, bool inuse)
+{
+	uint32_t j;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	KASSERT(block < sfs->sfs_super.sp_nblocks);
+
+	j = block / SFS_BLOCKBITS;
+	KASSERT(bitmap_isset(sfs->sfs_maploaded, j));
+
+	if (inuse) {
+		bitmap_mark(sfs->sfs_freemap, block);
+		KASSERT(sfs->sfs_super.sp_nfree > 0);
+		sfs->sfs_super.sp_nfree--;
+	}
+	else {
+		bitmap_unmark(sfs->sfs_freemap, block);
+		sfs->sfs_super.sp_nfree++;
+	}
+	sfs->sfs_superdirty = true;
 
+	if (!bitmap_isset(sfs->sfs_mapdirty, j)) {
+		bitmap_mark(sfs->sfs_mapdirty, j);
+	}
+	sfs->sfs_freemapdirty = true;
+}
+
+/*
+ * Write back the bitmap sectors that have been modified.
+ */
 static
 int
-sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
+sfs_freemap_sync(struct sfs_fs *sfs)
 {
 	uint32_t j, mapsize;
 	char *bitdata;
 	int result;
 
-	/* Number of blocks in the bitmap. */
-	mapsize = SFS_FS_BITBLOCKS(sfs);
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
 
-	/* Pointer to our bitmap data in memory. */
+	mapsize = SFS_FS_BITBLOCKS(sfs);
 	bitdata = bitmap_getdata(sfs->sfs_freemap);
-	
-	/* For each sector in the bitmap... */
-	for (j=0; j<mapsize; j++) {
-
-		/* Get a pointer to its data */
-		void *ptr = bitdata + j*SFS_BLOCKSIZE;
 
-		/* and read or write it. The bitmap starts at sector 2. */ 
-		if (rw == UIO_READ) {
-			result = sfs_rblock(sfs, ptr, SFS_MAP_LOCATION+j);
-		}
-		else {
-			result = sfs_wblock(sfs, ptr, SFS_MAP_LOCATION+j);
+	for (j=0; j<mapsize; j++) {
+		if (!bitmap_isset(sfs->sfs_mapdirty, j)) {
+			continue;
 		}
-
-		/* If we failed, stop. */
+		result = sfs_wblock(sfs, bitdata + j*SFS_BLOCKSIZE,
+				    SFS_MAP_LOCATION+j);
 		if (result) {
 			return result;
 		}
+		bitmap_unmark(sfs->sfs_mapdirty, j);
 	}
+	sfs->sfs_freemapdirty = false;
+	return 0;
+}
+
+/*
+ * Count the free blocks the hard way, by reading the whole bitmap.
+ * Only for volumes whose superblock doesn't have a sensible count.
+ */
+static
+int
+sfs_freemap_count(struct sfs_fs *sfs, uint32_t *ret)
+{
+	uint32_t i, nfree = 0;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	for (i=0; i<sfs->sfs_super.sp_nblocks; i++) {
+		if (i % SFS_BLOCKBITS == 0) {
+			result = sfs_freemap_load(sfs, i);
+			if (result) {
+				return result;
+			}
+		}
+		if (!bitmap_isset(sfs->sfs_freemap, i)) {
+			nfree++;
+		}
+	}
+	*ret = nfree;
 	return 0;
 }
 
@@ -111,11 +204,10 @@ int
 sfs_sync(struct fs *fs)
 {
 	struct sfs_fs *sfs; 
-	unsigned i, num;
+	struct vnode *v;
+	unsigned i;
 	int result;
 
-	vfs_biglock_acquire();
-
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
 	 *
@@ -148,34 +240,58 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
+	/*
+	 * Go over the array of loaded vnodes, syncing as we go.
+	 *
+	 * VOP_FSYNC takes the vnode's lock, which comes before
+	 * sfs_vnlock for the directory, so we can't hold sfs_vnlock
+	 * across it. Instead take a reference to each vnode in turn
+	 * and let go of the table. Vnodes loaded or reclaimed
+	 * meanwhile may be skipped; their inodes get synced by
+	 * reclaim or by the next sync.
+	 */
+	for (i=0; ; i++) {
+		lock_acquire(sfs->sfs_vnlock);
+		if (i >= vnodearray_num(sfs->sfs_vnodes)) {
+			lock_release(sfs->sfs_vnlock);
+			break;
+		}
+		v = vnodearray_get(sfs->sfs_vnodes, i);
+		VOP_INCREF(v);
+		lock_release(sfs->sfs_vnlock);
+
 		VOP_FSYNC(v);
+		VOP_DECREF(v);
+	}
+
+	/* Write back anything else still dirty in the buffer cache. */
+	result = sfs_buf_syncfs(sfs);
+	if (result) {
+		return result;
 	}
 
-	/* If the free block map needs to be written, write it. */
+	lock_acquire(sfs->sfs_freemaplock);
+
+	/* If any of the free block map needs to be written, write it. */
 	if (sfs->sfs_freemapdirty) {
-		result = sfs_mapio(sfs, UIO_WRITE);
+		result = sfs_freemap_sync(sfs);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
-		sfs->sfs_freemapdirty = false;
 	}
 
 	/* If the superblock needs to be written, write it. */
 	if (sfs->sfs_superdirty) {
 		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_freemaplock);
 			return result;
 		}
 		sfs->sfs_superdirty = false;
 	}
 
-	vfs_biglock_release();
+	lock_release(sfs->sfs_freemaplock);
 	return 0;
 }
 
@@ -189,13 +305,9 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
 
-	vfs_biglock_acquire();
-	ret = sfs->sfs_super.sp_volname;
-	vfs_biglock_release();
-
-	return ret;
+	/* The volume name never changes */
+	return sfs->sfs_super.sp_volname;
 }
 
 /*
@@ -209,21 +321,33 @@ sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
 
-	vfs_biglock_acquire();
-	
+	lock_acquire(sfs->sfs_vnlock);
+
 	/* Do we have any files open? If so, can't unmount. */
 	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
+
+	/*
+	 * Nothing can get at the volume without a vnode, and the
+	 * vfs layer (holding the big lock) won't hand out new ones
+	 * during unmount, so we're on our own from here.
+	 */
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
 
 	/* Once we start nuking stuff we can't fail. */
+	sfs_buf_dropfs(sfs);
 	vnodearray_destroy(sfs->sfs_vnodes);
 	bitmap_destroy(sfs->sfs_freemap);
+	bitmap_destroy(sfs->sfs_maploaded);
+	bitmap_destroy(sfs->sfs_mapdirty);
+	lock_destroy(sfs->sfs_vnlock);
+	lock_destroy(sfs->sfs_freemaplock);
 	
 	/* The vfs layer takes care of the device for us */
 	(void)sfs->sfs_device;
@@ -232,7 +356,6 @@ sfs_unmount(struct fs *fs)
 	kfree(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -255,13 +378,21 @@ int
 sfs_domount(void *options, struct device *dev, struct fs **ret)
 {
 	int result;
+	unsigned i;
 	struct sfs_fs *sfs;
 
-	vfs_biglock_acquire();
+	/*
+	 * vfs_mount holds the big lock, so mounts are serialized; and
+	 * nobody else can see this volume until we return.
+	 */
+	KASSERT(vfs_biglock_do_i_hold());
 
 	/* We don't pass any options through mount */
 	(void)options;
 
+	/* Make sure the buffer cache exists */
+	sfs_cache_bootstrap();
+
 	/*
 	 * Make sure our on-disk structures aren't messed up
 	 */
@@ -278,14 +409,12 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	 * don't do that in sfs.)
 	 */
 	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
 		return ENXIO;
 	}
 
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
 	if (sfs==NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
@@ -293,9 +422,11 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	sfs->sfs_vnodes = vnodearray_create();
 	if (sfs->sfs_vnodes == NULL) {
 		kfree(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
+	for (i=0; i<SFS_VNHASH_SIZE; i++) {
+		sfs->sfs_vnhash[i] = NULL;
+	}
 
 	/* Set the device so we can use sfs_rblock() */
 	sfs->sfs_device = dev;
@@ -305,7 +436,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	if (result) {
 		vnodearray_destroy(sfs->sfs_vnodes);
 		kfree(sfs);
-		vfs_biglock_release();
 		return result;
 	}
 
@@ -318,7 +448,6 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			SFS_MAGIC);
 		vnodearray_destroy(sfs->sfs_vnodes);
 		kfree(sfs);
-		vfs_biglock_release();
 		return EINVAL;
 	}
 	
@@ -330,21 +459,59 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Ensure null termination of the volume name */
 	sfs->sfs_super.sp_volname[sizeof(sfs->sfs_super.sp_volname)-1] = 0;
 
-	/* Load free space bitmap */
+	/*
+	 * Set up the free space bitmap. Its sectors are read in as
+	 * they're needed (see sfs_freemap_load), so all we need now is
+	 * space for them and a note of which ones we have.
+	 */
+	result = ENOMEM;
 	sfs->sfs_freemap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
 	if (sfs->sfs_freemap == NULL) {
-		vnodearray_destroy(sfs->sfs_vnodes);
-		kfree(sfs);
-		vfs_biglock_release();
-		return ENOMEM;
+		goto fail_vnodes;
 	}
-	result = sfs_mapio(sfs, UIO_READ);
-	if (result) {
-		bitmap_destroy(sfs->sfs_freemap);
-		vnodearray_destroy(sfs->sfs_vnodes);
-		kfree(sfs);
-		vfs_biglock_release();
-		return result;
+	sfs->sfs_maploaded = bitmap_create(SFS_FS_BITBLOCKS(sfs));
+	if (sfs->sfs_maploaded == NULL) {
+		goto fail_freemap;
+	}
+	sfs->sfs_mapdirty = bitmap_create(SFS_FS_BITBLOCKS(sfs));
+	if (sfs->sfs_mapdirty == NULL) {
+		goto fail_maploaded;
+	}
+
+	/* Create the locks (see sfs.h) */
+	sfs->sfs_vnlock = lock_create("sfs vnodes");
+	if (sfs->sfs_vnlock == NULL) {
+		goto fail_mapdirty;
+	}
+	sfs->sfs_freemaplock = lock_create("sfs freemap");
+	if (sfs->sfs_freemaplock == NULL) {
+		goto fail_vnlock;
+	}
+
+	sfs->sfs_superdirty = false;
+	sfs->sfs_freemapdirty = false;
+
+	/*
+	 * Volumes made before the superblock had a free block count
+	 * have zero there, and nothing can have more free blocks than
+	 * blocks. In either case count them, and fix the count at the
+	 * next sync. (A volume that really is full gets counted every
+	 * time, which is harmless.)
+	 */
+	if (sfs->sfs_super.sp_nfree == 0 ||
+	    sfs->sfs_super.sp_nfree > sfs->sfs_super.sp_nblocks) {
+		uint32_t nfree;
+
+		lock_acquire(sfs->sfs_freemaplock);
+		result = sfs_freemap_count(sfs, &nfree);
+		if (result == 0 && nfree != sfs->sfs_super.sp_nfree) {
+			sfs->sfs_super.sp_nfree = nfree;
+			sfs->sfs_superdirty = true;
+		}
+		lock_release(sfs->sfs_freemaplock);
+		if (result) {
+			goto fail_freemaplock;
+		}
 	}
 
 	/* Set up abstract fs calls */
@@ -353,16 +520,31 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	sfs->sfs_absfs.fs_getroot = sfs_getroot;
 	sfs->sfs_absfs.fs_unmount = sfs_unmount;
 	sfs->sfs_absfs.fs_data = sfs;
+	/* See sfs_loadvnode */
+	sfs->sfs_absfs.fs_uniquevnodes = true;
 
 	/* the other fields */
-	sfs->sfs_superdirty = false;
-	sfs->sfs_freemapdirty = false;
+	sfs->sfs_iopending = 0;
 
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
+
+ fail_freemaplock:
+	lock_destroy(sfs->sfs_freemaplock);
+ fail_vnlock:
+	lock_destroy(sfs->sfs_vnlock);
+ fail_mapdirty:
+	bitmap_destroy(sfs->sfs_mapdirty);
+ fail_maploaded:
+	bitmap_destroy(sfs->sfs_maploaded);
+ fail_freemap:
+	bitmap_destroy(sfs->sfs_freemap);
+ fail_vnodes:
+	vnodearray_destroy(sfs->sfs_vnodes);
+	kfree(sfs);
+	return result;
 }
 
 /*
@@ -43,6 +43,10 @@
 // early in mount, before sfs is fully (or even mostly)
 // initialized, and so may not use anything from sfs
 // except sfs_device.
+//
+// These go straight to the device. Apart from the superblock
+// and freemap, blocks should be accessed through the buffer
+// cache (sfs_cache.c), which uses these to do its I/O.
 
 int
 sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
@@ -50,8 +54,6 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	int result;
 	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	DEBUG(DB_SFS, "sfs: %s %llu\n", 
 	      uio->uio_rw == UIO_READ ? "read" : "write",
 	      uio->uio_offset / SFS_BLOCKSIZE);
@@ -86,6 +88,28 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	return result;
 }
 
+/*
+ * Start an asynchronous transfer; the device calls aio->da_done when
+ * it's finished. There's no retrying here: the caller is told of an
+ * error and can try again later if it wants.
+ */
+int
+sfs_aio(struct sfs_fs *sfs, struct device_aio *aio)
+{
+	int result;
+
+	DEBUG(DB_SFS, "sfs: async %s %llu\n",
+	      aio->da_write ? "write" : "read",
+	      aio->da_offset / SFS_BLOCKSIZE);
+
+	result = dev_aio(sfs->sfs_device, aio);
+	if (result == EINVAL) {
+		/* As in sfs_rwblock, this is our fault */
+		panic("sfs: d_aio returned EINVAL\n");
+	}
+	return result;
+}
+
 int
 sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block)
 {
@@ -41,6 +41,9 @@
 #include <bitmap.h>
 #include <uio.h>
 #include <synch.h>
+#include <thread.h>
+#include <current.h>
+#include <vm.h>
 #include <vfs.h>
 #include <device.h>
 #include <sfs.h>
@@ -49,31 +52,54 @@
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
 
+/* Further down */
+static int sfs_dotruncate(struct sfs_vnode *sv, off_t len);
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
 
-/* Zero out a disk block. */
+/* Zero out a disk block belonging to the file with inode INO. */
 static
 int
-sfs_clearblock(struct sfs_fs *sfs, uint32_t block)
+sfs_clearblock(struct sfs_fs *sfs, uint32_t block, uint32_t ino)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
-	return sfs_wblock(sfs, zeros, block);
+	struct sfs_buf *buf;
+	int result;
+
+	result = sfs_buf_get(sfs, block, false, &buf);
+	if (result) {
+		return result;
+	}
+	bzero(sfs_buf_data(buf), SFS_BLOCKSIZE);
+	sfs_buf_markdirty(buf, ino);
+	sfs_buf_release(buf);
+	return 0;
 }
 
-/* Write an on-disk inode structure back out to disk. */
+/*
+ * Write an on-disk inode structure back out to its block. (This puts
+ * it in the buffer cache; it reaches the disk when the cache flushes
+ * it or the file is fsynced.)
+ */
 static
 int
 sfs_sync_inode(struct sfs_vnode *sv)
 {
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
 	if (sv->sv_dirty) {
 		struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-		int result = sfs_wblock(sfs, &sv->sv_i, sv->sv_ino);
+		struct sfs_buf *buf;
+		int result;
+
+		result = sfs_buf_get(sfs, sv->sv_ino, false, &buf);
 		if (result) {
 			return result;
 		}
+		memcpy(sfs_buf_data(buf), &sv->sv_i, sizeof(sv->sv_i));
+		sfs_buf_markdirty(buf, sv->sv_ino);
+		sfs_buf_release(buf);
 		sv->sv_dirty = false;
 	}
 	return 0;
@@ -84,26 +110,99 @@ sfs_sync_inode(struct sfs_vnode *sv)
 // Space allocation
 
 /*
- * Allocate a block.
+ * Number of blocks past the one asked for that a file extending
+ * itself sequentially gets set aside for it (see sfs_file_balloc).
+ */
+#define SFS_RESERVE	8
+
+/*
+ * Find a free block at or after FIRST and before LIMIT, which must be
+ * covered by one loaded sector of the free map. Whole bytes of the map
+ * that are all in use are skipped at once.
+ */
+static
+bool
+sfs_mapfind(struct sfs_fs *sfs, uint32_t first, uint32_t limit,
+	    uint32_t *ret)
+{
+	const unsigned char *bits = bitmap_getdata(sfs->sfs_freemap);
+	uint32_t i;
+
+	for (i=first; i<limit; i++) {
+		if (i % CHAR_BIT == 0 && i + CHAR_BIT <= limit &&
+		    bits[i / CHAR_BIT] == 0xff) {
+			i += CHAR_BIT - 1;
+			continue;
+		}
+		if (!bitmap_isset(sfs->sfs_freemap, i)) {
+			*ret = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Allocate a block, preferably GOAL or the first free one after it.
+ * The block is not cleared; callers that need zeros must arrange it.
+ *
+ * The free map is searched a sector at a time starting with GOAL's,
+ * reading sectors in as we get to them, and wrapping around. A full
+ * volume is recognized from the free count without searching.
  */
 static
 int
-sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
+sfs_balloc(struct sfs_fs *sfs, uint32_t goal, uint32_t *diskblock)
 {
+	uint32_t nblocks, mapsize, startsect, sect, n, first, limit;
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
-	if (result) {
-		return result;
+	nblocks = sfs->sfs_super.sp_nblocks;
+	mapsize = SFS_BITBLOCKS(nblocks);
+	if (goal >= nblocks) {
+		goal = 0;
 	}
-	sfs->sfs_freemapdirty = true;
+	startsect = goal / SFS_BLOCKBITS;
 
-	if (*diskblock >= sfs->sfs_super.sp_nblocks) {
-		panic("sfs: balloc: invalid block %u\n", *diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	if (sfs->sfs_super.sp_nfree == 0) {
+		lock_release(sfs->sfs_freemaplock);
+		return ENOSPC;
+	}
+
+	/*
+	 * Visit every sector once, and GOAL's a second time at the
+	 * end for the blocks before GOAL.
+	 */
+	for (n=0; n<=mapsize; n++) {
+		sect = (startsect + n) % mapsize;
+		result = sfs_freemap_load(sfs, sect * SFS_BLOCKBITS);
+		if (result) {
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
+		first = sect * SFS_BLOCKBITS;
+		limit = first + SFS_BLOCKBITS;
+		if (n == 0) {
+			first = goal;
+		}
+		else if (n == mapsize) {
+			limit = goal;
+		}
+		if (limit > nblocks) {
+			limit = nblocks;
+		}
+		if (sfs_mapfind(sfs, first, limit, diskblock)) {
+			sfs_freemap_update(sfs, *diskblock, true);
+			lock_release(sfs->sfs_freemaplock);
+			return 0;
+		}
 	}
+	lock_release(sfs->sfs_freemaplock);
 
-	/* Clear block before returning it */
-	return sfs_clearblock(sfs, *diskblock);
+	kprintf("sfs: %s: free count is %u but no free blocks\n",
+		sfs->sfs_super.sp_volname, sfs->sfs_super.sp_nfree);
+	return ENOSPC;
 }
 
 /*
@@ -113,55 +212,239 @@ static
 void
 sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock)
 {
-	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	int result;
+
+	lock_acquire(sfs->sfs_freemaplock);
+	result = sfs_freemap_load(sfs, diskblock);
+	if (result) {
+		/* Can't do much about it; sfsck will find it unused */
+		kprintf("sfs: %s: cannot free block %u: %s\n",
+			sfs->sfs_super.sp_volname, diskblock,
+			strerror(result));
+	}
+	else {
+		sfs_freemap_update(sfs, diskblock, false);
+	}
+	lock_release(sfs->sfs_freemaplock);
+
+	/* Whatever was in it doesn't need writing back any more */
+	sfs_buf_forget(sfs, diskblock);
 }
 
 /*
- * Check if a block is in use.
+ * Check if a block is in use. If the free map can't be read, says it
+ * is; callers use this to catch corruption, not to allocate.
  */
 static
 int
 sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: sfs_bused called on out of range block %u\n", 
 		      diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	if (sfs_freemap_load(sfs, diskblock)) {
+		ret = 1;
+	}
+	else {
+		ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	}
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
+}
+
+/*
+ * Give back the blocks set aside for file SV.
+ */
+static
+void
+sfs_unreserve(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sv->sv_resvcount == 0) {
+		return;
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+	while (sv->sv_resvcount > 0) {
+		/* Never used, so nothing of them is in the cache */
+		sfs_freemap_update(sfs, sv->sv_resvstart, false);
+		sv->sv_resvstart++;
+		sv->sv_resvcount--;
+	}
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Allocate a block for file SV, which wants GOAL (the block after
+ * the one preceding it in the file). Not cleared, as for sfs_balloc.
+ *
+ * When a file grows by writing sequentially, each new block is the
+ * one right after the last. To keep such a file contiguous even while
+ * other files are growing too, whenever we have to go to the free
+ * map we also set aside (mark in use) up to SFS_RESERVE free blocks
+ * that follow the one we got. The next allocation that asks for the
+ * first of them gets it without touching the free map. An allocation
+ * that asks for anything else gives the reservation back, as does
+ * the last close, truncate, and reclaim.
+ *
+ * Reserved blocks are marked in use in the free map; if the system
+ * crashes while a file holds some, sfsck will find them unreferenced
+ * and free them.
+ */
+static
+int
+sfs_file_balloc(struct sfs_vnode *sv, uint32_t goal, uint32_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t next;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (sv->sv_resvcount > 0) {
+		if (goal == sv->sv_resvstart) {
+			*diskblock = sv->sv_resvstart;
+			sv->sv_resvstart++;
+			sv->sv_resvcount--;
+			return 0;
+		}
+		sfs_unreserve(sv);
+	}
+
+	result = sfs_balloc(sfs, goal, diskblock);
+	if (result) {
+		return result;
+	}
+
+	/* Set aside the free blocks that follow, if any */
+	lock_acquire(sfs->sfs_freemaplock);
+	next = *diskblock + 1;
+	sv->sv_resvstart = next;
+	while (sv->sv_resvcount < SFS_RESERVE &&
+	       next < sfs->sfs_super.sp_nblocks &&
+	       sfs_freemap_load(sfs, next) == 0 &&
+	       !bitmap_isset(sfs->sfs_freemap, next)) {
+		sfs_freemap_update(sfs, next, true);
+		sv->sv_resvcount++;
+		next++;
+	}
+	lock_release(sfs->sfs_freemaplock);
+
+	return 0;
 }
 
 ////////////////////////////////////////////////////////////
 //
 // Block mapping/inode maintenance
 
+/*
+ * Get entry INDEX of indirect block IDBLOCK of file SV into *RET,
+ * allocating a block for it if it's empty and DOALLOC is set. If
+ * ISDATA, the entries are data blocks, and a new one is left for the
+ * caller to fill in (*ISNEW is set); otherwise they are indirect
+ * blocks themselves, and a new one is cleared.
+ *
+ * A new block goes after the one in the previous entry, or after the
+ * indirect block itself for the first one.
+ */
+static
+int
+sfs_bmap_indirect(struct sfs_vnode *sv, uint32_t idblock, uint32_t index,
+		  bool isdata, int doalloc, uint32_t *ret, bool *isnew)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *idbufobj;
+	uint32_t *idbuf;
+	uint32_t block, prev;
+	int result;
+
+	KASSERT(index < SFS_DBPERIDB);
+
+	/* Load the indirect block. */
+	result = sfs_buf_get(sfs, idblock, true, &idbufobj);
+	if (result) {
+		return result;
+	}
+	idbuf = sfs_buf_data(idbufobj);
+
+	/* Get the block out of the indirect block buffer */
+	block = idbuf[index];
+
+	/* If there's no block there, allocate one */
+	if (block==0 && doalloc) {
+		prev = index > 0 ? idbuf[index-1] : idblock;
+		if (prev == 0) {
+			prev = idblock;
+		}
+		result = sfs_file_balloc(sv, prev+1, &block);
+		if (result) {
+			sfs_buf_release(idbufobj);
+			return result;
+		}
+		if (isdata) {
+			*isnew = true;
+		}
+		else {
+			result = sfs_clearblock(sfs, block, sv->sv_ino);
+			if (result) {
+				sfs_bfree(sfs, block);
+				sfs_buf_release(idbufobj);
+				return result;
+			}
+		}
+
+		/* Remember the block we allocated */
+		idbuf[index] = block;
+
+		/* The indirect block is now dirty */
+		sfs_buf_markdirty(idbufobj, sv->sv_ino);
+	}
+	sfs_buf_release(idbufobj);
+
+	*ret = block;
+	return 0;
+}
+
 /*
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
  * file. If DOALLOC is set, and no such block exists, one will be
  * allocated.
+ *
+ * Newly allocated data blocks are not cleared on disk or in the
+ * cache; *ISNEW is set instead, and the caller must fill the whole
+ * block (with data or zeros) before anyone can read it. Indirect
+ * blocks are cleared here.
+ *
+ * Past the direct blocks, a file's blocks are found through its
+ * single, double, and triple indirect blocks in turn.
+ *
+ * New blocks are placed right after the preceding block of the file
+ * (or after the inode, for the first block) when possible, so files
+ * written sequentially end up contiguous on disk.
  */
 static
 int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
-	 uint32_t *diskblock)
+	 uint32_t *diskblock, bool *isnew)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-	uint32_t block;
-	uint32_t idblock;
-	uint32_t idnum, idoff;
+	uint32_t block, prev;
+	uint32_t idblock, *slot;
+	uint32_t span;
+	unsigned level, i;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	KASSERT(SFS_DBPERIDB * sizeof(uint32_t) == SFS_BLOCKSIZE);
+
+	*isnew = false;
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -176,10 +459,16 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			prev = fileblock > 0 ?
+				sv->sv_i.sfi_direct[fileblock-1] : 0;
+			if (prev == 0) {
+				prev = sv->sv_ino;
+			}
+			result = sfs_file_balloc(sv, prev+1, &block);
 			if (result) {
 				return result;
 			}
+			*isnew = true;
 
 			/* Remember what we allocated; mark inode dirty */
 			sv->sv_i.sfi_direct[fileblock] = block;
@@ -198,27 +487,36 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	}
 
 	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
+	 * It's not a direct block; it must be under one of the
+	 * indirect blocks. Subtract off the blocks before that one's
+	 * range, so FILEBLOCK is now the offset into it, and note how
+	 * many levels of indirect blocks are in the way.
 	 */
-
 	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
-
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
-	 */
-	if (idnum > 0) {
+	if (fileblock < SFS_DBPERIDB) {
+		level = 1;
+		slot = &sv->sv_i.sfi_indirect;
+		/* Put it after the last direct block, where data would go */
+		prev = sv->sv_i.sfi_direct[SFS_NDIRECT-1];
+	}
+	else if ((fileblock -= SFS_DBPERIDB) < SFS_DBPERIDB * SFS_DBPERIDB) {
+		level = 2;
+		slot = &sv->sv_i.sfi_dindirect;
+		prev = sv->sv_i.sfi_indirect;
+	}
+	else if ((fileblock -= SFS_DBPERIDB * SFS_DBPERIDB) <
+		 SFS_DBPERIDB * SFS_DBPERIDB * SFS_DBPERIDB) {
+		level = 3;
+		slot = &sv->sv_i.sfi_tindirect;
+		prev = sv->sv_i.sfi_dindirect;
+	}
+	else {
+		/* Past the largest file we can represent */
 		return EFBIG;
 	}
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
+	/* Get the disk block number of the top indirect block. */
+	idblock = *slot;
 
 	if (idblock==0 && !doalloc) {
 		/*
@@ -236,54 +534,56 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		 * the indirect block. Thus, we need to allocate an
 		 * indirect block.
 		 */
-		result = sfs_balloc(sfs, &idblock);
+		if (prev == 0) {
+			prev = sv->sv_ino;
+		}
+		result = sfs_file_balloc(sv, prev+1, &idblock);
 		if (result) {
 			return result;
 		}
+		result = sfs_clearblock(sfs, idblock, sv->sv_ino);
+		if (result) {
+			/* Still unused, so just give it back */
+			sfs_bfree(sfs, idblock);
+			return result;
+		}
 
 		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
+		*slot = idblock;
 
 		/* Mark the inode dirty */
 		sv->sv_dirty = true;
 
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
-	}
-	else {
-		/*
-		 * We already have an indirect block allocated; load it.
-		 */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
-		}
+		/* (it's now in the cache, so the load below is cheap) */
 	}
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
-
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+	/*
+	 * Walk down through the indirect blocks. Each entry of a
+	 * level-N indirect block covers SFS_DBPERIDB^(N-1) blocks.
+	 */
+	span = 1;
+	for (i=1; i<level; i++) {
+		span *= SFS_DBPERIDB;
+	}
+	while (1) {
+		result = sfs_bmap_indirect(sv, idblock, fileblock / span,
+					   level == 1, doalloc, &block, isnew);
 		if (result) {
 			return result;
 		}
-
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
-
-		/* The indirect block is now dirty; write it back */
-		result = sfs_wblock(sfs, idbuf, idblock);
-		if (result) {
-			return result;
+		if (block == 0 || level == 1) {
+			break;
 		}
+		idblock = block;
+		fileblock %= span;
+		span /= SFS_DBPERIDB;
+		level--;
 	}
 
 	/* Hand back the result and return. */
 	if (block != 0 && !sfs_bused(sfs, block)) {
-		panic("sfs: Data block %u (block %u of file %u) marked free\n",
-		      block, fileblock, sv->sv_ino);
+		panic("sfs: Data block %u of file %u marked free\n",
+		      block, sv->sv_ino);
 	}
 	*diskblock = block;
 	return 0;
@@ -308,18 +608,11 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *iobuf;
 	uint32_t diskblock;
 	uint32_t fileblock;
+	bool isnew;
 	int result;
 	
 	/* Allocate missing blocks if and only if we're writing */
@@ -331,7 +624,7 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
 
 	/* Get the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, fileblock, doalloc, &diskblock, &isnew);
 	if (result) {
 		return result;
 	}
@@ -339,105 +632,307 @@ sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Read zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_rblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block. A block just allocated has nothing worth
+	 * reading on disk; it's all zeros apart from what we write.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = sfs_buf_get(sfs, diskblock, !isnew, &iobuf);
 	if (result) {
 		return result;
 	}
+	if (isnew) {
+		bzero(sfs_buf_data(iobuf), SFS_BLOCKSIZE);
+		sfs_buf_markdirty(iobuf, sv->sv_ino);
+	}
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * Now perform the requested operation into/out of the buffer.
 	 */
-	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_wblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+	result = uiomove((char *)sfs_buf_data(iobuf)+skipstart, len, uio);
+	if (result == 0 && uio->uio_rw == UIO_WRITE) {
+		/* it'll be written back later */
+		sfs_buf_markdirty(iobuf, sv->sv_ino);
 	}
+	sfs_buf_release(iobuf);
 
-	return 0;
+	return result;
 }
 
 /*
- * Do I/O (either read or write) of a single whole block.
+ * Do I/O (either read or write) of a single whole block, which the
+ * caller has already looked up with sfs_bmap: it is on disk at
+ * DISKBLOCK, and ISNEW is what sfs_bmap said about it.
  */
 static
 int
-sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
+sfs_blockio(struct sfs_vnode *sv, struct uio *uio, uint32_t diskblock,
+	    bool isnew)
 {
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-	uint32_t diskblock;
-	uint32_t fileblock;
+	struct sfs_buf *iobuf;
 	int result;
-	int doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
-	/* Get the block number within the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	KASSERT(diskblock != 0);
 
-	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	/*
+	 * Go through the buffer cache. When writing we replace the
+	 * whole block, so there is no need to read it first.
+	 */
+	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
+	result = sfs_buf_get(sfs, diskblock, uio->uio_rw == UIO_READ, &iobuf);
 	if (result) {
 		return result;
 	}
+	if (isnew) {
+		/* Don't expose stale data if the uiomove fails part way */
+		bzero(sfs_buf_data(iobuf), SFS_BLOCKSIZE);
+	}
 
-	if (diskblock == 0) {
+	result = uiomove(sfs_buf_data(iobuf), SFS_BLOCKSIZE, uio);
+	if (uio->uio_rw == UIO_WRITE) {
 		/*
-		 * No block - fill with zeros.
-		 *
-		 * We must be reading, or sfs_bmap would have
-		 * allocated a block for us.
+		 * Even if the uiomove failed part way, the buffer's
+		 * old contents are gone, so it must be written back.
 		 */
-		KASSERT(uio->uio_rw == UIO_READ);
-		return uiomovezeros(SFS_BLOCKSIZE, uio);
+		sfs_buf_markdirty(iobuf, sv->sv_ino);
 	}
+	sfs_buf_release(iobuf);
 
-	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
-	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
+	return result;
+}
+
+/*
+ * Longest run of whole blocks transferred in one device request, and
+ * shortest one worth bypassing the buffer cache for. Shorter runs are
+ * more likely to be small files (or the tail of one) that will be
+ * touched again soon, so those stay cached.
+ */
+#define SFS_MAXRUN	64
+#define SFS_MINRUN	4
+
+/*
+ * Do I/O of NBLOCKS whole blocks of the file, which are contiguous
+ * on disk starting at DISKBLOCK. ISNEW[i] says whether the i'th one
+ * was just allocated by sfs_bmap.
+ */
+static
+int
+sfs_runio(struct sfs_vnode *sv, struct uio *uio, uint32_t diskblock,
+	  uint32_t nblocks, const bool *isnew)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	size_t startresid;
+	uint32_t i;
+	int result;
+
+	if (nblocks < SFS_MINRUN) {
+		for (i=0; i<nblocks; i++) {
+			result = sfs_blockio(sv, uio, diskblock + i, isnew[i]);
+			if (result) {
+				/* sfs_blockio took care of this one */
+				i++;
+				goto fail;
+			}
+		}
+		return 0;
+	}
+
+	startresid = uio->uio_resid;
+	result = sfs_buf_directio(sfs, diskblock, nblocks, uio);
+	if (result == 0) {
+		return 0;
+	}
 
+	/* Blocks at and past this one didn't get (all of) their data */
+	i = (startresid - uio->uio_resid) / SFS_BLOCKSIZE;
+
+ fail:
 	/*
-	 * Temporarily set the residue to be one block size.
+	 * New blocks the data didn't reach hold whatever was on disk
+	 * before; clear them so it can't be read back through the file.
 	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-	
-	result = sfs_rwblock(sfs, uio);
+	if (uio->uio_rw == UIO_WRITE) {
+		for (; i<nblocks; i++) {
+			if (isnew[i]) {
+				sfs_clearblock(sfs, diskblock + i, sv->sv_ino);
+			}
+		}
+	}
+	return result;
+}
+
+/*
+ * Do I/O of the whole blocks at the (block-aligned) current position
+ * of UIO. Blocks that are consecutive in the file and on disk are
+ * collected into runs, so large sequential transfers of a file laid
+ * out contiguously (see sfs_bmap) take a few device requests instead
+ * of one per block.
+ */
+static
+int
+sfs_wholeio(struct sfs_vnode *sv, struct uio *uio, uint32_t nblocks)
+{
+	/* One extra slot for the block that ends a full run */
+	bool isnew[SFS_MAXRUN + 1];
+	uint32_t fileblock, diskblock, runstart, runlen, i;
+	int doalloc = (uio->uio_rw==UIO_WRITE);
+	int result;
+
+	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
+
+	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	runstart = 0;
+	runlen = 0;
+
+	for (i=0; i<nblocks; i++) {
+		/* Look up the disk block number */
+		result = sfs_bmap(sv, fileblock + i, doalloc, &diskblock,
+				  &isnew[runlen]);
+		if (result) {
+			/* Blocks already in the run may be new; finish them */
+			if (runlen > 0) {
+				sfs_runio(sv, uio, runstart, runlen, isnew);
+			}
+			return result;
+		}
+
+		if (diskblock != 0 && runlen > 0 && runlen < SFS_MAXRUN &&
+		    diskblock == runstart + runlen) {
+			/* Extends the current run */
+			runlen++;
+			continue;
+		}
+
+		/* Doesn't; do the run so far */
+		if (runlen > 0) {
+			bool thisnew = isnew[runlen];
+
+			result = sfs_runio(sv, uio, runstart, runlen, isnew);
+			if (result) {
+				if (thisnew) {
+					sfs_clearblock(sv->sv_v.vn_fs->fs_data,
+						       diskblock, sv->sv_ino);
+				}
+				return result;
+			}
+			isnew[0] = thisnew;
+			runlen = 0;
+		}
+
+		if (diskblock == 0) {
+			/*
+			 * No block - fill with zeros.
+			 *
+			 * We must be reading, or sfs_bmap would have
+			 * allocated a block for us.
+			 */
+			KASSERT(uio->uio_rw == UIO_READ);
+			result = uiomovezeros(SFS_BLOCKSIZE, uio);
+			if (result) {
+				return result;
+			}
+			continue;
+		}
+
+		runstart = diskblock;
+		runlen = 1;
+	}
+
+	if (runlen > 0) {
+		return sfs_runio(sv, uio, runstart, runlen, isnew);
+	}
+	return 0;
+}
+
+/*
+ * Smallest read-ahead window, in blocks. The largest is SFS_RAMAX.
+ */
+#define SFS_RAMIN	2
+
+/*
+ * Sequential read detection. Called after a read of the file that
+ * went from byte STARTPOS to ENDPOS.
+ *
+ * A read that starts where the previous one ended is sequential. Each
+ * one doubles the read-ahead window, up to SFS_RAMAX blocks; any other
+ * read closes it again. While it's open, we keep the blocks within
+ * the window past the current position read ahead into the buffer
+ * cache, topping it up in batches once half of it has been used.
+ *
+ * The VOP interface doesn't tell us which open file a read came
+ * through, so this is per vnode; several readers of one file at once
+ * will mostly just get no read-ahead.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, off_t startpos, off_t endpos)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t blocks[SFS_RAMAX];
+	uint32_t cur, last, fileblock, diskblock;
+	unsigned n;
+	bool isnew;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (startpos != sv->sv_raoffset) {
+		sv->sv_rawindow = 0;
+		sv->sv_raend = 0;
+		sv->sv_raoffset = endpos;
+		return;
+	}
+	sv->sv_raoffset = endpos;
+
+	if (sv->sv_rawindow == 0) {
+		sv->sv_rawindow = SFS_RAMIN;
+	}
+	else if (sv->sv_rawindow < SFS_RAMAX) {
+		sv->sv_rawindow *= 2;
+	}
 
 	/*
-	 * Now, restore the original uio_offset and uio_resid and update 
-	 * them by the amount of I/O done.
+	 * Readers asking for many blocks at a time already get them
+	 * in large device transfers that bypass the cache (see
+	 * sfs_runio); reading ahead into the cache wouldn't help them.
 	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	if (endpos - startpos >= SFS_MINRUN * SFS_BLOCKSIZE ||
+	    sv->sv_i.sfi_size == 0) {
+		return;
+	}
 
-	return result;
+	/* The block the next read will start in, and the window's end */
+	cur = endpos / SFS_BLOCKSIZE;
+	last = (sv->sv_i.sfi_size - 1) / SFS_BLOCKSIZE;
+	if (last > cur + sv->sv_rawindow) {
+		last = cur + sv->sv_rawindow;
+	}
+
+	if (sv->sv_raend < cur + 1) {
+		sv->sv_raend = cur + 1;
+	}
+	else if (sv->sv_raend > cur + sv->sv_rawindow / 2) {
+		/* Still well ahead of the reader */
+		return;
+	}
+
+	n = 0;
+	for (fileblock = sv->sv_raend; fileblock <= last; fileblock++) {
+		if (sfs_bmap(sv, fileblock, 0, &diskblock, &isnew)) {
+			break;
+		}
+		if (diskblock != 0) {
+			blocks[n++] = diskblock;
+		}
+	}
+	sv->sv_raend = fileblock;
+
+	sfs_buf_readahead(sfs, blocks, n);
 }
 
 /*
@@ -448,9 +943,12 @@ int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
 	uint32_t blkoff;
-	uint32_t nblocks, i;
+	uint32_t nblocks;
 	int result = 0;
 	uint32_t extraresid = 0;
+	off_t startpos = uio->uio_offset;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
@@ -506,8 +1004,8 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	 */
 	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
 	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
-	for (i=0; i<nblocks; i++) {
-		result = sfs_blockio(sv, uio);
+	if (nblocks > 0) {
+		result = sfs_wholeio(sv, uio, nblocks);
 		if (result) {
 			goto out;
 		}
@@ -527,6 +1025,11 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 
  out:
 
+	/* If reading sequentially, get the following blocks coming */
+	if (uio->uio_rw == UIO_READ && result == 0) {
+		sfs_readahead(sv, startpos, uio->uio_offset);
+	}
+
 	/* If writing, adjust file length */
 	if (uio->uio_rw == UIO_WRITE && 
 	    uio->uio_offset > (off_t)sv->sv_i.sfi_size) {
@@ -541,6 +1044,199 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	return result;
 }
 
+////////////////////////////////////////////////////////////
+//
+// Mapped pages
+//
+// Buffer cache blocks are smaller than a page, so a file that gets
+// mmap()ed keeps its own page-sized copies, sv_pages, filled through
+// the buffer cache on first use and shared by every mapping of the
+// file. Writes copy what they write into the copies, and truncates
+// zero them, so mappings see the changes; the pages go away with the
+// vnode. (Mappings hold a vnode reference, so that's never while one
+// is still mapped.)
+//
+// Filling a page takes sv_lock, and sfs_write copies from user memory
+// with sv_lock held, so a page fault in that copy mustn't fill one:
+// it could be a page of the same file, or of another file whose
+// writer is waiting for ours. So sfs_write gets the pages of a user
+// buffer in first with uio_prefault, before locking, and bumps
+// t_nomapfill around the copy; a fault then (FILL false in sfs_mmap)
+// only gets pages already present, looked up under the sv_pagelock
+// spinlock. (Reads copy out, and mappings are read-only, so a fault
+// there fails without coming here.)
+
+/*
+ * Make room in sv_pages for file pages up to NPAGES.
+ */
+static
+int
+sfs_pages_grow(struct sfs_vnode *sv, unsigned npages)
+{
+	vaddr_t *newpages, *oldpages;
+	unsigned newsize, i;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (npages <= sv->sv_npages) {
+		return 0;
+	}
+	newsize = sv->sv_npages == 0 ? 8 : sv->sv_npages;
+	while (newsize < npages) {
+		newsize *= 2;
+	}
+	newpages = kmalloc(newsize * sizeof(vaddr_t));
+	if (newpages == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<newsize; i++) {
+		newpages[i] = i < sv->sv_npages ? sv->sv_pages[i] : 0;
+	}
+
+	spinlock_acquire(&sv->sv_pagelock);
+	oldpages = sv->sv_pages;
+	sv->sv_pages = newpages;
+	sv->sv_npages = newsize;
+	spinlock_release(&sv->sv_pagelock);
+
+	if (oldpages != NULL) {
+		kfree(oldpages);
+	}
+	return 0;
+}
+
+/*
+ * Get the copy of file page PAGENO if there is one, or 0, without
+ * sv_lock.
+ */
+static
+vaddr_t
+sfs_pages_lookup(struct sfs_vnode *sv, off_t pageno)
+{
+	vaddr_t kva = 0;
+
+	spinlock_acquire(&sv->sv_pagelock);
+	if (pageno < (off_t)sv->sv_npages) {
+		kva = sv->sv_pages[pageno];
+	}
+	spinlock_release(&sv->sv_pagelock);
+	return kva;
+}
+
+/*
+ * Read file page INDEX into its copy at KVA, zeroing whatever is past
+ * EOF.
+ */
+static
+int
+sfs_page_fill(struct sfs_vnode *sv, unsigned index, vaddr_t kva)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	uio_kinit(&iov, &ku, (void *)kva, PAGE_SIZE,
+		  (off_t)index * PAGE_SIZE, UIO_READ);
+	result = sfs_io(sv, &ku);
+	if (result) {
+		return result;
+	}
+	bzero((char *)kva + (PAGE_SIZE - ku.uio_resid), ku.uio_resid);
+	return 0;
+}
+
+/*
+ * After writing LEN bytes from UIO, a copy of the writer's uio as it
+ * was beforehand, copy them into the copies of the pages they're in.
+ */
+static
+void
+sfs_pages_update(struct sfs_vnode *sv, struct uio *uio, size_t len)
+{
+	off_t index;
+	size_t skip, amt;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+	KASSERT(uio->uio_rw == UIO_WRITE);
+
+	while (len > 0) {
+		index = uio->uio_offset / PAGE_SIZE;
+		if (index >= (off_t)sv->sv_npages) {
+			/* No copies this far into the file */
+			break;
+		}
+		skip = uio->uio_offset % PAGE_SIZE;
+		amt = PAGE_SIZE - skip;
+		if (amt > len) {
+			amt = len;
+		}
+		if (sv->sv_pages[index] == 0) {
+			uioskip(amt, uio);
+		}
+		else {
+			/* This just came from here, so it can't fault */
+			result = uiomove((char *)sv->sv_pages[index] + skip,
+					 amt, uio);
+			if (result) {
+				kprintf("sfs: inode %u: mapped page %u not "
+					"updated: %s\n", sv->sv_ino,
+					(unsigned)index, strerror(result));
+				break;
+			}
+		}
+		len -= amt;
+	}
+}
+
+/*
+ * After truncating to LEN bytes, zero what's past the new EOF in the
+ * copies. They can't be thrown away, as they may still be mapped.
+ */
+static
+void
+sfs_pages_truncate(struct sfs_vnode *sv, off_t len)
+{
+	unsigned index;
+	off_t pagestart;
+	size_t skip;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	for (index = len / PAGE_SIZE; index < sv->sv_npages; index++) {
+		if (sv->sv_pages[index] == 0) {
+			continue;
+		}
+		pagestart = (off_t)index * PAGE_SIZE;
+		skip = len > pagestart ? len - pagestart : 0;
+		bzero((char *)sv->sv_pages[index] + skip, PAGE_SIZE - skip);
+	}
+}
+
+/*
+ * Throw the copies away; the vnode is going.
+ */
+static
+void
+sfs_pages_free(struct sfs_vnode *sv)
+{
+	unsigned i;
+
+	for (i=0; i<sv->sv_npages; i++) {
+		if (sv->sv_pages[i] != 0) {
+			free_kpages(sv->sv_pages[i]);
+		}
+	}
+	if (sv->sv_pages != NULL) {
+		kfree(sv->sv_pages);
+	}
+	sv->sv_pages = NULL;
+	sv->sv_npages = 0;
+	spinlock_cleanup(&sv->sv_pagelock);
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Directory I/O
@@ -637,23 +1333,22 @@ sfs_dir_nentries(struct sfs_vnode *sv)
 }
 
 /*
- * Search a directory for a particular filename in a directory, and
- * return its inode number, its slot, and/or the slot number of an
- * empty directory slot if one is found.
+ * Search slots FIRST through LAST-1 of a directory for a particular
+ * filename, and return its inode number, its slot, and/or the slot
+ * number of an empty directory slot if one is found.
  */
-
 static
 int
-sfs_dir_findname(struct sfs_vnode *sv, const char *name,
-		    uint32_t *ino, int *slot, int *emptyslot)
+sfs_dir_findname_linear(struct sfs_vnode *sv, const char *name,
+			int first, int last,
+			uint32_t *ino, int *slot, int *emptyslot)
 {
 	struct sfs_dir tsd;
 	int found = 0;
-	int nentries = sfs_dir_nentries(sv);
 	int i, result;
 
 	/* For each slot... */
-	for (i=0; i<nentries; i++) {
+	for (i=first; i<last; i++) {
 
 		/* Read the entry from that slot */
 		result = sfs_readdir(sv, &tsd, i);
@@ -685,7 +1380,162 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 		}
 	}
 
-	return found ? 0 : ENOENT;
+	return found ? 0 : ENOENT;
+}
+
+/*
+ * Hash a name for a hashed directory (see kern/sfs.h).
+ */
+static
+uint32_t
+sfs_dir_hash(const char *name)
+{
+	uint32_t h = SFS_DIRHASH_INIT;
+
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= SFS_DIRHASH_MULT;
+	}
+	return h;
+}
+
+/*
+ * Check if directory entry SD holds name NAME, which is at most
+ * SFS_NAMELEN-1 chars long. SD may not be null-terminated.
+ */
+static
+bool
+sfs_dir_nameis(const struct sfs_dir *sd, const char *name)
+{
+	unsigned i;
+
+	for (i=0; i<sizeof(sd->sfd_name); i++) {
+		if (sd->sfd_name[i] != name[i]) {
+			return false;
+		}
+		if (name[i] == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Search bucket BUCKET of a hashed directory for NAME, like
+ * sfs_dir_findname. The bucket is examined in place in the buffer
+ * cache. Sets *NEVERUSED if the bucket has a never-used entry, which
+ * means the search can stop here.
+ */
+static
+int
+sfs_dir_findbucket(struct sfs_vnode *sv, const char *name, uint32_t bucket,
+		   uint32_t *ino, int *slot, int *emptyslot, bool *neverused)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_buf *buf;
+	const struct sfs_dir *sds;
+	uint32_t diskblock;
+	bool isnew;
+	unsigned i;
+	int result;
+
+	*neverused = false;
+
+	result = sfs_bmap(sv, bucket, 0, &diskblock, &isnew);
+	if (result) {
+		return result;
+	}
+	if (diskblock == 0) {
+		/* Never written; all free */
+		if (emptyslot != NULL && *emptyslot < 0) {
+			*emptyslot = bucket * SFS_DIRPERBLOCK;
+		}
+		*neverused = true;
+		return ENOENT;
+	}
+
+	result = sfs_buf_get(sfs, diskblock, true, &buf);
+	if (result) {
+		return result;
+	}
+	sds = sfs_buf_data(buf);
+
+	result = ENOENT;
+	for (i=0; i<SFS_DIRPERBLOCK; i++) {
+		if (sds[i].sfd_ino == SFS_NOINO) {
+			if (emptyslot != NULL && *emptyslot < 0) {
+				*emptyslot = bucket * SFS_DIRPERBLOCK + i;
+			}
+			if (sds[i].sfd_name[1] != SFS_DIR_TOMBSTONE) {
+				*neverused = true;
+			}
+		}
+		else if (sfs_dir_nameis(&sds[i], name)) {
+			if (slot != NULL) {
+				*slot = bucket * SFS_DIRPERBLOCK + i;
+			}
+			if (ino != NULL) {
+				*ino = sds[i].sfd_ino;
+			}
+			result = 0;
+			break;
+		}
+	}
+
+	sfs_buf_release(buf);
+	return result;
+}
+
+/*
+ * Search a directory for a particular filename in a directory, and
+ * return its inode number, its slot, and/or the slot number of an
+ * empty directory slot if one is found.
+ *
+ * For a hashed directory, the empty slot is where the name would go
+ * if created (or -1 for the end of the directory), and the search
+ * normally looks at only one bucket.
+ */
+static
+int
+sfs_dir_findname(struct sfs_vnode *sv, const char *name,
+		    uint32_t *ino, int *slot, int *emptyslot)
+{
+	uint32_t nbuckets = sv->sv_i.sfi_dirhash;
+	uint32_t home, k;
+	bool neverused;
+	int result;
+
+	if (nbuckets == 0) {
+		return sfs_dir_findname_linear(sv, name,
+					       0, sfs_dir_nentries(sv),
+					       ino, slot, emptyslot);
+	}
+
+	if (strlen(name) >= SFS_NAMELEN) {
+		/* Can't be there */
+		return ENOENT;
+	}
+
+	if (emptyslot != NULL) {
+		*emptyslot = -1;
+	}
+
+	home = sfs_dir_hash(name) % nbuckets;
+	for (k=0; k<nbuckets; k++) {
+		result = sfs_dir_findbucket(sv, name, (home + k) % nbuckets,
+					    ino, slot, emptyslot, &neverused);
+		if (result != ENOENT || neverused) {
+			return result;
+		}
+	}
+
+	/* Every bucket is full; look in the overflow area too */
+	return sfs_dir_findname_linear(sv, name,
+				       nbuckets * SFS_DIRPERBLOCK,
+				       sfs_dir_nentries(sv),
+				       ino, slot,
+				       (emptyslot != NULL && *emptyslot < 0) ?
+				       emptyslot : NULL);
 }
 
 /*
@@ -746,6 +1596,11 @@ sfs_dir_unlink(struct sfs_vnode *sv, int slot)
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
+	/* ...which in a hash bucket mustn't end searches (see kern/sfs.h) */
+	if ((uint32_t)slot < sv->sv_i.sfi_dirhash * SFS_DIRPERBLOCK) {
+		sd.sfd_name[1] = SFS_DIR_TOMBSTONE;
+	}
+
 	/* ... and write it */
 	return sfs_writedir(sv, &sd, slot);
 }
@@ -787,22 +1642,30 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name,
 // Object creation
 
 /*
- * Create a new filesystem object and hand back its vnode.
+ * Create a new filesystem object, to go in directory DIR, and hand
+ * back its vnode.
  */
 static
 int
-sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
+sfs_makeobj(struct sfs_fs *sfs, struct sfs_vnode *dir, int type,
+	    struct sfs_vnode **ret)
 {
 	uint32_t ino;
 	int result;
 
 	/*
 	 * First, get an inode. (Each inode is a block, and the inode 
-	 * number is the block number, so just get a block.)
+	 * number is the block number, so just get a block.) Keep it
+	 * near the directory's, and clear it.
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, dir->sv_ino + 1, &ino);
+	if (result) {
+		return result;
+	}
+	result = sfs_clearblock(sfs, ino, ino);
 	if (result) {
+		sfs_bfree(sfs, ino);
 		return result;
 	}
 
@@ -813,6 +1676,93 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	return sfs_loadvnode(sfs, ino, type, ret);
 }
 
+////////////////////////////////////////////////////////////
+//
+// Table of loaded vnodes
+//
+// Loaded vnodes are kept both in the sfs_vnodes array, which is
+// what sync and unmount walk, and in the sfs_vnhash hash table by
+// inode number, which is what sfs_loadvnode searches. Each vnode
+// remembers its array index so it can be removed from both without
+// searching. All of these are called with sfs_vnlock held.
+
+/*
+ * Find the loaded vnode for inode INO, or NULL if not loaded.
+ */
+static
+struct sfs_vnode *
+sfs_vntable_find(struct sfs_fs *sfs, uint32_t ino)
+{
+	struct sfs_vnode *sv;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (sv = sfs->sfs_vnhash[SFS_VNHASH(ino)]; sv; sv = sv->sv_hashnext) {
+		if (sv->sv_ino == ino) {
+			return sv;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Add a newly loaded vnode.
+ */
+static
+int
+sfs_vntable_add(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	unsigned h;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, &sv->sv_index);
+	if (result) {
+		return result;
+	}
+	h = SFS_VNHASH(sv->sv_ino);
+	sv->sv_hashnext = sfs->sfs_vnhash[h];
+	sfs->sfs_vnhash[h] = sv;
+	return 0;
+}
+
+/*
+ * Remove a vnode being reclaimed.
+ */
+static
+void
+sfs_vntable_remove(struct sfs_fs *sfs, struct sfs_vnode *sv)
+{
+	struct sfs_vnode **pp;
+	struct vnode *last;
+	unsigned num;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (pp = &sfs->sfs_vnhash[SFS_VNHASH(sv->sv_ino)]; *pp != sv;
+	     pp = &(*pp)->sv_hashnext) {
+		if (*pp == NULL) {
+			panic("sfs: reclaim vnode %u not in vnode pool\n",
+			      sv->sv_ino);
+		}
+	}
+	*pp = sv->sv_hashnext;
+	sv->sv_hashnext = NULL;
+
+	/* Move the last vnode in the array into our slot. */
+	num = vnodearray_num(sfs->sfs_vnodes);
+	KASSERT(sv->sv_index < num);
+	KASSERT(vnodearray_get(sfs->sfs_vnodes, sv->sv_index) == &sv->sv_v);
+	last = vnodearray_get(sfs->sfs_vnodes, num - 1);
+	vnodearray_set(sfs->sfs_vnodes, sv->sv_index, last);
+	((struct sfs_vnode *)last->vn_data)->sv_index = sv->sv_index;
+	result = vnodearray_setsize(sfs->sfs_vnodes, num - 1);
+	/* shrinking never fails */
+	KASSERT(result == 0);
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Vnode ops
@@ -875,8 +1825,20 @@ static
 int
 sfs_close(struct vnode *v)
 {
-	/* Sync it. */
-	return VOP_FSYNC(v);
+	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	/*
+	 * Put the inode in the buffer cache. It and the file's data
+	 * go to disk with the next sync (or fsync), not on every
+	 * close.
+	 */
+	lock_acquire(sv->sv_lock);
+	sfs_unreserve(sv);
+	result = sfs_sync_inode(sv);
+	lock_release(sv->sv_lock);
+
+	return result;
 }
 
 /*
@@ -890,31 +1852,42 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
 	int result;
 
-	vfs_biglock_acquire();
+	/*
+	 * Holding sfs_vnlock keeps sfs_loadvnode from handing out
+	 * new references while we decide.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it.
 	 */
+	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
 
 		/* consume the reference VOP_DECREF gave us */
 		KASSERT(v->vn_refcount>1);
 		v->vn_refcount--;
 
-		vfs_biglock_release();
+		spinlock_release(&v->vn_countlock);
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
+
+	/* Nobody else has, or can get, a reference now. */
+	lock_acquire(sv->sv_lock);
+
+	sfs_unreserve(sv);
 
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount==0) {
-		result = VOP_TRUNCATE(&sv->sv_v, 0);
+		result = sfs_dotruncate(sv, 0);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sv->sv_lock);
+			lock_release(sfs->sfs_vnlock);
 			return result;
 		}
 	}
@@ -922,7 +1895,8 @@ sfs_reclaim(struct vnode *v)
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
@@ -931,26 +1905,16 @@ sfs_reclaim(struct vnode *v)
 		sfs_bfree(sfs, sv->sv_ino);
 	}
 
+	lock_release(sv->sv_lock);
+
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
-		}
-	}
-	if (ix == num) {
-		panic("sfs: reclaim vnode %u not in vnode pool\n",
-		      sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	sfs_vntable_remove(sfs, sv);
 
-	VOP_CLEANUP(&sv->sv_v);
+	lock_release(sfs->sfs_vnlock);
 
-	vfs_biglock_release();
+	sfs_pages_free(sv);
+	lock_destroy(sv->sv_lock);
+	VOP_CLEANUP(&sv->sv_v);
 
 	/* Release the storage for the vnode structure itself. */
 	kfree(sv);
@@ -971,9 +1935,9 @@ sfs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 
 	return result;
 }
@@ -986,13 +1950,39 @@ int
 sfs_write(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct uio pageuio;
+	struct iovec *pageiov = NULL;
+	size_t startresid;
 	int result;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
+	/* The data may come from a mapping; see "Mapped pages" */
+	uio_prefault(uio);
+
+	lock_acquire(sv->sv_lock);
+	if (sv->sv_pages != NULL) {
+		/* Remember where the data comes from, for the copies */
+		pageiov = kmalloc(uio->uio_iovcnt * sizeof(struct iovec));
+		if (pageiov == NULL) {
+			lock_release(sv->sv_lock);
+			return ENOMEM;
+		}
+		memcpy(pageiov, uio->uio_iov,
+		       uio->uio_iovcnt * sizeof(struct iovec));
+		pageuio = *uio;
+		pageuio.uio_iov = pageiov;
+	}
+	startresid = uio->uio_resid;
+	curthread->t_nomapfill++;
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	curthread->t_nomapfill--;
+	if (pageiov != NULL) {
+		/* even on error; some of it may have been written */
+		sfs_pages_update(sv, &pageuio, startresid - uio->uio_resid);
+		kfree(pageiov);
+	}
+	lock_release(sv->sv_lock);
 
 	return result;
 }
@@ -1033,7 +2023,9 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	lock_acquire(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
+	lock_release(sv->sv_lock);
 
 	/* We don't support these yet; you get to implement them */
 	statbuf->st_nlink = 0;
@@ -1053,16 +2045,13 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* The type never changes, so no locking is needed */
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -1100,118 +2089,253 @@ int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
+	if (result == 0) {
+		/* Only this file's blocks, including its inode */
+		result = sfs_buf_syncfile(sfs, sv->sv_ino);
+	}
 
 	return result;
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(), and then to fault in each page; see "Mapped
+ * pages" above.
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v, off_t offset, bool fill, paddr_t *ret)
 {
-	(void)v;
-	return EUNIMP;
+	struct sfs_vnode *sv = v->vn_data;
+	unsigned index;
+	vaddr_t kva;
+	int result;
+
+	if (ret == NULL) {
+		/* Any regular file can be mapped */
+		return 0;
+	}
+
+	KASSERT(offset % PAGE_SIZE == 0);
+	if (offset < 0) {
+		return EFAULT;
+	}
+
+	/* A page already in memory needs no sv_lock */
+	kva = sfs_pages_lookup(sv, offset / PAGE_SIZE);
+	if (kva != 0) {
+		*ret = KVADDR_TO_PADDR(kva);
+		return 0;
+	}
+	if (!fill) {
+		return EFAULT;
+	}
+
+	lock_acquire(sv->sv_lock);
+	if (offset >= (off_t)sv->sv_i.sfi_size) {
+		lock_release(sv->sv_lock);
+		return EFAULT;
+	}
+	index = offset / PAGE_SIZE;
+
+	result = sfs_pages_grow(sv, index + 1);
+	if (result) {
+		lock_release(sv->sv_lock);
+		return result;
+	}
+
+	kva = sv->sv_pages[index];
+	if (kva == 0) {
+		kva = alloc_kpages(1);
+		if (kva == 0) {
+			lock_release(sv->sv_lock);
+			return ENOMEM;
+		}
+		result = sfs_page_fill(sv, index, kva);
+		if (result) {
+			free_kpages(kva);
+			lock_release(sv->sv_lock);
+			return result;
+		}
+		spinlock_acquire(&sv->sv_pagelock);
+		sv->sv_pages[index] = kva;
+		spinlock_release(&sv->sv_pagelock);
+	}
+	*ret = KVADDR_TO_PADDR(kva);
+	lock_release(sv->sv_lock);
+
+	return 0;
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Free the blocks of file SV at and past file block BLOCKLEN that
+ * are under the level-LEVEL indirect block *IDBLOCKP, whose range of
+ * the file starts at file block BASE. (Level 1 indirect blocks point
+ * to data blocks.) If that leaves the indirect block empty, free it
+ * too and set *IDBLOCKP to 0.
  */
 static
 int
-sfs_truncate(struct vnode *v, off_t len)
+sfs_truncate_indirect(struct sfs_vnode *sv, uint32_t *idblockp,
+		      unsigned level, uint32_t base, uint32_t blocklen)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
-	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-
-	/* Length in blocks (divide rounding up) */
-	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
-
-	uint32_t i, j, block;
-	uint32_t idblock, baseblock, highblock;
-	int result;
+	struct sfs_buf *idbufobj;
+	uint32_t *idbuf;
+	uint32_t span, child;
+	unsigned i, j;
 	int hasnonzero, iddirty;
+	int result = 0;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
-
-	vfs_biglock_acquire();
-
-	/*
-	 * Go through the direct blocks. Discard any that are
-	 * past the limit we're truncating to.
-	 */
-	for (i=0; i<SFS_NDIRECT; i++) {
-		block = sv->sv_i.sfi_direct[i];
-		if (i >= blocklen && block != 0) {
-			sfs_bfree(sfs, block);
-			sv->sv_i.sfi_direct[i] = 0;
-			sv->sv_dirty = true;
-		}
+	if (*idblockp == 0) {
+		return 0;
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
-
-	/* The lowest block in the indirect block */
-	baseblock = SFS_NDIRECT;
+	/* Number of file blocks each entry covers */
+	span = 1;
+	for (i=1; i<level; i++) {
+		span *= SFS_DBPERIDB;
+	}
 
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
+	if (blocklen >= base + span * SFS_DBPERIDB) {
+		/* All of it is before the new EOF */
+		return 0;
+	}
 
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
+	/* Read the indirect block */
+	result = sfs_buf_get(sfs, *idblockp, true, &idbufobj);
+	if (result) {
+		return result;
+	}
+	idbuf = sfs_buf_data(idbufobj);
 
-		/* Read the indirect block */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-		
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
+	hasnonzero = 0;
+	iddirty = 0;
+	for (j=0; j<SFS_DBPERIDB; j++) {
+		if (idbuf[j] != 0 && blocklen < base + (j+1) * span) {
+			/* Some of it is past the new EOF */
+			if (level == 1) {
 				sfs_bfree(sfs, idbuf[j]);
 				idbuf[j] = 0;
 				iddirty = 1;
 			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
+			else {
+				child = idbuf[j];
+				result = sfs_truncate_indirect(sv, &child,
+							       level - 1,
+							       base + j*span,
+							       blocklen);
+				if (child != idbuf[j]) {
+					idbuf[j] = child;
+					iddirty = 1;
+				}
+				if (result) {
+					break;
+				}
 			}
 		}
+		/* Remember if we see any nonzero blocks in here */
+		if (idbuf[j]!=0) {
+			hasnonzero=1;
+		}
+	}
 
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
+	if (iddirty) {
+		/* The indirect block is dirty */
+		sfs_buf_markdirty(idbufobj, sv->sv_ino);
+	}
+	sfs_buf_release(idbufobj);
+
+	if (result == 0 && !hasnonzero) {
+		/* The whole indirect block is empty now; free it */
+		sfs_bfree(sfs, *idblockp);
+		*idblockp = 0;
+	}
+	return result;
+}
+
+/*
+ * Truncate (or extend) a file to LEN bytes. Used for ftruncate() and
+ * from sfs_reclaim. The caller holds the vnode's lock.
+ */
+static
+int
+sfs_dotruncate(struct sfs_vnode *sv, off_t len)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	uint32_t blocklen;
+	uint32_t i, block;
+	uint32_t ind, dind, tind;
+	int result;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	if (len > (off_t)SFS_MAXFILEBLOCKS * SFS_BLOCKSIZE) {
+		return EFBIG;
+	}
+
+	/* Length in blocks (divide rounding up) */
+	blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
+
+	/* The reservation might be past the new end; just drop it */
+	sfs_unreserve(sv);
+
+	/* Likewise what was read ahead */
+	sv->sv_raend = 0;
+
+	/*
+	 * Go through the indirect blocks, and then the direct blocks,
+	 * discarding any blocks past the limit we're truncating to.
+	 * Going from the end backwards means that if we fail part way
+	 * the file has no holes that weren't there before.
+	 */
+	ind = SFS_NDIRECT;
+	dind = ind + SFS_DBPERIDB;
+	tind = dind + SFS_DBPERIDB * SFS_DBPERIDB;
+
+	block = sv->sv_i.sfi_tindirect;
+	result = sfs_truncate_indirect(sv, &sv->sv_i.sfi_tindirect, 3,
+				       tind, blocklen);
+	if (block != sv->sv_i.sfi_tindirect) {
+		sv->sv_dirty = true;
+	}
+	if (result) {
+		return result;
+	}
+
+	block = sv->sv_i.sfi_dindirect;
+	result = sfs_truncate_indirect(sv, &sv->sv_i.sfi_dindirect, 2,
+				       dind, blocklen);
+	if (block != sv->sv_i.sfi_dindirect) {
+		sv->sv_dirty = true;
+	}
+	if (result) {
+		return result;
+	}
+
+	block = sv->sv_i.sfi_indirect;
+	result = sfs_truncate_indirect(sv, &sv->sv_i.sfi_indirect, 1,
+				       ind, blocklen);
+	if (block != sv->sv_i.sfi_indirect) {
+		sv->sv_dirty = true;
+	}
+	if (result) {
+		return result;
+	}
+
+	for (i=0; i<SFS_NDIRECT; i++) {
+		block = sv->sv_i.sfi_direct[i];
+		if (i >= blocklen && block != 0) {
+			sfs_bfree(sfs, block);
+			sv->sv_i.sfi_direct[i] = 0;
 			sv->sv_dirty = true;
 		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_wblock(sfs, idbuf, idblock);
-			if (result) {
-				vfs_biglock_release();
-				return result;
-			}
-		}
 	}
 
 	/* Set the file size */
@@ -1220,10 +2344,29 @@ sfs_truncate(struct vnode *v, off_t len)
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
 	return 0;
 }
 
+/*
+ * Called for ftruncate().
+ */
+static
+int
+sfs_truncate(struct vnode *v, off_t len)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	int result;
+
+	lock_acquire(sv->sv_lock);
+	result = sfs_dotruncate(sv, len);
+	if (result == 0 && sv->sv_pages != NULL) {
+		sfs_pages_truncate(sv, len);
+	}
+	lock_release(sv->sv_lock);
+
+	return result;
+}
+
 /*
  * Get the full pathname for a file. This only needs to work on directories.
  * Since we don't support subdirectories, assume it's the root directory
@@ -1259,37 +2402,36 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look up the name */
 	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return EEXIST;
 	}
 
 	if (result==0) {
 		/* We got a file; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
+		lock_release(sv->sv_lock);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
 		*ret = &newguy->sv_v;
-		vfs_biglock_release();
 		return 0;
 	}
 
 	/* Didn't exist - create it */
-	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
+	result = sfs_makeobj(sfs, sv, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
@@ -1299,20 +2441,23 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	/* Link it into the directory */
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
+		lock_release(sv->sv_lock);
 		VOP_DECREF(&newguy->sv_v);
-		vfs_biglock_release();
 		return result;
 	}
 
-	/* Update the linkcount of the new file */
+	/*
+	 * Update the linkcount of the new file and consequently mark
+	 * it dirty. Only sync can have found it yet, but it might.
+	 */
+	lock_acquire(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
-
-	/* and consequently mark it dirty. */
 	newguy->sv_dirty = true;
+	lock_release(newguy->sv_lock);
+
+	lock_release(sv->sv_lock);
 
 	*ret = &newguy->sv_v;
-	
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1331,21 +2476,25 @@ sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
+	/* Can't hard-link the directory (and we'd deadlock trying) */
+	if (f == sv) {
+		return EINVAL;
+	}
+
+	lock_acquire(sv->sv_lock);
+	lock_acquire(f->sv_lock);
 
 	/* Just create a link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
-	if (result) {
-		vfs_biglock_release();
-		return result;
+	if (result == 0) {
+		/* and update the link count, marking the inode dirty */
+		f->sv_i.sfi_linkcount++;
+		f->sv_dirty = true;
 	}
 
-	/* and update the link count, marking the inode dirty */
-	f->sv_i.sfi_linkcount++;
-	f->sv_dirty = true;
-
-	vfs_biglock_release();
-	return 0;
+	lock_release(f->sv_lock);
+	lock_release(sv->sv_lock);
+	return result;
 }
 
 /*
@@ -1360,28 +2509,38 @@ sfs_remove(struct vnode *dir, const char *name)
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	lock_acquire(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
+	/* Don't let "." (which sfsck may create) remove the directory */
+	if (victim == sv) {
+		lock_release(sv->sv_lock);
+		VOP_DECREF(&victim->sv_v);
+		return EINVAL;
+	}
+
 	/* Erase its directory entry. */
 	result = sfs_dir_unlink(sv, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
+		lock_acquire(victim->sv_lock);
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+		lock_release(victim->sv_lock);
 	}
 
+	lock_release(sv->sv_lock);
+
 	/* Discard the reference that sfs_lookonce got us */
 	VOP_DECREF(&victim->sv_v);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -1401,21 +2560,23 @@ sfs_rename(struct vnode *d1, const char *n1,
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
-
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOT_LOCATION);
 
+	lock_acquire(sv->sv_lock);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
 		return result;
 	}
 
 	/* We don't support subdirectories */
 	KASSERT(g1->sv_i.sfi_type == SFS_TYPE_FILE);
 
+	lock_acquire(g1->sv_lock);
+
 	/*
 	 * Link it under the new name.
 	 *
@@ -1447,10 +2608,12 @@ sfs_rename(struct vnode *d1, const char *n1,
 	g1->sv_i.sfi_linkcount--;
 	g1->sv_dirty = true;
 
+	lock_release(g1->sv_lock);
+	lock_release(sv->sv_lock);
+
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
 
-	vfs_biglock_release();
 	return 0;
 
  puke_harder:
@@ -1466,9 +2629,10 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 	g1->sv_i.sfi_linkcount--;
  puke:
+	lock_release(g1->sv_lock);
+	lock_release(sv->sv_lock);
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
-	vfs_biglock_release();
 	return result;
 }
 
@@ -1486,15 +2650,13 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
+	/* Only looks at the type, which never changes; no locking */
 
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -1502,7 +2664,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_v);
 	*ret = &sv->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1520,22 +2681,19 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
-	
+
+	lock_acquire(sv->sv_lock);
 	result = sfs_lookonce(sv, path, &final, NULL);
+	lock_release(sv->sv_lock);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	*ret = &final->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1645,48 +2803,52 @@ static const struct vnode_ops sfs_dirops = {
 /*
  * Function to load a inode into memory as a vnode, or dig up one
  * that's already resident.
+ *
+ * This holds sfs_vnlock throughout, so that a given inode is loaded
+ * only once and so sfs_reclaim can't free a vnode we're handing out.
  */
 static
 int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
+	struct sfs_buf *buf;
 	const struct vnode_ops *ops = NULL;
-	unsigned i, num;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	lock_acquire(sfs->sfs_vnlock);
 
+	/* Look in the vnodes table */
+	sv = sfs_vntable_find(sfs, ino);
+	if (sv != NULL) {
 		/* Every inode in memory must be in an allocated block */
 		if (!sfs_bused(sfs, sv->sv_ino)) {
 			panic("sfs: Found inode %u in unallocated block\n",
 			      sv->sv_ino);
 		}
 
-		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* May only be set when creating new objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
+		/* May only be set when creating new objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
 
-			VOP_INCREF(&sv->sv_v);
-			*ret = sv;
-			return 0;
-		}
+		VOP_INCREF(&sv->sv_v);
+		lock_release(sfs->sfs_vnlock);
+		*ret = sv;
+		return 0;
 	}
 
 	/* Didn't have it loaded; load it */
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+
+	sv->sv_lock = lock_create("sfs vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -1697,14 +2859,26 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	}
 
 	/* Read the block the inode is in */
-	result = sfs_rblock(sfs, &sv->sv_i, ino);
+	result = sfs_buf_get(sfs, ino, true, &buf);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
+	memcpy(&sv->sv_i, sfs_buf_data(buf), sizeof(sv->sv_i));
+	sfs_buf_release(buf);
 
-	/* Not dirty yet */
+	/* Not dirty yet, and nothing set aside for it */
 	sv->sv_dirty = false;
+	sv->sv_resvstart = 0;
+	sv->sv_resvcount = 0;
+	sv->sv_raoffset = 0;
+	sv->sv_rawindow = 0;
+	sv->sv_raend = 0;
+	sv->sv_pages = NULL;
+	sv->sv_npages = 0;
+	spinlock_init(&sv->sv_pagelock);
 
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
@@ -1736,7 +2910,10 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		spinlock_cleanup(&sv->sv_pagelock);
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
@@ -1744,13 +2921,18 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	sv->sv_ino = ino;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
+	result = sfs_vntable_add(sfs, sv);
 	if (result) {
 		VOP_CLEANUP(&sv->sv_v);
+		spinlock_cleanup(&sv->sv_pagelock);
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
+	lock_release(sfs->sfs_vnlock);
+
 	/* Hand it back */
 	*ret = sv;
 	return 0;
@@ -1767,14 +2949,10 @@ sfs_getroot(struct fs *fs)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOT_LOCATION, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		panic("sfs: getroot: Cannot load root vnode\n");
 	}
 
-	vfs_biglock_release();
-
 	return &sv->sv_v;
 }
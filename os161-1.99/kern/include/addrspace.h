@@ -40,6 +40,18 @@
 
 struct vnode;
 
+/*
+ * A file mapped with mmap(): NPAGES pages at BASE show the file VN
+ * from OFFSET on, read-only, faulted in on demand from VOP_MMAP.
+ */
+struct as_mapping {
+	vaddr_t am_base;
+	size_t am_npages;
+	struct vnode *am_vn;		/* holds a reference */
+	off_t am_offset;		/* file offset of am_base */
+	struct as_mapping *am_next;	/* by address */
+};
+
 
 /* 
  * Address space - data structure associated with the virtual memory
@@ -57,6 +69,7 @@ struct addrspace {
   size_t as_npages2;
   paddr_t as_stackpbase;
   
+  struct as_mapping *as_maps;	/* mmap()ed files, by address */
 #if OPT_A3
   bool loaded;
 #endif
@@ -96,6 +109,22 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_map    - map LEN bytes of file VN, from page-aligned OFFSET on,
+ *                somewhere free in the address space; hands back
+ *                where. Takes its own reference to VN.
+ *
+ *    as_unmap  - remove any mappings of pages in LEN bytes from
+ *                page-aligned ADDR. Pieces of mappings outside the
+ *                range stay mapped.
+ *
+ *    as_prefault - get the file pages mapped in LEN bytes from ADDR
+ *                into memory, so that a copy with t_nomapfill set
+ *                (see thread.h) can touch them without calling into
+ *                the file system to read a page in. Called through
+ *                uio_prefault before a file system locks a file for
+ *                I/O from user memory. Failures are left for the copy
+ *                to find.
  */
 
 struct addrspace *as_create(void);
@@ -112,6 +141,10 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_map(struct addrspace *as, size_t len,
+                         struct vnode *vn, off_t offset, vaddr_t *ret);
+int               as_unmap(struct addrspace *as, vaddr_t addr, size_t len);
+void              as_prefault(struct addrspace *as, vaddr_t addr, size_t len);
 
 
 /*
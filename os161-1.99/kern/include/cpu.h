@@ -60,6 +60,14 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 
+	/*
+	 * Accessed only by this cpu, at splhigh.
+	 * Dead threads kept (with their stacks) for reuse by thread_fork.
+	 */
+	struct threadlist c_threadcache; /* Recycled thread structures */
+	unsigned c_threadcache_hits;	/* Forks served from the cache */
+	unsigned c_threadcache_misses;	/* Forks that had to kmalloc */
+
 	/*
 	 * Accessed by other cpus.
 	 * Protected by the runqueue lock.
@@ -108,6 +116,12 @@ void cpu_machdep_init(struct cpu *);
 /*ASMLINKAGE*/ void cpu_start_secondary(void);
 void cpu_hatch(unsigned software_number);
 
+/*
+ * Return the number of cpus (online or starting up). CPU numbers
+ * (c_number) run from 0 to this minus one.
+ */
+unsigned cpu_count(void);
+
 /*
  * Return a string describing the CPU type.
  */
@@ -37,14 +37,36 @@
 
 struct uio;  /* in <uio.h> */
 
+/*
+ * An asynchronous transfer between a block device and a kernel
+ * buffer. da_offset and da_len must be multiples of the block size.
+ *
+ * da_done is called once the transfer is over, with 0 or an error.
+ * It may be called from an interrupt handler (so it must not sleep),
+ * on any cpu, and possibly before the call that started the transfer
+ * has returned. Until then the request and the buffer belong to the
+ * device.
+ */
+struct device_aio {
+	void *da_buf;			/* kernel buffer */
+	off_t da_offset;		/* where on the device */
+	size_t da_len;			/* how much */
+	bool da_write;			/* write (else read) */
+	void (*da_done)(struct device_aio *, int result);
+	void *da_data;			/* for da_done's use */
+};
+
 /*
  * Filesystem-namespace-accessible device.
  * d_io is for both reads and writes; the uio indicates the direction.
+ * d_aio starts an asynchronous transfer; devices that can't do that
+ * leave it NULL (see dev_aio).
  */
 struct device {
 	int (*d_open)(struct device *, int flags_from_open);
 	int (*d_close)(struct device *);
 	int (*d_io)(struct device *, struct uio *);
+	int (*d_aio)(struct device *, struct device_aio *);
 	int (*d_ioctl)(struct device *, int op, userptr_t data);
 
 	blkcnt_t d_blocks;
@@ -58,6 +80,9 @@ struct device {
 /* Create vnode for a vfs-level device. */
 struct vnode *dev_create_vnode(struct device *dev);
 
+/* Start an asynchronous transfer, or do it now if the device can't. */
+int dev_aio(struct device *dev, struct device_aio *aio);
+
 
 /* Initialization functions for builtin vfs-level devices. */
 void devnull_create(void);
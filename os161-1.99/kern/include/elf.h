@@ -193,8 +193,58 @@ typedef struct {
 #define	PF_X		0x1	/* Segment is executable */
 
 
+/*
+ * Section header. There are Ehdr.e_shnum of these, at Ehdr.e_shoff
+ * in the file. Loading doesn't use them; they're only needed to find
+ * the symbol table.
+ */
+typedef struct {
+	uint32_t	sh_name;     /* Name (index into section name table) */
+	uint32_t	sh_type;     /* Type of section */
+	uint32_t	sh_flags;    /* Flags */
+	uint32_t	sh_addr;     /* Address when loaded, if it is */
+	uint32_t	sh_offset;   /* Location of data within file */
+	uint32_t	sh_size;     /* Size of data */
+	uint32_t	sh_link;     /* Associated section, depending on type */
+	uint32_t	sh_info;     /* Extra information, depending on type */
+	uint32_t	sh_addralign;/* Required alignment */
+	uint32_t	sh_entsize;  /* Size of each entry, for tables */
+} Elf32_Shdr;
+
+/* values for sh_type (only the ones we care about) */
+#define	SHT_NULL	0		/* Section header entry unused */
+#define	SHT_PROGBITS	1		/* Program data */
+#define	SHT_SYMTAB	2		/* Symbol table */
+#define	SHT_STRTAB	3		/* String table */
+#define	SHT_NOBITS	8		/* Zero-filled (bss) */
+
+/*
+ * Symbol table entry. For a SHT_SYMTAB section, sh_link is the
+ * string table st_name indexes.
+ */
+typedef struct {
+	uint32_t	st_name;     /* Name (index into string table) */
+	uint32_t	st_value;    /* Value (address, for functions) */
+	uint32_t	st_size;     /* Size (length, for functions) */
+	unsigned char	st_info;     /* Binding and type */
+	unsigned char	st_other;    /* Ignore */
+	uint16_t	st_shndx;    /* Section it's in */
+} Elf32_Sym;
+
+#define	ELF32_ST_TYPE(info)	((info) & 0xf)
+
+/* values for ELF32_ST_TYPE */
+#define	STT_NOTYPE	0		/* Unspecified */
+#define	STT_OBJECT	1		/* Data */
+#define	STT_FUNC	2		/* Function */
+#define	STT_SECTION	3		/* Section */
+#define	STT_FILE	4		/* Source file name */
+
+
 typedef Elf32_Ehdr Elf_Ehdr;
 typedef Elf32_Phdr Elf_Phdr;
+typedef Elf32_Shdr Elf_Shdr;
+typedef Elf32_Sym Elf_Sym;
 
 
 #endif /* _ELF_H_ */
@@ -59,6 +59,11 @@
  * filesystem should have been discarded/released.
  *
  * fs_data is a pointer to filesystem-specific data.
+ *
+ * fs_uniquevnodes is true if the filesystem never has more than one
+ * vnode for the same file at once, so that a file can be identified
+ * by its vnode. The name cache uses this to forget just the names
+ * that change; otherwise it forgets all names on the filesystem.
  */
 
 struct fs {
@@ -68,6 +73,7 @@ struct fs {
 	int           (*fs_unmount)(struct fs *);
 
 	void *fs_data;
+	bool fs_uniquevnodes;
 };
 
 /*
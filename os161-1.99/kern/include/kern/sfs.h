@@ -71,7 +71,8 @@ struct sfs_super {
 	uint32_t sp_magic;		/* Magic number, should be SFS_MAGIC */
 	uint32_t sp_nblocks;			/* Number of blocks in fs */
 	char sp_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];
+	uint32_t sp_nfree;			/* Number of free blocks */
+	uint32_t reserved[117];
 };
 
 /*
@@ -83,9 +84,21 @@ struct sfs_inode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
+	uint32_t sfi_dirhash;			/* Hashed dir: # of buckets */
+	uint32_t sfi_waste[128-6-SFS_NDIRECT];	/* unused space, set to 0 */
 };
 
+/* Tell sfsck about the double and triple indirect blocks */
+#define HAS_DIDIRECT
+#define HAS_TIDIRECT
+
+/* Largest file, in blocks */
+#define SFS_MAXFILEBLOCKS (SFS_NDIRECT + SFS_DBPERIDB + \
+			   SFS_DBPERIDB * SFS_DBPERIDB + \
+			   SFS_DBPERIDB * SFS_DBPERIDB * SFS_DBPERIDB)
+
 /*
  * On-disk directory entry
  */
@@ -94,5 +107,34 @@ struct sfs_dir {
 	char sfd_name[SFS_NAMELEN];		/* Filename */
 };
 
+/* Directory entries per block */
+#define SFS_DIRPERBLOCK   (SFS_BLOCKSIZE / sizeof(struct sfs_dir))
+
+/*
+ * Hashed directories.
+ *
+ * A directory whose sfi_dirhash is 0 is a plain array of entries,
+ * searched from one end to the other. Otherwise its first sfi_dirhash
+ * blocks are hash buckets, and the directory is at least that long
+ * (blocks never written are holes). A name goes in the first free
+ * entry of bucket (hash of name) % sfi_dirhash, or if that's full the
+ * next bucket, and so on around; if every bucket is full, at the end
+ * of the directory, past the buckets.
+ *
+ * A search for a name can stop at the first bucket in that sequence
+ * with a never-used entry. So that this stays true, removing a name
+ * from a bucket leaves a tombstone: a free entry (sfd_ino SFS_NOINO,
+ * empty name) with sfd_name[1] set to SFS_DIR_TOMBSTONE. Tombstones
+ * are reused for new names but don't stop searches.
+ *
+ * The hash is 32-bit FNV-1a over the bytes of the name: starting
+ * from SFS_DIRHASH_INIT, for each byte, xor it in and then multiply
+ * by SFS_DIRHASH_MULT.
+ */
+#define SFS_DIRHASH_NBUCKETS 64         /* buckets in a new hashed dir */
+#define SFS_DIRHASH_INIT     2166136261U
+#define SFS_DIRHASH_MULT     16777619U
+#define SFS_DIR_TOMBSTONE    0x7f
+
 
 #endif /* _KERN_SFS_H_ */
@@ -91,9 +91,12 @@
 #define DB_SYNCPROB    0x1000
 
 extern uint32_t dbflags;
+extern bool dbtrace;
 
 /*
- * DEBUG() is for conditionally printing debug messages to the console.
+ * DEBUG() is for conditionally printing debug messages to the console,
+ * or if dbtrace is set, to the trace buffer (see <trace.h>), which is
+ * much faster and so usable in busy paths.
  *
  * The idea is that you put lots of lines of the form
  *
@@ -108,7 +111,8 @@ extern uint32_t dbflags;
  *
  * DEBUG is a varargs macro. These were added to the language in C99.
  */
-#define DEBUG(d, ...) ((dbflags & (d)) ? kprintf(__VA_ARGS__) : 0)
+#define DEBUG(d, ...) ((dbflags & (d)) ? \
+	(dbtrace ? trace_printf(d, __VA_ARGS__) : kprintf(__VA_ARGS__)) : 0)
 
 /*
  * Random number generator, using the random device.
@@ -168,6 +172,7 @@ void beep(void);
  * Higher-level console output.
  *
  * kprintf is like printf, only in the kernel.
+ * trace_printf is what DEBUG uses to put a message in the trace buffer.
  * panic prepends the string "panic: " to the message printed, and then
  * resets the system.
  * badassert calls panic in a way suitable for an assertion failure.
@@ -178,6 +183,7 @@ void beep(void);
  * threads are created.
  */
 int kprintf(const char *format, ...) __PF(1,2);
+int trace_printf(uint32_t class, const char *format, ...) __PF(2,3);
 void panic(const char *format, ...) __PF(1,2);
 void badassert(const char *expr, const char *file, int line, const char *func);
 
@@ -0,0 +1,31 @@
+#ifndef _PROF_H_
+#define _PROF_H_
+
+/*
+ * Sampling profiler. While it's running, every clock tick records
+ * the pc it interrupted, kernel or user, in a per-cpu table of
+ * (pc, count). prof_dump merges the cpus and prints the most common
+ * pcs, with kernel ones looked up in the kernel's ELF symbol table.
+ *
+ * Sampling takes no lock: each cpu only touches its own table, and
+ * only from the clock interrupt. If a table fills up, further new
+ * pcs on that cpu are counted as dropped rather than recorded.
+ */
+
+/* Called from the clock interrupt, with interrupts off. */
+void prof_sample(vaddr_t pc, bool user);
+
+/* Throw away old samples and start taking new ones. */
+int prof_start(void);
+
+/* Stop taking samples (they're kept for prof_dump). */
+void prof_stop(void);
+
+/*
+ * Print the TOPN most common pcs, symbolized against the kernel
+ * image in KERNELPATH (e.g. "emu0:kernel"). If the file can't be
+ * read, addresses are printed without symbols.
+ */
+void prof_dump(unsigned topn, const char *kernelpath);
+
+#endif /* _PROF_H_ */
@@ -48,21 +48,76 @@
  */
 #include <kern/sfs.h>
 
+/*
+ * Locking.
+ *
+ *    sv_lock            - per vnode; protects the in-memory inode
+ *                         (sv_i, sv_dirty), the block reservation,
+ *                         the file's contents, including directory
+ *                         entries, and its mapped pages.
+ *    sv_pagelock        - per vnode spinlock; also protects the table
+ *                         of mapped pages (sv_pages, sv_npages), which
+ *                         is only changed with both held, so a page
+ *                         fault can look a page up without sv_lock.
+ *    sfs_vnlock         - per volume; protects the table of loaded
+ *                         vnodes. Held while handing out a reference
+ *                         to an already loaded vnode and while deciding
+ *                         to reclaim one, so the two can't race.
+ *    sfs_freemaplock    - per volume; protects the free block bitmap,
+ *                         the superblock, and their dirty flags.
+ *    buffer cache lock  - internal to sfs_cache.c; also protects
+ *                         sfs_iopending.
+ *
+ * Lock order: directory sv_lock, then sfs_vnlock, then file sv_lock,
+ * then sfs_freemaplock, then the buffer cache. (SFS has only the one
+ * directory.) The vfs big lock, where held, comes before all of these.
+ * sfs_reclaim locks a vnode (even the directory) after sfs_vnlock;
+ * that's safe because by then nobody else has a reference to it.
+ *
+ * The type of a loaded vnode (sfi_type), the inode number, and the
+ * superblock's size and volume name never change and may be read
+ * without locking.
+ */
+
 struct sfs_vnode {
 	struct vnode sv_v;              /* abstract vnode structure */
 	struct sfs_inode sv_i;		/* on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct lock *sv_lock;           /* protects sv_i and contents */
+	uint32_t sv_resvstart;          /* blocks set aside for growth */
+	uint32_t sv_resvcount;          /* (see sfs_file_balloc) */
+	off_t sv_raoffset;              /* where the last read ended */
+	uint32_t sv_rawindow;           /* blocks to read ahead, or 0 */
+	uint32_t sv_raend;              /* first block not read ahead */
+	vaddr_t *sv_pages;              /* mmap pages by file page, or 0 */
+	unsigned sv_npages;             /* size of sv_pages */
+	struct spinlock sv_pagelock;    /* for looking in sv_pages */
+	unsigned sv_index;              /* position in sfs_vnodes */
+	struct sfs_vnode *sv_hashnext;  /* sfs_vnhash chain */
 };
 
+/*
+ * Number of chains in the table of loaded vnodes; must be a power of
+ * 2. Inode numbers are block numbers, so the low bits hash well.
+ */
+#define SFS_VNHASH_SIZE 256
+#define SFS_VNHASH(ino) ((ino) & (SFS_VNHASH_SIZE - 1))
+
 struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
 	struct sfs_super sfs_super;	/* on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
 	struct device *sfs_device;      /* device mounted on */
+	struct lock *sfs_vnlock;        /* protects the next two */
 	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct sfs_vnode *sfs_vnhash[SFS_VNHASH_SIZE]; /* same, by inode */
+	struct lock *sfs_freemaplock;   /* protects freemap and super */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
-	bool sfs_freemapdirty;          /* true if freemap modified */
+	struct bitmap *sfs_maploaded;   /* freemap sectors read in */
+	struct bitmap *sfs_mapdirty;    /* freemap sectors modified */
+	bool sfs_freemapdirty;          /* true if any are modified */
+	unsigned sfs_iopending;         /* cache transfers in progress */
 };
 
 /*
@@ -70,6 +125,12 @@ struct sfs_fs {
  */
 int sfs_mount(const char *device);
 
+/*
+ * Make a new, empty volume on an unmounted device, as mksfs does
+ * (sfs_format.c).
+ */
+int sfs_format(const char *device, const char *volname);
+
 
 /*
  * Internal functions
@@ -79,11 +140,41 @@ int sfs_mount(const char *device);
 #define SFSUIO(iov, uio, ptr, block, rw) \
     uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
 
-/* Convenience functions for block I/O */
+/* Convenience functions for block I/O (uncached; see below) */
+struct device_aio;
 int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
+int sfs_aio(struct sfs_fs *sfs, struct device_aio *aio);
 int sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block);
 int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block);
 
+/* Free block bitmap, loaded on demand (sfs_fs.c); need sfs_freemaplock */
+int sfs_freemap_load(struct sfs_fs *sfs, uint32_t block);
+void sfs_freemap_update(struct sfs_fs *sfs, uint32_t block, bool inuse);
+
+/*
+ * Buffer cache (sfs_cache.c). Everything except the superblock and
+ * the free block bitmap is read and written through the cache.
+ */
+struct sfs_buf;
+void sfs_cache_bootstrap(void);
+void sfs_cache_printstats(void);
+int sfs_buf_get(struct sfs_fs *sfs, uint32_t block, bool fill,
+		struct sfs_buf **ret);
+void *sfs_buf_data(struct sfs_buf *buf);
+void sfs_buf_markdirty(struct sfs_buf *buf, uint32_t ino);
+void sfs_buf_release(struct sfs_buf *buf);
+void sfs_buf_forget(struct sfs_fs *sfs, uint32_t block);
+int sfs_buf_syncfs(struct sfs_fs *sfs);
+int sfs_buf_syncfile(struct sfs_fs *sfs, uint32_t ino);
+void sfs_buf_dropfs(struct sfs_fs *sfs);
+int sfs_buf_directio(struct sfs_fs *sfs, uint32_t block, uint32_t nblocks,
+		     struct uio *uio);
+
+/* Most blocks in one read-ahead request */
+#define SFS_RAMAX	16
+void sfs_buf_readahead(struct sfs_fs *sfs, const uint32_t *blocks,
+		       unsigned nblocks);
+
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
 
@@ -121,6 +121,7 @@ void lock_destroy(struct lock *);
 struct cv {
         char *cv_name;
         struct wchan *wchan;
+        struct spinlock cv_lock;    /* interlock for wchan */
         // (don't forget to mark things volatile as needed)
 };
 
@@ -75,8 +75,16 @@ int readstress(int, char **);
 int writestress(int, char **);
 int writestress2(int, char **);
 int createstress(int, char **);
+int openstress(int, char **);
+int throughput(int, char **);
+int randread(int, char **);
+int mapscan(int, char **);
 int printfile(int, char **);
 
+/* device tests */
+int diskbench(int, char **);
+int conbench(int, char **);
+
 /* other tests */
 int malloctest(int, char **);
 int mallocstress(int, char **);
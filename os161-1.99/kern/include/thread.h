@@ -104,6 +104,14 @@ struct thread {
 	 * Public fields
 	 */
 
+	/*
+	 * t_nomapfill is nonzero while the thread copies from user
+	 * memory holding locks that reading in a page of a mapped
+	 * file could need; a page fault then only gets pages already
+	 * in memory. See vm_mapfault.
+	 */
+	unsigned t_nomapfill;
+
 	/* add more here as needed */
 };
 
@@ -129,6 +137,9 @@ void thread_panic(void);
 /* Call during system shutdown to offline other CPUs. */
 void thread_shutdown(void);
 
+/* Print per-cpu thread cache hit/miss counts. */
+void thread_cache_printstats(void);
+
 /*
  * Make a new thread, which will start executing at "func". The thread
  * will belong to the process "proc", or to the current thread's
@@ -0,0 +1,51 @@
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+/*
+ * In-kernel trace buffer: a ring of timestamped binary records per
+ * cpu, cheap enough to append to from hot paths and interrupt
+ * handlers, and read back later from the menu ("trace dump").
+ *
+ * Records are tagged with one of the DB_* classes from <lib.h>.
+ * TRACE() records an event if its class is on in traceflags; it
+ * stores the format and up to TRACE_NARGS 32-bit arguments, and the
+ * message is only formatted when dumped, so the format must be a
+ * string constant and the arguments integers or pointers (%s is fine
+ * for pointers to string constants).
+ *
+ * DEBUG() messages (see <lib.h>) go to the trace buffer instead of the
+ * console if dbtrace is set; those are formatted when recorded and
+ * cut short at TRACE_TEXTLEN-1 characters.
+ *
+ * Appending takes no lock: each cpu only writes its own ring, with
+ * interrupts off. The oldest records are overwritten when a ring is
+ * full. Nothing is recorded before trace_bootstrap.
+ */
+
+#define TRACE_NARGS	6
+#define TRACE_TEXTLEN	48
+
+extern uint32_t traceflags;
+
+#define TRACE(c, ...) \
+	((traceflags & (c)) ? trace_event(c, __VA_ARGS__) : (void)0)
+
+/*
+ * Use TRACE() rather than calling this directly. Unused arguments
+ * may be left off.
+ */
+void trace_event(uint32_t class, const char *fmt, ...);
+
+/* Call once, after secondary cpus are up. */
+void trace_bootstrap(void);
+
+/* Print the records of the classes in CLASSES, oldest first. */
+void trace_dump(uint32_t classes);
+
+/* Throw away all records. */
+void trace_clear(void);
+
+/* Look up a DB_* class by name ("vm", "sfs", ...); 0 if none. */
+uint32_t trace_class(const char *name);
+
+#endif /* _TRACE_H_ */
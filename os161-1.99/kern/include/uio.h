@@ -104,6 +104,20 @@ int uiomove(void *kbuffer, size_t len, struct uio *uio);
  */
 int uiomovezeros(size_t len, struct uio *uio);
 
+/*
+ * Like uiomove, but just moves past the data without copying it.
+ */
+void uioskip(size_t len, struct uio *uio);
+
+/*
+ * Get any pages of mapped files in the user memory UIO refers to into
+ * memory (see as_prefault). A file system calls this before locking
+ * a file for I/O that copies to or from user memory, since the copy
+ * can't fault such pages in while the lock is held. Does nothing for
+ * kernel I/O.
+ */
+void uio_prefault(struct uio *uio);
+
 /*
  * Initialize a uio suitable for I/O from a kernel buffer.
  *
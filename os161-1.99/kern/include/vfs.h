@@ -157,6 +157,14 @@ int vfs_getcwd(struct uio *buf);
  *                    specified device.
  *
  *    vfs_unmountall - Unmount all mounted filesystems.
+ *
+ *    vfs_claimdev  - Take over the mountable device DEVNAME (without
+ *                    the colon) for a device built on top of it, such
+ *                    as a stripe set, and return it in RESULT. It can
+ *                    no longer be mounted. Fails with EBUSY if it is
+ *                    mounted or already claimed.
+ *
+ *    vfs_unclaimdev - Release a device taken with vfs_claimdev.
  */
 
 void vfs_bootstrap(void);
@@ -173,6 +181,43 @@ int vfs_mount(const char *devname, void *data,
 			       struct fs **result));
 int vfs_unmount(const char *devname);
 int vfs_unmountall(void);
+int vfs_claimdev(const char *devname, struct device **result);
+void vfs_unclaimdev(const char *devname);
+
+/*
+ * Name cache (vfs/vfsnamecache.c), used by vfs_lookup and
+ * vfs_lookparent.
+ *
+ *    vfs_namecache_walk   - Look up PATH relative to STARTVN one
+ *                           component at a time, consulting the cache
+ *                           first. Does not consume STARTVN's reference.
+ *
+ *    vfs_namecache_changed - NAME in directory DIR has been created or
+ *                           removed (other than by rename), or may
+ *                           have been.
+ *
+ *    vfs_namecache_created - NAME in directory DIR is now VN, which may
+ *                           or may not have been there before (as
+ *                           with VOP_CREAT).
+ *
+ *    vfs_namecache_renamed - OLDNAME in OLDDIR has been renamed to
+ *                           NEWNAME in NEWDIR.
+ *
+ *    vfs_namecache_purgefs - Forget all cached names on FS. Must be done
+ *                           before FS is unmounted.
+ *
+ * One of the first three must be called after every successful
+ * operation that changes names; on filesystems without unique vnodes
+ * (see fs.h) they forget all names on the filesystem.
+ */
+void vfs_namecache_bootstrap(void);
+int vfs_namecache_walk(struct vnode *startvn, char *path, struct vnode **ret);
+void vfs_namecache_changed(struct vnode *dir, const char *name);
+void vfs_namecache_created(struct vnode *dir, const char *name,
+			   struct vnode *vn);
+void vfs_namecache_renamed(struct vnode *olddir, const char *oldname,
+			   struct vnode *newdir, const char *newname);
+void vfs_namecache_purgefs(struct fs *fs);
 
 /*
  * Array of vnodes.
@@ -185,8 +230,10 @@ DECLARRAY(vnode);
 DEFARRAY(vnode, VFSINLINE);
 
 /*
- * Global one-big-lock for all filesystem operations.
- * You must remove this for the filesystem assignment.
+ * Global one-big-lock for VFS-level state: the device list, the boot
+ * filesystem, and mount/unmount. emufs also still uses it for its own
+ * state. SFS and the name cache do their own locking and do not need
+ * it.
  */
 void vfs_biglock_acquire(void);
 void vfs_biglock_release(void);
@@ -30,6 +30,7 @@
 #ifndef _VNODE_H_
 #define _VNODE_H_
 
+#include <spinlock.h>
 
 struct uio;
 struct stat;
@@ -50,8 +51,16 @@ struct stat;
  * vn_opencount is managed using VOP_INCOPEN and VOP_DECOPEN by
  * vfs_open() and vfs_close(). Code above the VFS layer should not
  * need to worry about it.
+ *
+ * Both counts are protected by vn_countlock. When the reference
+ * count would drop to zero, VOP_DECREF calls VOP_RECLAIM with the
+ * count still 1 and the lock released; the file system must then
+ * recheck the count under its own vnode-table lock (which is also
+ * held when handing out new references) and, if somebody else got
+ * a reference in the meantime, just drop the count and return EBUSY.
  */
 struct vnode {
+	struct spinlock vn_countlock;   /* Protects the counts */
 	int vn_refcount;                /* Reference count */
 	int vn_opencount;
 
@@ -135,9 +144,21 @@ struct vnode {
  *    vop_fsync       - Force any dirty buffers associated with this file
  *                      to stable storage.
  *
- *    vop_mmap        - Map file into memory. If you implement this
- *                      feature, you're responsible for choosing the
- *                      arguments for this operation.
+ *    vop_mmap        - Get the physical page holding the PAGE_SIZE
+ *                      bytes of the file at OFFSET (page-aligned), to
+ *                      map into a user address space. The page
+ *                      belongs to the file and stays valid, and up to
+ *                      date with writes, as long as the caller holds
+ *                      a reference to the vnode. Bytes past EOF read
+ *                      as zero; OFFSET itself at or past EOF is
+ *                      EFAULT if the page has to be read in. If FILL
+ *                      is false, only a page already in memory is
+ *                      handed back, without sleeping (EFAULT if there
+ *                      isn't one): the caller may be holding file
+ *                      system locks, as in a fault taken by uiomove.
+ *                      If RET is NULL, just check whether the object
+ *                      can be mapped at all (ENODEV if not). Pages
+ *                      are only ever mapped read-only.
  *
  *    vop_truncate    - Forcibly set size of file to the length passed
  *                      in, discarding any excess blocks.
@@ -209,7 +230,8 @@ struct vnode_ops {
 	int (*vop_gettype)(struct vnode *object, mode_t *result);
 	int (*vop_tryseek)(struct vnode *object, off_t pos);
 	int (*vop_fsync)(struct vnode *object);
-	int (*vop_mmap)(struct vnode *file /* add stuff */);
+	int (*vop_mmap)(struct vnode *file, off_t offset, bool fill,
+			paddr_t *ret);
 	int (*vop_truncate)(struct vnode *file, off_t len);
 	int (*vop_namefile)(struct vnode *file, struct uio *uio);
 
@@ -254,7 +276,7 @@ struct vnode_ops {
 #define VOP_GETTYPE(vn, result)         (__VOP(vn, gettype)(vn, result))
 #define VOP_TRYSEEK(vn, pos)            (__VOP(vn, tryseek)(vn, pos))
 #define VOP_FSYNC(vn)                   (__VOP(vn, fsync)(vn))
-#define VOP_MMAP(vn /*add stuff */)     (__VOP(vn, mmap)(vn /*add stuff */))
+#define VOP_MMAP(vn, pos, fill, ret)    (__VOP(vn, mmap)(vn, pos, fill, ret))
 #define VOP_TRUNCATE(vn, pos)           (__VOP(vn, truncate)(vn, pos))
 #define VOP_NAMEFILE(vn, uio)           (__VOP(vn, namefile)(vn, uio))
 
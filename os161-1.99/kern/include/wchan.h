@@ -36,6 +36,7 @@
 
 
 struct wchan; /* Opaque */
+struct spinlock;
 
 /*
  * Create a wait channel. Use NAME as a symbolic name for the channel.
@@ -44,6 +45,19 @@ struct wchan; /* Opaque */
  */
 struct wchan *wchan_create(const char *name);
 
+/*
+ * Create a wait channel that uses the caller's spinlock LK as its
+ * lock, instead of one of its own. This is for objects that already
+ * protect their state with a spinlock (semaphores, locks): the thread
+ * going to sleep just holds LK into wchan_sleep, rather than bridging
+ * from LK to a second wchan lock, and wakers call wchan_wakeone or
+ * wchan_wakeall with LK *held*, which lets the wakeup skip locking
+ * entirely when nobody is waiting.
+ *
+ * LK must outlive the channel.
+ */
+struct wchan *wchan_create_interlocked(const char *name, struct spinlock *lk);
+
 /*
  * Destroy a wait channel. Must be empty and unlocked.
  */
@@ -56,7 +70,15 @@ void wchan_destroy(struct wchan *wc);
 bool wchan_isempty(struct wchan *wc);
 
 /*
- * Lock and unlock the wait channel.
+ * Return the number of threads sleeping on the channel. For an
+ * interlocked channel the interlock must be held, in which case the
+ * answer is exact; otherwise it is only a hint.
+ */
+unsigned wchan_nwaiters(struct wchan *wc);
+
+/*
+ * Lock and unlock the wait channel. For an interlocked channel these
+ * take and release the interlock.
  */
 void wchan_lock(struct wchan *wc);
 void wchan_unlock(struct wchan *wc);
@@ -73,7 +95,9 @@ void wchan_sleep(struct wchan *wc);
 
 /*
  * Wake up one thread, or all threads, sleeping on a wait channel.
- * The queue should not already be locked.
+ * The queue should not already be locked, unless it is interlocked,
+ * in which case the interlock must be held. If nobody is sleeping
+ * these return without touching any run queue.
  *
  * The current implementation is FIFO but this is not promised by the
  * interface.
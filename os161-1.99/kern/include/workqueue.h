@@ -0,0 +1,57 @@
+#ifndef _WORKQUEUE_H_
+#define _WORKQUEUE_H_
+
+/*
+ * Kernel work queues: deferred work run later by kernel worker
+ * threads, so that slow cleanup (address space teardown, reaping
+ * dead threads, file system writeback) doesn't happen on the
+ * latency-critical path that generated it.
+ *
+ * There is one queue, with its own worker thread, per cpu. Allocated
+ * work is put on the queue of the cpu that submits it, which keeps
+ * submitters on different cpus from contending for one queue lock;
+ * a caller-owned item always goes to the same queue. Items on one
+ * queue run in FIFO order; there is no ordering between queues.
+ *
+ * Work functions run in an ordinary kernel thread and may sleep.
+ *
+ * Two ways to submit:
+ *
+ * workqueue_submit allocates an item, so it can't be used from an
+ * interrupt handler or with a spinlock held, and may fail (ENOMEM).
+ * Callers should then just do the work themselves.
+ *
+ * workqueue_queue takes a caller-owned struct work set up with
+ * work_init, and never allocates, so it is safe from interrupt
+ * handlers and at splhigh. An item already on a queue is not queued
+ * again; it is taken off the queue just before its function runs, so
+ * the function (or anyone else) may queue it again from then on.
+ *
+ * Until workqueue_bootstrap has run, both return failure (ENXIO /
+ * false) and nothing is queued.
+ */
+
+struct work {
+	void (*w_func)(void *data1, unsigned long data2);
+	void *w_data1;
+	unsigned long w_data2;
+	struct work *w_next;		/* queue link */
+	bool w_pending;			/* on a queue now */
+	bool w_allocated;		/* kfree after running */
+};
+
+/* Call once, after secondary cpus are up, to start the workers. */
+void workqueue_bootstrap(void);
+
+/* Initialize a caller-owned work item. */
+void work_init(struct work *w, void (*func)(void *, unsigned long),
+	       void *data1, unsigned long data2);
+
+/* Queue a caller-owned item. Returns false if not queued. */
+bool workqueue_queue(struct work *w);
+
+/* Allocate and queue a work item. Returns an error if not queued. */
+int workqueue_submit(void (*func)(void *, unsigned long),
+		     void *data1, unsigned long data2);
+
+#endif /* _WORKQUEUE_H_ */
@@ -120,6 +120,46 @@ bitmap_alloc(struct bitmap *b, unsigned *index)
         return ENOSPC;
 }
 
+/*
+ * Like bitmap_alloc, but take the first clear bit at or after GOAL,
+ * wrapping around to the beginning if there are none.
+ */
+int
+bitmap_alloc_near(struct bitmap *b, unsigned goal, unsigned *index)
+{
+        unsigned maxix = DIVROUNDUP(b->nbits, BITS_PER_WORD);
+        unsigned ix, startix, n, offset;
+
+        if (goal >= b->nbits) {
+                goal = 0;
+        }
+        startix = goal / BITS_PER_WORD;
+
+        /*
+         * Visit every word once starting with the goal's, and the
+         * goal's word a second time at the end for the bits before
+         * the goal. In the first visit skip bits before the goal.
+         */
+        for (n=0; n<=maxix; n++) {
+                ix = (startix + n) % maxix;
+                if (b->v[ix] == WORD_ALLBITS) {
+                        continue;
+                }
+                offset = (n == 0) ? goal % BITS_PER_WORD : 0;
+                for (; offset < BITS_PER_WORD; offset++) {
+                        WORD_TYPE mask = ((WORD_TYPE)1) << offset;
+
+                        if ((b->v[ix] & mask)==0) {
+                                b->v[ix] |= mask;
+                                *index = (ix*BITS_PER_WORD)+offset;
+                                KASSERT(*index < b->nbits);
+                                return 0;
+                        }
+                }
+        }
+        return ENOSPC;
+}
+
 static
 inline
 void
@@ -0,0 +1,466 @@
+/*
+ * Sampling profiler; see <prof.h>.
+ *
+ * Each cpu has an open-addressed hash table keyed on (pc, user) with
+ * a count per entry; a count of 0 means the slot is free. Only the
+ * owning cpu's clock interrupt writes it, so recording a sample is a
+ * short probe with no locking. Dumping merges the cpus' tables into
+ * one, picks the busiest entries, and looks the kernel ones up in
+ * the symbol table of the kernel's ELF image, read from a file since
+ * the loaded kernel doesn't carry one.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <cpu.h>
+#include <current.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vfs.h>
+#include <elf.h>
+#include <prof.h>
+
+/* Slots per cpu; must be a power of 2 */
+#define PROF_NSLOTS	1024
+
+/* Give up on a new pc after this many probes */
+#define PROF_MAXPROBE	16
+
+struct prof_slot {
+	vaddr_t ps_pc;
+	uint32_t ps_count;		/* 0 if unused */
+	bool ps_user;
+};
+
+struct prof_table {
+	uint32_t pt_samples;		/* all samples taken */
+	uint32_t pt_user;		/* ...of which in user mode */
+	uint32_t pt_dropped;		/* ...of which not recorded */
+	struct prof_slot pt_slots[PROF_NSLOTS];
+};
+
+struct prof_symtab {
+	Elf_Sym *st_syms;		/* functions only */
+	unsigned st_nsyms;
+	char *st_strs;
+	size_t st_strsize;
+};
+
+static struct prof_table **prof_tables;	/* one per cpu, by c_number */
+static unsigned prof_ncpus;
+static volatile bool prof_running;
+
+static
+unsigned
+prof_hash(vaddr_t pc, bool user)
+{
+	/* instructions are word-aligned; the low bits carry nothing */
+	return ((pc >> 2) ^ (user ? 0x9e3779b9 : 0)) * 2654435761U;
+}
+
+/*
+ * Add COUNT samples of (PC, USER) to the table of NSLOTS slots at
+ * SLOTS. Returns false if there was no room.
+ */
+static
+bool
+prof_add(struct prof_slot *slots, unsigned nslots, unsigned maxprobe,
+	 vaddr_t pc, bool user, uint32_t count)
+{
+	struct prof_slot *ps;
+	unsigned h, i;
+
+	h = prof_hash(pc, user);
+	for (i=0; i<maxprobe; i++) {
+		ps = &slots[(h + i) & (nslots - 1)];
+		if (ps->ps_count == 0) {
+			ps->ps_pc = pc;
+			ps->ps_user = user;
+			ps->ps_count = count;
+			return true;
+		}
+		if (ps->ps_pc == pc && ps->ps_user == user) {
+			ps->ps_count += count;
+			return true;
+		}
+	}
+	return false;
+}
+
+void
+prof_sample(vaddr_t pc, bool user)
+{
+	struct prof_table *pt;
+
+	if (!prof_running) {
+		return;
+	}
+
+	pt = prof_tables[curcpu->c_number];
+	pt->pt_samples++;
+	if (user) {
+		pt->pt_user++;
+	}
+	if (!prof_add(pt->pt_slots, PROF_NSLOTS, PROF_MAXPROBE,
+		      pc, user, 1)) {
+		pt->pt_dropped++;
+	}
+}
+
+int
+prof_start(void)
+{
+	struct prof_table **tables;
+	unsigned i, j, ncpus;
+
+	if (prof_running) {
+		return EBUSY;
+	}
+
+	if (prof_tables == NULL) {
+		ncpus = cpu_count();
+		tables = kmalloc(ncpus * sizeof(*tables));
+		if (tables == NULL) {
+			return ENOMEM;
+		}
+		for (i=0; i<ncpus; i++) {
+			tables[i] = kmalloc(sizeof(struct prof_table));
+			if (tables[i] == NULL) {
+				while (i > 0) {
+					kfree(tables[--i]);
+				}
+				kfree(tables);
+				return ENOMEM;
+			}
+		}
+		prof_ncpus = ncpus;
+		prof_tables = tables;
+	}
+
+	for (i=0; i<prof_ncpus; i++) {
+		prof_tables[i]->pt_samples = 0;
+		prof_tables[i]->pt_user = 0;
+		prof_tables[i]->pt_dropped = 0;
+		for (j=0; j<PROF_NSLOTS; j++) {
+			prof_tables[i]->pt_slots[j].ps_count = 0;
+		}
+	}
+
+	prof_running = true;
+	return 0;
+}
+
+void
+prof_stop(void)
+{
+	prof_running = false;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Symbols
+
+/*
+ * Read exactly LEN bytes at offset OFFSET of file VN into BUF.
+ */
+static
+int
+prof_read(struct vnode *vn, void *buf, size_t len, off_t offset)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	uio_kinit(&iov, &ku, buf, len, offset, UIO_READ);
+	result = VOP_READ(vn, &ku);
+	if (result) {
+		return result;
+	}
+	if (ku.uio_resid != 0) {
+		return ENOEXEC;
+	}
+	return 0;
+}
+
+static
+void
+prof_freesyms(struct prof_symtab *st)
+{
+	if (st->st_syms != NULL) {
+		kfree(st->st_syms);
+		st->st_syms = NULL;
+	}
+	if (st->st_strs != NULL) {
+		kfree(st->st_strs);
+		st->st_strs = NULL;
+	}
+	st->st_nsyms = 0;
+	st->st_strsize = 0;
+}
+
+/*
+ * Load the function symbols of the ELF image in file PATH.
+ */
+static
+int
+prof_loadsyms(const char *path, struct prof_symtab *st)
+{
+	struct vnode *vn;
+	Elf_Ehdr eh;
+	Elf_Shdr *sh = NULL;
+	Elf_Shdr *symsh, *strsh;
+	char *pathcopy;
+	unsigned i, n, nsyms;
+	int result;
+
+	st->st_syms = NULL;
+	st->st_nsyms = 0;
+	st->st_strs = NULL;
+	st->st_strsize = 0;
+
+	/* vfs_open destroys the path it's given */
+	pathcopy = kstrdup(path);
+	if (pathcopy == NULL) {
+		return ENOMEM;
+	}
+	result = vfs_open(pathcopy, O_RDONLY, 0, &vn);
+	kfree(pathcopy);
+	if (result) {
+		return result;
+	}
+
+	result = prof_read(vn, &eh, sizeof(eh), 0);
+	if (result) {
+		goto fail;
+	}
+	if (eh.e_ident[EI_MAG0] != ELFMAG0 ||
+	    eh.e_ident[EI_MAG1] != ELFMAG1 ||
+	    eh.e_ident[EI_MAG2] != ELFMAG2 ||
+	    eh.e_ident[EI_MAG3] != ELFMAG3 ||
+	    eh.e_ident[EI_CLASS] != ELFCLASS32 ||
+	    eh.e_shentsize != sizeof(Elf_Shdr) ||
+	    eh.e_shnum == 0) {
+		result = ENOEXEC;
+		goto fail;
+	}
+
+	sh = kmalloc(eh.e_shnum * sizeof(Elf_Shdr));
+	if (sh == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+	result = prof_read(vn, sh, eh.e_shnum * sizeof(Elf_Shdr),
+			   eh.e_shoff);
+	if (result) {
+		goto fail;
+	}
+
+	symsh = NULL;
+	for (i=0; i<eh.e_shnum; i++) {
+		if (sh[i].sh_type == SHT_SYMTAB) {
+			symsh = &sh[i];
+			break;
+		}
+	}
+	if (symsh == NULL || symsh->sh_link >= eh.e_shnum ||
+	    symsh->sh_entsize != sizeof(Elf_Sym)) {
+		/* stripped */
+		result = ENOENT;
+		goto fail;
+	}
+	strsh = &sh[symsh->sh_link];
+
+	nsyms = symsh->sh_size / sizeof(Elf_Sym);
+	st->st_syms = kmalloc(nsyms * sizeof(Elf_Sym));
+	st->st_strs = kmalloc(strsh->sh_size + 1);
+	if (st->st_syms == NULL || st->st_strs == NULL) {
+		result = ENOMEM;
+		goto fail;
+	}
+	result = prof_read(vn, st->st_syms, nsyms * sizeof(Elf_Sym),
+			   symsh->sh_offset);
+	if (result) {
+		goto fail;
+	}
+	result = prof_read(vn, st->st_strs, strsh->sh_size,
+			   strsh->sh_offset);
+	if (result) {
+		goto fail;
+	}
+	st->st_strs[strsh->sh_size] = 0;
+	st->st_strsize = strsh->sh_size;
+
+	/* Keep just the functions */
+	n = 0;
+	for (i=0; i<nsyms; i++) {
+		if (ELF32_ST_TYPE(st->st_syms[i].st_info) == STT_FUNC &&
+		    st->st_syms[i].st_size > 0 &&
+		    st->st_syms[i].st_name < st->st_strsize) {
+			st->st_syms[n++] = st->st_syms[i];
+		}
+	}
+	st->st_nsyms = n;
+
+	kfree(sh);
+	vfs_close(vn);
+	return 0;
+
+ fail:
+	prof_freesyms(st);
+	if (sh != NULL) {
+		kfree(sh);
+	}
+	vfs_close(vn);
+	return result;
+}
+
+/*
+ * Find the function containing PC; returns its name and sets *OFFSET
+ * to how far into it PC is, or returns NULL.
+ */
+static
+const char *
+prof_lookup(const struct prof_symtab *st, vaddr_t pc, uint32_t *offset)
+{
+	const Elf_Sym *sym;
+	unsigned i;
+
+	for (i=0; i<st->st_nsyms; i++) {
+		sym = &st->st_syms[i];
+		if (pc >= sym->st_value && pc - sym->st_value < sym->st_size) {
+			*offset = pc - sym->st_value;
+			return st->st_strs + sym->st_name;
+		}
+	}
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Reporting
+
+void
+prof_dump(unsigned topn, const char *kernelpath)
+{
+	struct prof_symtab st;
+	struct prof_slot *merged = NULL, **top = NULL, *ps;
+	struct prof_table *pt;
+	unsigned cpu, i, j, nmerged, ntop, used;
+	uint32_t samples, user, dropped, offset;
+	const char *name;
+	bool havesyms;
+	int result;
+
+	if (prof_tables == NULL) {
+		kprintf("prof: no samples\n");
+		return;
+	}
+	/* Size the merged table at least twice the entries going in */
+	samples = user = dropped = 0;
+	used = 0;
+	for (cpu=0; cpu<prof_ncpus; cpu++) {
+		pt = prof_tables[cpu];
+		samples += pt->pt_samples;
+		user += pt->pt_user;
+		dropped += pt->pt_dropped;
+		for (i=0; i<PROF_NSLOTS; i++) {
+			if (pt->pt_slots[i].ps_count != 0) {
+				used++;
+			}
+		}
+	}
+	for (nmerged = PROF_NSLOTS; nmerged < 2*used; nmerged *= 2) {
+		/* nothing */
+	}
+	if (topn > used) {
+		topn = used;
+	}
+	if (topn == 0) {
+		topn = 1;
+	}
+
+	merged = kmalloc(nmerged * sizeof(struct prof_slot));
+	top = kmalloc(topn * sizeof(struct prof_slot *));
+	if (merged == NULL || top == NULL) {
+		kprintf("prof: Out of memory\n");
+		goto done;
+	}
+	for (i=0; i<nmerged; i++) {
+		merged[i].ps_count = 0;
+	}
+
+	for (cpu=0; cpu<prof_ncpus; cpu++) {
+		pt = prof_tables[cpu];
+		for (i=0; i<PROF_NSLOTS; i++) {
+			ps = &pt->pt_slots[i];
+			if (ps->ps_count == 0) {
+				continue;
+			}
+			/* can't fail; the table is never more than half full */
+			prof_add(merged, nmerged, nmerged,
+				 ps->ps_pc, ps->ps_user, ps->ps_count);
+		}
+	}
+
+	/* Keep the TOPN biggest, in descending order, by insertion */
+	ntop = 0;
+	for (i=0; i<nmerged; i++) {
+		ps = &merged[i];
+		if (ps->ps_count == 0) {
+			continue;
+		}
+		if (ntop == topn && ps->ps_count <= top[ntop-1]->ps_count) {
+			continue;
+		}
+		j = ntop < topn ? ntop++ : ntop - 1;
+		while (j > 0 && top[j-1]->ps_count < ps->ps_count) {
+			top[j] = top[j-1];
+			j--;
+		}
+		top[j] = ps;
+	}
+
+	result = prof_loadsyms(kernelpath, &st);
+	havesyms = (result == 0);
+	if (!havesyms) {
+		kprintf("prof: %s: %s; not symbolizing\n", kernelpath,
+			strerror(result));
+	}
+
+	kprintf("prof: %u samples (%u kernel, %u user), %u not recorded%s\n",
+		samples, samples - user, user, dropped,
+		prof_running ? " (still running)" : "");
+	kprintf("  samples      %%  address     where\n");
+	for (i=0; i<ntop; i++) {
+		ps = top[i];
+		kprintf("  %7u %3u.%u%%  0x%08x  ", ps->ps_count,
+			ps->ps_count * 100 / samples,
+			(ps->ps_count * 1000 / samples) % 10,
+			ps->ps_pc);
+		if (ps->ps_user) {
+			kprintf("[user]\n");
+			continue;
+		}
+		name = havesyms ? prof_lookup(&st, ps->ps_pc, &offset) : NULL;
+		if (name != NULL) {
+			kprintf("%s+0x%x\n", name, offset);
+		}
+		else {
+			kprintf("[kernel]\n");
+		}
+	}
+
+	if (havesyms) {
+		prof_freesyms(&st);
+	}
+
+ done:
+	if (merged != NULL) {
+		kfree(merged);
+	}
+	if (top != NULL) {
+		kfree(top);
+	}
+}
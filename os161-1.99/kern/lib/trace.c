@@ -0,0 +1,382 @@
+/*
+ * In-kernel trace buffer; see <trace.h>.
+ *
+ * Each cpu's ring counts the records ever appended to it (tg_next);
+ * record I lives in slot I % TRACE_NRECS. The owning cpu fills in
+ * the slot, then bumps the count, all at splhigh, so nothing else on
+ * that cpu can get in between. A reader on another cpu copies the
+ * records it wants and then looks at the count again: a record I is
+ * good if the count is still below I + TRACE_NRECS, i.e. the writer
+ * hasn't started reusing its slot. Clearing the buffer just moves
+ * up where readers start (tg_cleared), so only the owner ever writes
+ * the ring itself.
+ */
+
+#include <types.h>
+#include <stdarg.h>
+#include <lib.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <clock.h>
+#include <trace.h>
+
+/* Records per cpu */
+#define TRACE_NRECS	512
+
+struct trace_rec {
+	uint32_t tr_secs;		/* when */
+	uint32_t tr_nsecs;
+	uint32_t tr_class;		/* DB_* */
+	const char *tr_fmt;		/* NULL if tr_text is the message */
+	union {
+		uint32_t tr_args[TRACE_NARGS];
+		char tr_text[TRACE_TEXTLEN];
+	} tr_u;
+};
+
+struct trace_ring {
+	volatile uint32_t tg_next;	/* records ever appended */
+	uint32_t tg_cleared;		/* tg_next at last trace_clear */
+	struct trace_rec tg_recs[TRACE_NRECS];
+};
+
+static struct trace_ring **trace_rings;	/* one per cpu, by c_number */
+static unsigned trace_ncpus;
+
+uint32_t traceflags;
+bool dbtrace;
+
+static const struct {
+	const char *name;
+	uint32_t class;
+} trace_classes[] = {
+	{ "locore",	DB_LOCORE },
+	{ "syscall",	DB_SYSCALL },
+	{ "interrupt",	DB_INTERRUPT },
+	{ "device",	DB_DEVICE },
+	{ "threads",	DB_THREADS },
+	{ "vm",		DB_VM },
+	{ "exec",	DB_EXEC },
+	{ "vfs",	DB_VFS },
+	{ "sfs",	DB_SFS },
+	{ "net",	DB_NET },
+	{ "netfs",	DB_NETFS },
+	{ "kmalloc",	DB_KMALLOC },
+	{ "syncprob",	DB_SYNCPROB },
+	{ NULL, 0 },
+};
+
+/*
+ * Get this cpu's next record to fill in, with interrupts off, or NULL
+ * if there's nowhere to put it. Hand it back with trace_commit.
+ */
+static
+struct trace_rec *
+trace_alloc(uint32_t class, int *spl)
+{
+	struct trace_ring *tg;
+	struct trace_rec *tr;
+	time_t secs;
+	uint32_t nsecs;
+
+	*spl = splhigh();
+	if (trace_rings == NULL) {
+		splx(*spl);
+		return NULL;
+	}
+
+	tg = trace_rings[curcpu->c_number];
+	tr = &tg->tg_recs[tg->tg_next % TRACE_NRECS];
+
+	gettime(&secs, &nsecs);
+	tr->tr_secs = secs;
+	tr->tr_nsecs = nsecs;
+	tr->tr_class = class;
+	return tr;
+}
+
+static
+void
+trace_commit(int spl)
+{
+	trace_rings[curcpu->c_number]->tg_next++;
+	splx(spl);
+}
+
+void
+trace_event(uint32_t class, const char *fmt, ...)
+{
+	struct trace_rec *tr;
+	va_list ap;
+	unsigned i, nargs;
+	int spl;
+
+	tr = trace_alloc(class, &spl);
+	if (tr == NULL) {
+		return;
+	}
+
+	/* Only fetch as many arguments as the format has conversions */
+	nargs = 0;
+	for (i=0; fmt[i] != 0 && nargs < TRACE_NARGS; i++) {
+		if (fmt[i] == '%') {
+			if (fmt[i+1] == '%') {
+				i++;
+			}
+			else {
+				nargs++;
+			}
+		}
+	}
+
+	tr->tr_fmt = fmt;
+	va_start(ap, fmt);
+	for (i=0; i<TRACE_NARGS; i++) {
+		tr->tr_u.tr_args[i] = i < nargs ? va_arg(ap, uint32_t) : 0;
+	}
+	va_end(ap);
+
+	trace_commit(spl);
+}
+
+/*
+ * Record a DEBUG() message; see DEBUG in <lib.h>.
+ */
+int
+trace_printf(uint32_t class, const char *fmt, ...)
+{
+	struct trace_rec *tr;
+	va_list ap;
+	int spl, len;
+
+	tr = trace_alloc(class, &spl);
+	if (tr == NULL) {
+		return 0;
+	}
+
+	tr->tr_fmt = NULL;
+	va_start(ap, fmt);
+	len = vsnprintf(tr->tr_u.tr_text, TRACE_TEXTLEN, fmt, ap);
+	va_end(ap);
+
+	trace_commit(spl);
+	return len;
+}
+
+void
+trace_bootstrap(void)
+{
+	struct trace_ring **rings;
+	unsigned i, ncpus;
+
+	ncpus = cpu_count();
+	rings = kmalloc(ncpus * sizeof(*rings));
+	if (rings == NULL) {
+		panic("trace_bootstrap: Out of memory\n");
+	}
+	for (i=0; i<ncpus; i++) {
+		rings[i] = kmalloc(sizeof(struct trace_ring));
+		if (rings[i] == NULL) {
+			panic("trace_bootstrap: Out of memory\n");
+		}
+		rings[i]->tg_next = 0;
+		rings[i]->tg_cleared = 0;
+	}
+	trace_ncpus = ncpus;
+	trace_rings = rings;
+}
+
+uint32_t
+trace_class(const char *name)
+{
+	unsigned i;
+
+	for (i=0; trace_classes[i].name != NULL; i++) {
+		if (!strcmp(trace_classes[i].name, name)) {
+			return trace_classes[i].class;
+		}
+	}
+	return 0;
+}
+
+static
+const char *
+trace_classname(uint32_t class)
+{
+	unsigned i;
+
+	for (i=0; trace_classes[i].name != NULL; i++) {
+		if (trace_classes[i].class == class) {
+			return trace_classes[i].name;
+		}
+	}
+	return "?";
+}
+
+/*
+ * Copy the good records of cpu CPU's ring since the last clear into
+ * BUF (room for TRACE_NRECS), oldest first. Returns how many, and in
+ * *LOST how many were overwritten before we got to them.
+ */
+static
+unsigned
+trace_snapshot(unsigned cpu, struct trace_rec *buf, uint32_t *lost)
+{
+	struct trace_ring *tg = trace_rings[cpu];
+	uint32_t first, last, now, i;
+
+	last = tg->tg_next;
+	first = last > TRACE_NRECS ? last - TRACE_NRECS : 0;
+	if (first < tg->tg_cleared) {
+		first = tg->tg_cleared;
+	}
+	for (i=first; i<last; i++) {
+		buf[i - first] = tg->tg_recs[i % TRACE_NRECS];
+	}
+
+	/* Drop those the writer got to while we were copying */
+	now = tg->tg_next;
+	if (now >= first + TRACE_NRECS) {
+		i = now - TRACE_NRECS + 1;
+		if (i > last) {
+			i = last;
+		}
+		memmove(buf, buf + (i - first),
+			(last - i) * sizeof(struct trace_rec));
+		first = i;
+	}
+	*lost = first - tg->tg_cleared;
+	return last - first;
+}
+
+static
+void
+trace_print(unsigned cpu, const struct trace_rec *tr)
+{
+	const uint32_t *a = tr->tr_u.tr_args;
+	size_t len;
+
+	kprintf("[%u.%09u] cpu%u %s: ", tr->tr_secs, tr->tr_nsecs, cpu,
+		trace_classname(tr->tr_class));
+	if (tr->tr_fmt != NULL) {
+		kprintf(tr->tr_fmt, a[0], a[1], a[2], a[3], a[4], a[5]);
+		len = strlen(tr->tr_fmt);
+		if (len == 0 || tr->tr_fmt[len-1] != '\n') {
+			kprintf("\n");
+		}
+	}
+	else {
+		/* vsnprintf always terminates it */
+		len = strlen(tr->tr_u.tr_text);
+		kprintf("%s", tr->tr_u.tr_text);
+		if (len == 0 || tr->tr_u.tr_text[len-1] != '\n') {
+			kprintf("\n");
+		}
+	}
+}
+
+/*
+ * Print the records of the classes in CLASSES, from all cpus merged
+ * by time, oldest first.
+ */
+void
+trace_dump(uint32_t classes)
+{
+	struct trace_rec **bufs = NULL;
+	unsigned *nrecs = NULL, *pos = NULL;
+	uint32_t lost, totallost = 0;
+	unsigned cpu, best, nprinted = 0;
+	const struct trace_rec *tr, *btr;
+
+	if (trace_rings == NULL) {
+		kprintf("trace: not set up yet\n");
+		return;
+	}
+
+	bufs = kmalloc(trace_ncpus * sizeof(*bufs));
+	if (bufs != NULL) {
+		for (cpu=0; cpu<trace_ncpus; cpu++) {
+			bufs[cpu] = NULL;
+		}
+	}
+	nrecs = kmalloc(trace_ncpus * sizeof(*nrecs));
+	pos = kmalloc(trace_ncpus * sizeof(*pos));
+	if (bufs == NULL || nrecs == NULL || pos == NULL) {
+		kprintf("trace: Out of memory\n");
+		goto done;
+	}
+	for (cpu=0; cpu<trace_ncpus; cpu++) {
+		bufs[cpu] = kmalloc(TRACE_NRECS * sizeof(struct trace_rec));
+		if (bufs[cpu] == NULL) {
+			kprintf("trace: Out of memory\n");
+			goto done;
+		}
+		nrecs[cpu] = trace_snapshot(cpu, bufs[cpu], &lost);
+		totallost += lost;
+		pos[cpu] = 0;
+	}
+
+	/* Merge the cpus' records by time */
+	while (1) {
+		best = 0;
+		btr = NULL;
+		for (cpu=0; cpu<trace_ncpus; cpu++) {
+			while (pos[cpu] < nrecs[cpu] &&
+			       (bufs[cpu][pos[cpu]].tr_class & classes) == 0) {
+				pos[cpu]++;
+			}
+			if (pos[cpu] == nrecs[cpu]) {
+				continue;
+			}
+			tr = &bufs[cpu][pos[cpu]];
+			if (btr == NULL || tr->tr_secs < btr->tr_secs ||
+			    (tr->tr_secs == btr->tr_secs &&
+			     tr->tr_nsecs < btr->tr_nsecs)) {
+				best = cpu;
+				btr = tr;
+			}
+		}
+		if (btr == NULL) {
+			break;
+		}
+		trace_print(best, btr);
+		pos[best]++;
+		nprinted++;
+	}
+
+	kprintf("trace: %u records shown, %u overwritten unseen\n",
+		nprinted, totallost);
+
+ done:
+	if (bufs != NULL) {
+		for (cpu=0; cpu<trace_ncpus; cpu++) {
+			if (bufs[cpu] != NULL) {
+				kfree(bufs[cpu]);
+			}
+		}
+		kfree(bufs);
+	}
+	if (nrecs != NULL) {
+		kfree(nrecs);
+	}
+	if (pos != NULL) {
+		kfree(pos);
+	}
+}
+
+/*
+ * Throw away all records recorded so far.
+ */
+void
+trace_clear(void)
+{
+	unsigned cpu;
+
+	if (trace_rings == NULL) {
+		return;
+	}
+	for (cpu=0; cpu<trace_ncpus; cpu++) {
+		trace_rings[cpu]->tg_cleared = trace_rings[cpu]->tg_next;
+	}
+}
@@ -32,6 +32,7 @@
 #include <uio.h>
 #include <proc.h>
 #include <current.h>
+#include <addrspace.h>
 #include <copyinout.h>
 
 /*
@@ -145,6 +146,66 @@ uiomovezeros(size_t n, struct uio *uio)
 	return 0;
 }
 
+void
+uioskip(size_t n, struct uio *uio)
+{
+	struct iovec *iov;
+	size_t size;
+
+	while (n > 0 && uio->uio_resid > 0) {
+		iov = uio->uio_iov;
+		size = iov->iov_len;
+
+		if (size > n) {
+			size = n;
+		}
+
+		if (size == 0) {
+			/* move to the next iovec and try again */
+			uio->uio_iov++;
+			uio->uio_iovcnt--;
+			if (uio->uio_iovcnt == 0) {
+				panic("uioskip: ran out of buffers\n");
+			}
+			continue;
+		}
+
+		if (uio->uio_segflg == UIO_SYSSPACE) {
+			iov->iov_kbase = ((char *)iov->iov_kbase + size);
+		}
+		else {
+			iov->iov_ubase += size;
+		}
+		iov->iov_len -= size;
+		uio->uio_resid -= size;
+		uio->uio_offset += size;
+		n -= size;
+	}
+}
+
+void
+uio_prefault(struct uio *uio)
+{
+	size_t left, len;
+	unsigned i;
+
+	if (uio->uio_segflg == UIO_SYSSPACE) {
+		return;
+	}
+	KASSERT(uio->uio_space == curproc_getas());
+
+	left = uio->uio_resid;
+	for (i=0; i<uio->uio_iovcnt && left > 0; i++) {
+		len = uio->uio_iov[i].iov_len;
+		if (len > left) {
+			len = left;
+		}
+		as_prefault(uio->uio_space,
+			    (vaddr_t)uio->uio_iov[i].iov_ubase, len);
+		left -= len;
+	}
+}
+
 /*
  * Convenience function to initialize an iovec and uio for kernel I/O.
  */
@@ -49,6 +49,8 @@
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
+#include <workqueue.h>
+#include <trace.h>
 #include "autoconf.h"  // for pseudoconfig
 
 
@@ -124,7 +126,10 @@ boot(void)
 	/* Late phase of initialization. */
 	vm_bootstrap();
 	kprintf_bootstrap();
+	futex_bootstrap();
 	thread_start_cpus();
+	trace_bootstrap();
+	workqueue_bootstrap();
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
 	vfs_setbootfs("emu0");
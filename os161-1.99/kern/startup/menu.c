@@ -40,8 +40,13 @@
 #include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
+#include <lamebus/lhd.h>
+#include <generic/stripe.h>
+#include <generic/ramdisk.h>
 #include <syscall.h>
 #include <test.h>
+#include <trace.h>
+#include <prof.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
 #include "opt-net.h"
@@ -374,6 +379,77 @@ cmd_unmount(int nargs, char **args)
 	return vfs_unmount(device);
 }
 
+/*
+ * Command for striping several disks together into one device.
+ */
+static
+int
+cmd_mkstripe(int nargs, char **args)
+{
+	char *device;
+	int unitsize, i;
+
+	if (nargs < 4 || (unitsize = atoi(args[1])) <= 0) {
+		kprintf("Usage: mkstripe sectors device: device: ...\n");
+		return EINVAL;
+	}
+
+	for (i=2; i<nargs; i++) {
+		device = args[i];
+
+		/* Allow (but do not require) colon after device name */
+		if (device[strlen(device)-1]==':') {
+			device[strlen(device)-1] = 0;
+		}
+	}
+
+	return stripe_create(unitsize, nargs - 2, args + 2);
+}
+
+/*
+ * Command for making a ramdisk.
+ */
+static
+int
+cmd_mkrd(int nargs, char **args)
+{
+	int nsects;
+
+	if (nargs != 2 || (nsects = atoi(args[1])) <= 0) {
+		kprintf("Usage: mkrd sectors\n");
+		return EINVAL;
+	}
+
+	return ramdisk_create(nsects);
+}
+
+#if OPT_SFS
+/*
+ * Command for making an empty SFS volume on a device.
+ */
+static
+int
+cmd_mkfs(int nargs, char **args)
+{
+	char *device, *volname;
+
+	if (nargs != 3) {
+		kprintf("Usage: mkfs device: volname\n");
+		return EINVAL;
+	}
+
+	device = args[1];
+	volname = args[2];
+
+	/* Allow (but do not require) colon after device name */
+	if (device[strlen(device)-1]==':') {
+		device[strlen(device)-1] = 0;
+	}
+
+	return sfs_format(device, volname);
+}
+#endif
+
 /*
  * Command to set the "boot fs". 
  *
@@ -415,6 +491,146 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_threadcachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	thread_cache_printstats();
+
+	return 0;
+}
+
+/*
+ * Command for the trace buffer.
+ *
+ *    trace dump [class...]      print records (all, or these classes)
+ *    trace clear                throw records away
+ *    trace on|off class...      record TRACE() events of these classes
+ *    trace debug class...       set dbflags (or "none")
+ *    trace route on|off         send DEBUG() to the buffer, not console
+ *
+ * Classes are DB_* names in lower case ("vm", "sfs", ...) or "all".
+ */
+static
+int
+cmd_trace(int nargs, char **args)
+{
+	uint32_t classes = 0, c;
+	int i;
+
+	for (i=2; i<nargs; i++) {
+		if (!strcmp(args[i], "all")) {
+			c = 0xffffffff;
+		}
+		else if (!strcmp(args[i], "none")) {
+			c = 0;
+		}
+		else {
+			c = trace_class(args[i]);
+			if (c == 0) {
+				kprintf("trace: Unknown class %s\n", args[i]);
+				return EINVAL;
+			}
+		}
+		classes |= c;
+	}
+
+	if (nargs >= 2 && !strcmp(args[1], "dump")) {
+		trace_dump(nargs == 2 ? 0xffffffff : classes);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "clear")) {
+		trace_clear();
+	}
+	else if (nargs > 2 && !strcmp(args[1], "on")) {
+		traceflags |= classes;
+	}
+	else if (nargs > 2 && !strcmp(args[1], "off")) {
+		traceflags &= ~classes;
+	}
+	else if (nargs > 2 && !strcmp(args[1], "debug")) {
+		dbflags = classes;
+	}
+	else if (nargs == 3 && !strcmp(args[1], "route") &&
+		 !strcmp(args[2], "on")) {
+		dbtrace = true;
+	}
+	else if (nargs == 3 && !strcmp(args[1], "route") &&
+		 !strcmp(args[2], "off")) {
+		dbtrace = false;
+	}
+	else {
+		kprintf("Usage: trace dump [class...] | clear | "
+			"on|off class... |\n"
+			"             debug class... | route on|off\n");
+		return EINVAL;
+	}
+	return 0;
+}
+
+/*
+ * Command for the sampling profiler.
+ *
+ *    prof start                 throw old samples away and start
+ *    prof stop                  stop sampling
+ *    prof dump [n] [kernel]     print the N (default 20) busiest pcs,
+ *                               symbolized from file KERNEL
+ */
+static
+int
+cmd_prof(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 2 && !strcmp(args[1], "start")) {
+		result = prof_start();
+		if (result) {
+			kprintf("prof: %s\n", strerror(result));
+			return result;
+		}
+	}
+	else if (nargs == 2 && !strcmp(args[1], "stop")) {
+		prof_stop();
+	}
+	else if (nargs >= 2 && nargs <= 4 && !strcmp(args[1], "dump")) {
+		prof_dump(nargs > 2 ? atoi(args[2]) : 20,
+			  nargs > 3 ? args[3] : "emu0:kernel");
+	}
+	else {
+		kprintf("Usage: prof start | stop | dump [n] [kernelfile]\n");
+		return EINVAL;
+	}
+	return 0;
+}
+
+static
+int
+cmd_diskstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	lhd_printstats();
+
+	return 0;
+}
+
+#if OPT_SFS
+static
+int
+cmd_sfscachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	sfs_cache_printstats();
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -449,6 +665,11 @@ static const char *opsmenu[] = {
 	"[p]       Other program             ",
 	"[mount]   Mount a filesystem        ",
 	"[unmount] Unmount a filesystem      ",
+	"[mkstripe] Stripe disks (RAID-0)    ",
+	"[mkrd]    Make a ramdisk            ",
+#if OPT_SFS
+	"[mkfs]    Make an empty SFS volume  ",
+#endif
 	"[bootfs]  Set \"boot\" filesystem     ",
 	"[pf]      Print a file              ",
 	"[cd]      Change directory          ",
@@ -493,6 +714,12 @@ static const char *testmenu[] = {
 	"[fs3] FS write stress       (4)     ",
 	"[fs4] FS write stress 2     (4)     ",
 	"[fs5] FS create stress      (4)     ",
+	"[fs6] FS open stress        (4)     ",
+	"[fs7] FS throughput         (4)     ",
+	"[fs8] FS random read        (4)     ",
+	"[fs9] FS mmap scan          (4)     ",
+	"[db1] Disk queue benchmark          ",
+	"[cb1] Console throughput            ",
 	NULL
 };
 
@@ -524,6 +751,13 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+	"[tc] Thread cache stats             ",
+	"[ds] Disk queue stats               ",
+	"[trace] Trace buffer                ",
+	"[prof] Sampling profiler            ",
+#if OPT_SFS
+	"[bc] SFS buffer cache stats         ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -559,6 +793,11 @@ static struct {
 	{ "p",		cmd_prog },
 	{ "mount",	cmd_mount },
 	{ "unmount",	cmd_unmount },
+	{ "mkstripe",	cmd_mkstripe },
+	{ "mkrd",	cmd_mkrd },
+#if OPT_SFS
+	{ "mkfs",	cmd_mkfs },
+#endif
 	{ "bootfs",	cmd_bootfs },
 	{ "pf",		printfile },
 	{ "cd",		cmd_chdir },
@@ -581,6 +820,13 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "tc",         cmd_threadcachestats },
+	{ "ds",         cmd_diskstats },
+	{ "trace",      cmd_trace },
+	{ "prof",       cmd_prof },
+#if OPT_SFS
+	{ "bc",         cmd_sfscachestats },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -609,6 +855,14 @@ static struct {
 	{ "fs3",	writestress },
 	{ "fs4",	writestress2 },
 	{ "fs5",	createstress },
+	{ "fs6",	openstress },
+	{ "fs7",	throughput },
+	{ "fs8",	randread },
+	{ "fs9",	mapscan },
+
+	/* device tests */
+	{ "db1",	diskbench },
+	{ "cb1",	conbench },
 
 	{ NULL, NULL }
 };
@@ -110,6 +110,7 @@ static struct semaphore *CatMouseWait;
 struct bowl {
   volatile char animal;          /* 'c' for cat, 'm' for mouse */
   volatile unsigned int which;   /* Which cat or mouse         */
+  volatile int meals;            /* How many times it was used */
 };
 
 struct bowl *bowls;
@@ -139,6 +140,10 @@ static volatile int cat_wait_count;
 static volatile time_t mouse_total_wait_secs;
 static volatile uint32_t mouse_total_wait_nsecs;
 static volatile int mouse_wait_count;
+static volatile time_t cat_max_wait_secs;
+static volatile uint32_t cat_max_wait_nsecs;
+static volatile time_t mouse_max_wait_secs;
+static volatile uint32_t mouse_max_wait_nsecs;
 
 /* mutex to provide mutual exclusion to performance stats */
 static struct semaphore *perf_mutex;
@@ -172,6 +177,7 @@ initialize_bowls()
   for(i=0;i<NumBowls;i++) {
     bowls[i].animal = '-';
     bowls[i].which = INVALID_ANIMAL_NUM;
+    bowls[i].meals = 0;
   }
   eating_cats_count = eating_mice_count = 0;
 
@@ -192,6 +198,8 @@ initialize_bowls()
   mouse_total_wait_secs = 0;
   mouse_total_wait_nsecs = 0;
   mouse_wait_count = 0;
+  cat_max_wait_secs = mouse_max_wait_secs = 0;
+  cat_max_wait_nsecs = mouse_max_wait_nsecs = 0;
   
   return;
 }
@@ -350,6 +358,7 @@ cat_eat(unsigned int bowlnumber, int eat_time, unsigned int cat_num)
   eating_cats_count += 1;
   bowls[bowlnumber-1].animal = 'c';
   bowls[bowlnumber-1].which = cat_num;
+  bowls[bowlnumber-1].meals++;
   print_state();
 
   DEBUG(DB_SYNCPROB,"cat %d starts to eat at bowl %d [%d:%d]\n",
@@ -445,6 +454,7 @@ mouse_eat(unsigned int bowlnumber, int eat_time, unsigned int mouse_num)
   eating_mice_count += 1;
   bowls[bowlnumber-1].animal = 'm';
   bowls[bowlnumber-1].which = mouse_num;
+  bowls[bowlnumber-1].meals++;
   print_state();
 
   DEBUG(DB_SYNCPROB,"mouse %d starts to eat at bowl %d [%d:%d]\n",
@@ -549,6 +559,11 @@ cat_simulation(void * unusedpointer,
       cat_total_wait_secs ++;
     }
     cat_wait_count++;
+    if ((wait_sec > cat_max_wait_secs) ||
+        ((wait_sec == cat_max_wait_secs) && (wait_nsec > cat_max_wait_nsecs))) {
+      cat_max_wait_secs = wait_sec;
+      cat_max_wait_nsecs = wait_nsec;
+    }
     V(perf_mutex);
   }
 
@@ -612,6 +627,11 @@ mouse_simulation(void * unusedpointer,
       mouse_total_wait_secs ++;
     }
     mouse_wait_count++;
+    if ((wait_sec > mouse_max_wait_secs) ||
+        ((wait_sec == mouse_max_wait_secs) && (wait_nsec > mouse_max_wait_nsecs))) {
+      mouse_max_wait_secs = wait_sec;
+      mouse_max_wait_nsecs = wait_nsec;
+    }
     V(perf_mutex);
   }
 
@@ -652,6 +672,7 @@ catmouse(int nargs,
   time_t before_sec, after_sec, wait_sec;
   uint32_t before_nsec, after_nsec, wait_nsec;
   int total_bowl_milliseconds, total_eating_milliseconds, utilization_percent;
+  int sim_milliseconds, max_wait_msecs;
 
   /* check and process command line arguments */
   if ((nargs != 9) && (nargs != 5)) {
@@ -770,12 +791,22 @@ catmouse(int nargs,
   /* compute total simulation time */
   getinterval(before_sec,before_nsec,after_sec,after_nsec,&wait_sec,&wait_nsec);
   /* compute and report bowl utilization */
-  total_bowl_milliseconds = (wait_sec*1000 + wait_nsec/1000000)*NumBowls;
+  sim_milliseconds = wait_sec*1000 + wait_nsec/1000000;
+  kprintf("STATS: Simulation time: %d.%03d seconds, %d meals\n",
+          sim_milliseconds/1000,sim_milliseconds%1000,
+          (NumCats+NumMice)*NumLoops);
+  total_bowl_milliseconds = sim_milliseconds*NumBowls;
   total_eating_milliseconds = (NumCats*CatEatTime + NumMice*MouseEatTime)*NumLoops*1000;
   if (total_bowl_milliseconds > 0) {
     utilization_percent = total_eating_milliseconds*100/total_bowl_milliseconds;
     kprintf("STATS: Bowl utilization: %d%%\n",utilization_percent);
   }
+  /* and how evenly the bowls were used */
+  kprintf("STATS: Meals per bowl:");
+  for(i=0;i<NumBowls;i++) {
+    kprintf(" %d",bowls[i].meals);
+  }
+  kprintf("\n");
 
   /* clean up the semaphore that we created */
   sem_destroy(CatMouseWait);
@@ -789,14 +820,20 @@ catmouse(int nargs,
   if (cat_wait_count > 0) {
     /* some rounding error here - not significant if cat_wait_count << 1000000 */
     mean_cat_wait_usecs = (cat_total_wait_secs*1000000+cat_total_wait_nsecs/1000)/cat_wait_count;
-    kprintf("STATS: Mean cat waiting time: %d.%d seconds\n",
+    kprintf("STATS: Mean cat waiting time: %d.%06d seconds\n",
              mean_cat_wait_usecs/1000000,mean_cat_wait_usecs%1000000);
+    max_wait_msecs = cat_max_wait_secs*1000 + cat_max_wait_nsecs/1000000;
+    kprintf("STATS: Max cat waiting time: %d.%03d seconds\n",
+             max_wait_msecs/1000,max_wait_msecs%1000);
   }
   if (mouse_wait_count > 0) {
     /* some rounding error here - not significant if mouse_wait_count << 1000000 */
     mean_mouse_wait_usecs = (mouse_total_wait_secs*1000000+mouse_total_wait_nsecs/1000)/mouse_wait_count;
-    kprintf("STATS: Mean mouse waiting time: %d.%d seconds\n",
+    kprintf("STATS: Mean mouse waiting time: %d.%06d seconds\n",
              mean_mouse_wait_usecs/1000000,mean_mouse_wait_usecs%1000000);
+    max_wait_msecs = mouse_max_wait_secs*1000 + mouse_max_wait_nsecs/1000000;
+    kprintf("STATS: Max mouse waiting time: %d.%03d seconds\n",
+             max_wait_msecs/1000,max_wait_msecs%1000);
   }
 
   return 0;
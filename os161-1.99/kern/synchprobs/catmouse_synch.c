@@ -3,12 +3,6 @@
 #include <synchprobs.h>
 #include <synch.h>
 
-/* 
- * This simple default synchronization mechanism allows only creature at a time to
- * eat.   The globalCatMouseSem is used as a a lock.   We use a semaphore
- * rather than a lock so that this code will work even before locks are implemented.
- */
-
 /* 
  * Replace this default synchronization mechanism with your own (better) mechanism
  * needed for your solution.   Your mechanism may use any of the available synchronzation
@@ -17,10 +11,103 @@
  */
 
 /*
- * replace this with declarations of any synchronization and other variables you need here
+ * Bowls are shared in turns: while it is the cats' turn any number of
+ * cats may eat, one per bowl, and no mouse may start; then the mice
+ * get a turn, and so on.
+ *
+ * turn_mutex protects the turn state below. A creature is admitted
+ * when it is its species' turn (or nobody's) and the turn still has
+ * room; it then takes the per-bowl lock for its bowl and holds it
+ * while eating, so two creatures of one species never share a bowl
+ * and creatures at different bowls never contend.
+ *
+ * A turn admits at most turn_limit creatures (one round of the bowls)
+ * while the other species is waiting, so neither species can starve
+ * the other: a waiting creature waits for at most the rest of the
+ * current turn and one turn of the other species. When the last
+ * creature admitted in a turn finishes, the turn passes to the other
+ * species if any of them are waiting, and only that many of them are
+ * woken.
  */
-static struct semaphore *globalCatMouseSem;
+#define NO_TURN 0
+#define CAT_TURN 1
+#define MOUSE_TURN 2
+
+static struct lock *turn_mutex;
+static struct cv *cv_species[3];        /* indexed by CAT_TURN/MOUSE_TURN */
+static struct lock **bowl_locks;
+static int num_bowls;
+
+static volatile int turn;               /* whose turn it is */
+static volatile int turn_active;        /* admitted and not yet finished */
+static volatile int turn_served;        /* admitted during this turn */
+static volatile int waiting[3];         /* blocked, by species */
+static int turn_limit;                  /* admissions per turn if contended */
+
+static int other_species(int s);
+static void before_eating(int s, unsigned int bowl);
+static void after_eating(int s, unsigned int bowl);
+
+static int
+other_species(int s)
+{
+	return s == CAT_TURN ? MOUSE_TURN : CAT_TURN;
+}
+
+static void
+before_eating(int s, unsigned int bowl)
+{
+	KASSERT(bowl >= 1 && (int)bowl <= num_bowls);
+
+	lock_acquire(turn_mutex);
+	while (!((turn == s || turn == NO_TURN) &&
+		 (turn_served < turn_limit || waiting[other_species(s)] == 0))) {
+		waiting[s]++;
+		cv_wait(cv_species[s], turn_mutex);
+		waiting[s]--;
+	}
+	turn = s;
+	turn_active++;
+	turn_served++;
+	lock_release(turn_mutex);
+
+	/* may wait here for one of our own species at the same bowl */
+	lock_acquire(bowl_locks[bowl-1]);
+}
 
+static void
+after_eating(int s, unsigned int bowl)
+{
+	int next, n;
+
+	lock_release(bowl_locks[bowl-1]);
+
+	lock_acquire(turn_mutex);
+	KASSERT(turn == s);
+	KASSERT(turn_active > 0);
+	turn_active--;
+	if (turn_active == 0) {
+		/* end of the turn: prefer the other species if it is waiting */
+		next = other_species(s);
+		if (waiting[next] == 0) {
+			next = s;
+		}
+		if (waiting[next] == 0) {
+			/* the next species to arrive starts a fresh turn */
+			turn = NO_TURN;
+			turn_served = 0;
+		} else {
+			turn = next;
+			turn_served = 0;
+			/* wake only as many as this turn can admit */
+			n = waiting[next] < turn_limit ? waiting[next] : turn_limit;
+			while (n-- > 0) {
+				cv_signal(cv_species[next], turn_mutex);
+			}
+		}
+	}
+	lock_release(turn_mutex);
+}
 
 /* 
  * The CatMouse simulation will call this function once before any cat or
@@ -33,14 +120,30 @@ static struct semaphore *globalCatMouseSem;
 void
 catmouse_sync_init(int bowls)
 {
-  /* replace this default implementation with your own implementation of catmouse_sync_init */
-
-  (void)bowls; /* keep the compiler from complaining about unused parameters */
-  globalCatMouseSem = sem_create("globalCatMouseSem",1);
-  if (globalCatMouseSem == NULL) {
-    panic("could not create global CatMouse synchronization semaphore");
-  }
-  return;
+	int i;
+
+	KASSERT(bowls > 0);
+
+	turn_mutex = lock_create("catmouse turn");
+	cv_species[CAT_TURN] = cv_create("catmouse cats");
+	cv_species[MOUSE_TURN] = cv_create("catmouse mice");
+	bowl_locks = kmalloc(bowls * sizeof(struct lock *));
+	if (turn_mutex == NULL || cv_species[CAT_TURN] == NULL ||
+	    cv_species[MOUSE_TURN] == NULL || bowl_locks == NULL) {
+		panic("could not create CatMouse synchronization variables");
+	}
+	for (i = 0; i < bowls; i++) {
+		bowl_locks[i] = lock_create("catmouse bowl");
+		if (bowl_locks[i] == NULL) {
+			panic("could not create CatMouse bowl lock");
+		}
+	}
+
+	turn = NO_TURN;
+	turn_active = turn_served = 0;
+	waiting[CAT_TURN] = waiting[MOUSE_TURN] = 0;
+	num_bowls = bowls;
+	turn_limit = bowls;
 }
 
 /* 
@@ -54,10 +157,21 @@ catmouse_sync_init(int bowls)
 void
 catmouse_sync_cleanup(int bowls)
 {
-  /* replace this default implementation with your own implementation of catmouse_sync_cleanup */
-  (void)bowls; /* keep the compiler from complaining about unused parameters */
-  KASSERT(globalCatMouseSem != NULL);
-  sem_destroy(globalCatMouseSem);
+	int i;
+
+	KASSERT(turn_mutex != NULL);
+	KASSERT(turn_active == 0);
+	KASSERT(bowls == num_bowls);
+
+	for (i = 0; i < bowls; i++) {
+		lock_destroy(bowl_locks[i]);
+	}
+	kfree(bowl_locks);
+	bowl_locks = NULL;
+	cv_destroy(cv_species[CAT_TURN]);
+	cv_destroy(cv_species[MOUSE_TURN]);
+	lock_destroy(turn_mutex);
+	turn_mutex = NULL;
 }
 
 
@@ -76,10 +190,8 @@ catmouse_sync_cleanup(int bowls)
 void
 cat_before_eating(unsigned int bowl) 
 {
-  /* replace this default implementation with your own implementation of cat_before_eating */
-  (void)bowl;  /* keep the compiler from complaining about an unused parameter */
-  KASSERT(globalCatMouseSem != NULL);
-  P(globalCatMouseSem);
+	KASSERT(turn_mutex != NULL);
+	before_eating(CAT_TURN, bowl);
 }
 
 /*
@@ -98,10 +210,8 @@ cat_before_eating(unsigned int bowl)
 void
 cat_after_eating(unsigned int bowl) 
 {
-  /* replace this default implementation with your own implementation of cat_after_eating */
-  (void)bowl;  /* keep the compiler from complaining about an unused parameter */
-  KASSERT(globalCatMouseSem != NULL);
-  V(globalCatMouseSem);
+	KASSERT(turn_mutex != NULL);
+	after_eating(CAT_TURN, bowl);
 }
 
 /*
@@ -119,10 +229,8 @@ cat_after_eating(unsigned int bowl)
 void
 mouse_before_eating(unsigned int bowl) 
 {
-  /* replace this default implementation with your own implementation of mouse_before_eating */
-  (void)bowl;  /* keep the compiler from complaining about an unused parameter */
-  KASSERT(globalCatMouseSem != NULL);
-  P(globalCatMouseSem);
+	KASSERT(turn_mutex != NULL);
+	before_eating(MOUSE_TURN, bowl);
 }
 
 /*
@@ -141,8 +249,6 @@ mouse_before_eating(unsigned int bowl)
 void
 mouse_after_eating(unsigned int bowl) 
 {
-  /* replace this default implementation with your own implementation of mouse_after_eating */
-  (void)bowl;  /* keep the compiler from complaining about an unused parameter */
-  KASSERT(globalCatMouseSem != NULL);
-  V(globalCatMouseSem);
+	KASSERT(turn_mutex != NULL);
+	after_eating(MOUSE_TURN, bowl);
 }
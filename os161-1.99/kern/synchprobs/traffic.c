@@ -193,7 +193,9 @@ print_perf_stats(void) {
   int wait_msecs,mean_wait_msecs,max_wait_msecs;
   int total_wait_msecs = 0;
   int total_count = 0;
+  int all_max_wait_msecs = 0;
   int sim_msec;
+  int vps_milli;
   time_t run_sec;
   uint32_t run_nsec;
 
@@ -214,6 +216,9 @@ print_perf_stats(void) {
       mean_wait_msecs = wait_msecs/wait_count[i];
       total_count += wait_count[i];
       max_wait_msecs = max_wait_secs[i]*1000+max_wait_nsecs[i]/1000000;
+      if (max_wait_msecs > all_max_wait_msecs) {
+        all_max_wait_msecs = max_wait_msecs;
+      }
       kprintf("%d vehicles, average wait %d.%03d seconds, max wait %d.%03d seconds\n",
 	      wait_count[i], mean_wait_msecs/1000,mean_wait_msecs%1000,
 	      max_wait_msecs/1000,max_wait_msecs%1000);
@@ -223,11 +228,13 @@ print_perf_stats(void) {
   }
   /* then the average wait time for all vehicles */
   if (total_count > 0) {
-    kprintf("all:\t%d vehicles, average %d.%03d seconds waiting\n",total_count,
+    kprintf("all:\t%d vehicles, average %d.%03d seconds waiting, max wait %d.%03d seconds\n",
+	    total_count,
 	    (total_wait_msecs/total_count)/1000,
-	    (total_wait_msecs/total_count)%1000);
+	    (total_wait_msecs/total_count)%1000,
+	    all_max_wait_msecs/1000,all_max_wait_msecs%1000);
   } else{
-    kprintf("all:\t0 vehicles, average 0.000 seconds waiting\n");
+    kprintf("all:\t0 vehicles, average 0.000 seconds waiting, max wait 0.000 seconds\n");
   }
   /* finally, overall simulation run-time and throughput */
   getinterval(start_sec,start_nsec,end_sec,end_nsec,&run_sec,&run_nsec);
@@ -237,6 +244,15 @@ print_perf_stats(void) {
 	  sim_msec/1000,
 	  sim_msec%1000,
 	  total_count);
+  /* throughput in thousandths of a vehicle per second */
+  if (sim_msec > 0) {
+    vps_milli = (total_count*1000/sim_msec)*1000 +
+      ((total_count*1000)%sim_msec)*1000/sim_msec;
+  } else {
+    vps_milli = 0;
+  }
+  kprintf("Throughput: %d.%03d vehicles/second\n",
+	  vps_milli/1000,vps_milli%1000);
 } 
 
 
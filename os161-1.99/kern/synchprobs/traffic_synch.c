@@ -22,8 +22,17 @@ static volatile int volatile enterBlock[4] = {0, 0, 0, 0};
 static volatile int volatile regularBlock[4] = {0, 0, 0, 0};
 static volatile int volatile rightTurnBlock[4] = {0, 0, 0, 0};
 
+/*
+ * Vehicles wait on the condition variable for their route (origin and
+ * destination). Every vehicle on one route is blocked by exactly the
+ * same traffic, and vehicles on the same route never block each other,
+ * so when a route clears we can broadcast to it and everybody woken
+ * can go. A vehicle leaving only wakes the routes it actually cleared,
+ * instead of every waiting vehicle in every direction.
+ */
 static struct lock *mutex;
-static struct cv *cv_traffic;
+static struct cv *cv_route[4][4];
+static volatile int routeWaiting[4][4];
 
 void setEnter(Direction o, int i);
 void setExit(Direction o, int i);
@@ -31,6 +40,8 @@ void setRightTurnBlock(Direction o, int i);
 void setBlock(Direction o, Direction d, int i);
 bool checkConstraint(Direction o, Direction d);
 
+void wakeRoutes(Direction o);
+
 void 
 setEnter(Direction o, int i){
     enterBlock[o] += i;
@@ -88,6 +99,23 @@ checkConstraint(Direction o, Direction d){
     return (enterBlock[o] > 0 || regularBlock[d] > 0);
 }
 
+/*
+ * Wake every route with waiting vehicles that is no longer blocked.
+ * Start with the origin after o so no one direction is always
+ * woken (and so gets the lock) first. Called with mutex held.
+ */
+void
+wakeRoutes(Direction o){
+    for (unsigned int i = 1; i <= 4; i++){
+        Direction o2 = (o + i) % 4;
+        for (unsigned int d2 = 0; d2 < 4; d2++){
+            if (routeWaiting[o2][d2] > 0 && !checkConstraint(o2, d2)){
+                cv_broadcast(cv_route[o2][d2], mutex);
+            }
+        }
+    }
+}
+
 
 /* 
  * The simulation driver will call this function once before starting
@@ -100,12 +128,21 @@ void
 intersection_sync_init(void)
 {
     mutex = lock_create("traffic lock");
-    cv_traffic = cv_create("traffic cv");
     
-    if ( mutex == NULL || cv_traffic == NULL ){
+    if ( mutex == NULL ){
         panic("uh-oh.....");
     }
     
+    for (unsigned int o = 0; o < 4; o++){
+        for (unsigned int d = 0; d < 4; d++){
+            cv_route[o][d] = cv_create("traffic route cv");
+            if (cv_route[o][d] == NULL){
+                panic("uh-oh.....");
+            }
+            routeWaiting[o][d] = 0;
+        }
+    }
+    
   return;
 }
 
@@ -120,10 +157,14 @@ void
 intersection_sync_cleanup(void)
 {
   KASSERT(mutex != NULL);
-  KASSERT(cv_traffic != NULL);
   
+  for (unsigned int o = 0; o < 4; o++){
+      for (unsigned int d = 0; d < 4; d++){
+          KASSERT(routeWaiting[o][d] == 0);
+          cv_destroy(cv_route[o][d]);
+      }
+  }
   lock_destroy(mutex);
-  cv_destroy(cv_traffic);
 
 }
 
@@ -144,12 +185,13 @@ void
 intersection_before_entry(Direction o, Direction d) 
 {
     KASSERT(mutex != NULL);
-    KASSERT(cv_traffic != NULL);
     
     lock_acquire(mutex);
     
     while (checkConstraint(o,d)){
-        cv_wait(cv_traffic, mutex);
+        routeWaiting[o][d]++;
+        cv_wait(cv_route[o][d], mutex);
+        routeWaiting[o][d]--;
     }
     
     setBlock(o,d,1);
@@ -173,12 +215,11 @@ void
 intersection_after_exit(Direction o, Direction d) 
 {
     KASSERT(mutex != NULL);
-    KASSERT(cv_traffic != NULL);
     
     lock_acquire(mutex);
     
     setBlock(o,d,-1);
-    cv_broadcast(cv_traffic, mutex);
+    wakeRoutes(o);
 
     lock_release(mutex);
 }
@@ -0,0 +1,228 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <wchan.h>
+#include <proc.h>
+#include <current.h>
+#include <copyinout.h>
+#include <syscall.h>
+
+/*
+ * Futex-style user synchronization.
+ *
+ * futex_wait(uaddr, val) puts the caller to sleep if the int at UADDR
+ * still holds VAL; futex_wake(uaddr, n) wakes up to N threads sleeping
+ * on UADDR. User-level code does the uncontended case entirely with
+ * atomic instructions and only calls in here to block or to wake
+ * somebody up.
+ *
+ * A futex is keyed by (address space, user address). Futexes with
+ * sleepers live in a fixed-size hash table; each bucket is protected
+ * by a sleep lock, because we need to copyin() the user word while
+ * holding it and copyin may fault. Each futex has its own wait
+ * channel so wakeups only go to threads waiting on that address.
+ */
+
+#define FUTEX_HASHSIZE  64
+
+struct futex {
+	struct addrspace *f_as;		/* address space of the key */
+	vaddr_t f_uaddr;		/* user address of the key */
+	struct wchan *f_wchan;		/* sleepers on this futex */
+	unsigned f_waiters;		/* threads not yet woken */
+	unsigned f_refs;		/* threads not yet returned */
+	struct futex *f_next;		/* next in hash chain */
+};
+
+struct futex_bucket {
+	struct lock *fb_lock;
+	struct futex *fb_list;
+};
+
+static struct futex_bucket futex_table[FUTEX_HASHSIZE];
+
+/*
+ * Set up the hash table. Called once at boot.
+ */
+void
+futex_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<FUTEX_HASHSIZE; i++) {
+		futex_table[i].fb_lock = lock_create("futex");
+		if (futex_table[i].fb_lock == NULL) {
+			panic("futex_bootstrap: lock_create failed\n");
+		}
+		futex_table[i].fb_list = NULL;
+	}
+}
+
+static
+struct futex_bucket *
+futex_hash(struct addrspace *as, vaddr_t uaddr)
+{
+	unsigned h;
+
+	/* user words are int-aligned, so the low two bits carry nothing */
+	h = (unsigned)(uaddr >> 2) ^ ((unsigned)(uintptr_t)as >> 4);
+	h ^= h >> 16;
+	return &futex_table[h % FUTEX_HASHSIZE];
+}
+
+/*
+ * Find the futex for (AS, UADDR) in bucket FB, optionally creating it.
+ * Returns NULL if not found (or out of memory when creating).
+ * The bucket lock must be held.
+ */
+static
+struct futex *
+futex_lookup(struct futex_bucket *fb, struct addrspace *as, vaddr_t uaddr,
+	     bool create)
+{
+	struct futex *f;
+
+	KASSERT(lock_do_i_hold(fb->fb_lock));
+
+	for (f = fb->fb_list; f != NULL; f = f->f_next) {
+		if (f->f_as == as && f->f_uaddr == uaddr) {
+			return f;
+		}
+	}
+	if (!create) {
+		return NULL;
+	}
+
+	f = kmalloc(sizeof(*f));
+	if (f == NULL) {
+		return NULL;
+	}
+	f->f_wchan = wchan_create("futex");
+	if (f->f_wchan == NULL) {
+		kfree(f);
+		return NULL;
+	}
+	f->f_as = as;
+	f->f_uaddr = uaddr;
+	f->f_waiters = 0;
+	f->f_refs = 0;
+	f->f_next = fb->fb_list;
+	fb->fb_list = f;
+	return f;
+}
+
+/*
+ * Unlink and free a futex nobody is using any more.
+ * The bucket lock must be held.
+ */
+static
+void
+futex_remove(struct futex_bucket *fb, struct futex *f)
+{
+	struct futex **fp;
+
+	KASSERT(lock_do_i_hold(fb->fb_lock));
+	KASSERT(f->f_refs == 0);
+	KASSERT(f->f_waiters == 0);
+
+	for (fp = &fb->fb_list; *fp != f; fp = &(*fp)->f_next) {
+		KASSERT(*fp != NULL);
+	}
+	*fp = f->f_next;
+
+	wchan_destroy(f->f_wchan);
+	kfree(f);
+}
+
+int
+sys_futex_wait(userptr_t uaddr, int val)
+{
+	struct addrspace *as;
+	struct futex_bucket *fb;
+	struct futex *f;
+	int cur;
+	int result;
+
+	if ((vaddr_t)uaddr % sizeof(int) != 0) {
+		return EINVAL;
+	}
+
+	as = curproc_getas();
+	fb = futex_hash(as, (vaddr_t)uaddr);
+
+	lock_acquire(fb->fb_lock);
+
+	/*
+	 * Check the value with the bucket locked, so a waker that
+	 * changes it and then calls futex_wake can't slip in between
+	 * the check and our going to sleep.
+	 */
+	result = copyin(uaddr, &cur, sizeof(cur));
+	if (result) {
+		lock_release(fb->fb_lock);
+		return result;
+	}
+	if (cur != val) {
+		lock_release(fb->fb_lock);
+		return EAGAIN;
+	}
+
+	f = futex_lookup(fb, as, (vaddr_t)uaddr, true);
+	if (f == NULL) {
+		lock_release(fb->fb_lock);
+		return ENOMEM;
+	}
+	f->f_waiters++;
+	f->f_refs++;
+
+	wchan_lock(f->f_wchan);
+	lock_release(fb->fb_lock);
+	wchan_sleep(f->f_wchan);
+
+	lock_acquire(fb->fb_lock);
+	KASSERT(f->f_refs > 0);
+	f->f_refs--;
+	if (f->f_refs == 0) {
+		futex_remove(fb, f);
+	}
+	lock_release(fb->fb_lock);
+
+	return 0;
+}
+
+int
+sys_futex_wake(userptr_t uaddr, int nwake, int32_t *retval)
+{
+	struct addrspace *as;
+	struct futex_bucket *fb;
+	struct futex *f;
+	int woken;
+
+	if ((vaddr_t)uaddr % sizeof(int) != 0 || nwake < 0) {
+		return EINVAL;
+	}
+
+	as = curproc_getas();
+	fb = futex_hash(as, (vaddr_t)uaddr);
+	woken = 0;
+
+	lock_acquire(fb->fb_lock);
+	f = futex_lookup(fb, as, (vaddr_t)uaddr, false);
+	if (f != NULL) {
+		/*
+		 * Every thread counted in f_waiters locked the wchan
+		 * before dropping the bucket lock, so it is already on
+		 * the channel and each wakeone finds somebody.
+		 */
+		while (woken < nwake && f->f_waiters > 0) {
+			wchan_wakeone(f->f_wchan);
+			f->f_waiters--;
+			woken++;
+		}
+	}
+	lock_release(fb->fb_lock);
+
+	*retval = woken;
+	return 0;
+}
@@ -0,0 +1,102 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/mman.h>
+#include <kern/unistd.h>
+#include <lib.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vnode.h>
+#include <syscall.h>
+
+/*
+ * mmap() and munmap().
+ *
+ * A mapping is a range of the address space that shows a file,
+ * read-only, starting at a page-aligned offset. Nothing is read when
+ * it's made: vm_fault gets each page from the file (VOP_MMAP) the
+ * first time it's touched, and the pages are the file's own, shared
+ * with every other mapping of it.
+ */
+
+/*
+ * Find the file open on descriptor FD. There's no open file table
+ * yet; all a process has is the console, on the standard descriptors.
+ */
+static
+int
+mman_getfile(int fd, struct vnode **ret)
+{
+#ifdef UW
+	if (fd >= STDIN_FILENO && fd <= STDERR_FILENO &&
+	    curproc->console != NULL) {
+		*ret = curproc->console;
+		return 0;
+	}
+#else
+	(void)fd;
+	(void)ret;
+#endif
+	return EBADF;
+}
+
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	 off_t offset, int32_t *retval)
+{
+	struct addrspace *as;
+	struct vnode *vn;
+	vaddr_t base;
+	int result;
+
+	/* The address is only a hint, and we have no use for it */
+	(void)addr;
+
+	if (len == 0 || offset < 0 || offset % PAGE_SIZE != 0) {
+		return EINVAL;
+	}
+	if ((prot & ~(PROT_READ|PROT_WRITE|PROT_EXEC)) != 0 ||
+	    (prot & PROT_READ) == 0) {
+		return EINVAL;
+	}
+	if (prot & PROT_WRITE) {
+		/* Pages can't be written through a mapping */
+		return EACCES;
+	}
+	if ((flags & ~(MAP_SHARED|MAP_PRIVATE)) != 0 ||
+	    (flags & (MAP_SHARED|MAP_PRIVATE)) == 0 ||
+	    (flags & (MAP_SHARED|MAP_PRIVATE)) == (MAP_SHARED|MAP_PRIVATE)) {
+		return EINVAL;
+	}
+
+	result = mman_getfile(fd, &vn);
+	if (result) {
+		return result;
+	}
+
+	/* Can it be mapped at all? */
+	result = VOP_MMAP(vn, offset, false, NULL);
+	if (result) {
+		return result;
+	}
+
+	as = curproc_getas();
+	KASSERT(as != NULL);
+	result = as_map(as, len, vn, offset, &base);
+	if (result) {
+		return result;
+	}
+
+	*retval = (int32_t)base;
+	return 0;
+}
+
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+	struct addrspace *as;
+
+	as = curproc_getas();
+	KASSERT(as != NULL);
+	return as_unmap(as, (vaddr_t)addr, len);
+}
@@ -14,8 +14,21 @@
 #include <synch.h>
 #include <test.h>
 #include <kern/fcntl.h>
+#include <workqueue.h>
 #include "opt-A2.h"
 
+/*
+ * Work function for tearing down an exited process's address space
+ * in a worker thread rather than in _exit.
+ */
+static
+void
+exit_as_destroy(void *as, unsigned long unused)
+{
+  (void)unused;
+  as_destroy(as);
+}
+
   /* this implementation of sys__exit does not do anything with the exit code */
   /* this needs to be fixed to get exit() and waitpid() working properly */
 
@@ -36,7 +49,14 @@ void sys__exit(int exitcode) {
    * messily fatal.
    */
   as = curproc_setas(NULL);
-  as_destroy(as);
+  /*
+   * Nothing can use the address space any more, so freeing its
+   * pages can wait; let a worker do it and get on with exiting
+   * (and waking up the parent). Do it here if that fails.
+   */
+  if (workqueue_submit(exit_as_destroy, as, 0)) {
+    as_destroy(as);
+  }
   
   // free pid and resolve parent/children relationship
   KASSERT(curproc->info != NULL);
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * contest - console output throughput benchmark
+ *
+ * Writes lines of text to con: the way a user program's printf does,
+ * a few K per write, and prints the rate in bytes per second. The
+ * clock stops when the last write returns, which may leave up to a
+ * ring's worth of output (CONSOLE_OUTPUT_BUFFER_SIZE) still to go out;
+ * use a total well above that.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <clock.h>
+#include <test.h>
+
+#define CB_DEFAULTBYTES	32768
+#define CB_WRITESIZE	4096	/* bytes per write */
+#define CB_LINELEN	64	/* including the newline */
+
+/*
+ * Usage: cb1 [bytes]
+ */
+int
+conbench(int nargs, char **args)
+{
+	struct vnode *vn;
+	struct iovec iov;
+	struct uio ku;
+	char name[8];
+	char *buf;
+	size_t total, done, len;
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	uint64_t totalns;
+	unsigned i;
+	int err;
+
+	if (nargs > 2) {
+		kprintf("Usage: cb1 [bytes]\n");
+		return EINVAL;
+	}
+	total = CB_DEFAULTBYTES;
+	if (nargs == 2) {
+		if (atoi(args[1]) <= 0) {
+			kprintf("Usage: cb1 [bytes]\n");
+			return EINVAL;
+		}
+		total = atoi(args[1]);
+	}
+
+	buf = kmalloc(CB_WRITESIZE);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+	for (i=0; i<CB_WRITESIZE; i++) {
+		buf[i] = (i % CB_LINELEN == CB_LINELEN - 1) ?
+			'\n' : 'a' + i % 26;
+	}
+
+	/* vfs_open may scribble on the name */
+	strcpy(name, "con:");
+	err = vfs_open(name, O_WRONLY, 0, &vn);
+	if (err) {
+		kprintf("conbench: con: %s\n", strerror(err));
+		kfree(buf);
+		return err;
+	}
+
+	gettime(&secs1, &nsecs1);
+	for (done = 0; done < total; done += len) {
+		len = total - done < CB_WRITESIZE ? total - done : CB_WRITESIZE;
+		uio_kinit(&iov, &ku, buf, len, 0, UIO_WRITE);
+		err = VOP_WRITE(vn, &ku);
+		if (err) {
+			break;
+		}
+	}
+	gettime(&secs2, &nsecs2);
+
+	vfs_close(vn);
+	kfree(buf);
+
+	if (err) {
+		kprintf("\nconbench: write: %s\n", strerror(err));
+		return err;
+	}
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	totalns = (uint64_t)secs * 1000000000 + nsecs;
+	kprintf("\nconbench: %lu bytes in %lu.%09lu seconds "
+		"(%lu bytes/sec)\n",
+		(unsigned long)total, (unsigned long)secs,
+		(unsigned long)nsecs,
+		totalns > 0 ?
+		(unsigned long)((uint64_t)total * 1000000000 / totalns) : 0);
+	return 0;
+}
@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * disktest - disk request queue benchmark
+ *
+ * Several threads read short runs of sectors at random places on a
+ * raw disk device all at once, so the driver's request queue has
+ * something to choose from, and the time taken and the driver's
+ * queue statistics are printed. Only reads are done, so it's safe to
+ * run on a disk holding a file system, mounted or not.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <uio.h>
+#include <thread.h>
+#include <synch.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <stat.h>
+#include <clock.h>
+#include <lamebus/lhd.h>
+#include <test.h>
+
+#define DB_NTHREADS	8	/* concurrent readers */
+#define DB_NREADS	128	/* reads per thread */
+#define DB_MAXRUN	4	/* most sectors per read */
+#define DB_SECTSIZE	512
+
+static struct semaphore *db_donesem;
+static char db_devname[32];
+static uint32_t db_nsects;
+static volatile unsigned db_errors;
+
+static
+void
+diskbench_thread(void *unused, unsigned long num)
+{
+	char *buf;
+	struct vnode *vn;
+	struct iovec iov;
+	struct uio ku;
+	char name[32];
+	uint32_t sector, len;
+	unsigned i;
+	int err;
+
+	(void)unused;
+
+	buf = kmalloc(DB_MAXRUN * DB_SECTSIZE);
+	if (buf == NULL) {
+		kprintf("diskbench %lu: Out of memory\n", num);
+		db_errors++;
+		V(db_donesem);
+		return;
+	}
+
+	/* vfs_open may scribble on the name */
+	strcpy(name, db_devname);
+	err = vfs_open(name, O_RDONLY, 0, &vn);
+	if (err) {
+		kprintf("diskbench %lu: %s: %s\n", num, db_devname,
+			strerror(err));
+		db_errors++;
+		kfree(buf);
+		V(db_donesem);
+		return;
+	}
+
+	for (i=0; i<DB_NREADS; i++) {
+		len = 1 + random() % DB_MAXRUN;
+		sector = random() % (db_nsects - len + 1);
+		uio_kinit(&iov, &ku, buf, len * DB_SECTSIZE,
+			  (off_t)sector * DB_SECTSIZE, UIO_READ);
+		err = VOP_READ(vn, &ku);
+		if (err) {
+			kprintf("diskbench %lu: sector %u: %s\n", num,
+				sector, strerror(err));
+			db_errors++;
+			break;
+		}
+	}
+
+	vfs_close(vn);
+	kfree(buf);
+	V(db_donesem);
+}
+
+/*
+ * Usage: db1 rawdevice   (e.g. db1 lhd0raw)
+ */
+int
+diskbench(int nargs, char **args)
+{
+	struct vnode *vn;
+	struct stat st;
+	char name[32];
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	uint64_t totalns;
+	unsigned i;
+	int err;
+
+	if (nargs != 2) {
+		kprintf("Usage: db1 rawdevice\n");
+		return EINVAL;
+	}
+
+	/* Allow (but do not require) colon after device name */
+	snprintf(db_devname, sizeof(db_devname), "%s", args[1]);
+	if (db_devname[strlen(db_devname)-1] != ':') {
+		strcat(db_devname, ":");
+	}
+
+	strcpy(name, db_devname);
+	err = vfs_open(name, O_RDONLY, 0, &vn);
+	if (err) {
+		kprintf("diskbench: %s: %s\n", db_devname, strerror(err));
+		return err;
+	}
+	err = VOP_STAT(vn, &st);
+	vfs_close(vn);
+	if (err) {
+		kprintf("diskbench: %s: stat: %s\n", db_devname,
+			strerror(err));
+		return err;
+	}
+	db_nsects = st.st_size / DB_SECTSIZE;
+	if (db_nsects < DB_MAXRUN) {
+		kprintf("diskbench: %s: too small\n", db_devname);
+		return EINVAL;
+	}
+
+	if (db_donesem == NULL) {
+		db_donesem = sem_create("diskbench", 0);
+		if (db_donesem == NULL) {
+			return ENOMEM;
+		}
+	}
+	db_errors = 0;
+
+	kprintf("*** Starting disk benchmark on %s (%u sectors)\n",
+		db_devname, db_nsects);
+
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<DB_NTHREADS; i++) {
+		err = thread_fork("diskbench", NULL, diskbench_thread,
+				  NULL, i);
+		if (err) {
+			panic("diskbench: thread_fork failed: %s\n",
+			      strerror(err));
+		}
+	}
+	for (i=0; i<DB_NTHREADS; i++) {
+		P(db_donesem);
+	}
+	gettime(&secs2, &nsecs2);
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	totalns = (uint64_t)secs * 1000000000 + nsecs;
+	kprintf("diskbench: %d random reads by %d threads in "
+		"%lu.%09lu seconds (%lu us/read)\n",
+		DB_NTHREADS * DB_NREADS, DB_NTHREADS,
+		(unsigned long)secs, (unsigned long)nsecs,
+		(unsigned long)(totalns / (DB_NTHREADS * DB_NREADS) / 1000));
+	lhd_printstats();
+
+	kprintf("*** disk benchmark %s\n", db_errors ? "failed" : "done");
+	return 0;
+}
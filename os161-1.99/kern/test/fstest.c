@@ -48,6 +48,11 @@
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
+#include <clock.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <copyinout.h>
 #include <test.h>
 
 #define SLOGAN   "HODIE MIHI - CRAS TIBI\n"
@@ -55,6 +60,14 @@
 #define NCHUNKS  720
 #define NTHREADS 12
 #define NCREATES 32
+#define MAXOPEN  128	/* openstress: most files held open */
+#define NREOPENS 256	/* openstress: timed opens per level */
+#define TPUTSIZE (64*1024)	/* throughput: file size */
+#define TPUTMAXIO (32*1024)	/* throughput: largest transfer */
+#define RANDSIZE (4*1024*1024)	/* randread: file size */
+#define RANDBLK  512		/* randread: read size */
+#define NRANDREADS 512		/* randread: timed reads */
+#define MAPSIZE  (256*1024)	/* mapscan: file size */
 
 static struct semaphore *threadsem = NULL;
 
@@ -70,6 +83,32 @@ init_threadsem(void)
 	}
 }
 
+/*
+ * Print the rate at which BYTES were moved between two gettime()
+ * readings, in MB/s.
+ */
+static
+void
+fstest_rate(const char *what, size_t bytes,
+	    time_t secs1, uint32_t nsecs1, time_t secs2, uint32_t nsecs2)
+{
+	time_t secs;
+	uint32_t nsecs;
+	uint64_t totalns, centimb;
+
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	totalns = (uint64_t)secs * 1000000000 + nsecs;
+	if (totalns == 0) {
+		totalns = 1;
+	}
+	/* hundredths of a MB/s */
+	centimb = (uint64_t)bytes * 100 * 1000000000 / (totalns * 1024 * 1024);
+	kprintf("%s: %lu bytes in %lu.%09lu seconds (%lu.%02lu MB/s)\n",
+		what, (unsigned long)bytes,
+		(unsigned long)secs, (unsigned long)nsecs,
+		(unsigned long)(centimb / 100), (unsigned long)(centimb % 100));
+}
+
 /*
  * Vary each line of the test file in a way that's predictable but
  * unlikely to mask bugs in the filesystem.
@@ -313,6 +352,8 @@ static
 void
 doreadstress(const char *filesys)
 {
+	time_t secs1, secs2;
+	uint32_t nsecs1, nsecs2;
 	int i, err;
 
 	init_threadsem();
@@ -324,6 +365,7 @@ doreadstress(const char *filesys)
 		return;
 	}
 
+	gettime(&secs1, &nsecs1);
 	for (i=0; i<NTHREADS; i++) {
 		err = thread_fork("readstress", NULL,
 				  readstress_thread, (char *)filesys, i);
@@ -336,6 +378,9 @@ doreadstress(const char *filesys)
 	for (i=0; i<NTHREADS; i++) {
 		P(threadsem);
 	}
+	gettime(&secs2, &nsecs2);
+	fstest_rate("readstress", NTHREADS * NCHUNKS * strlen(SLOGAN),
+		    secs1, nsecs1, secs2, nsecs2);
 
 	if (fstest_remove(filesys, "")) {
 		kprintf("*** Test failed\n");
@@ -380,12 +425,15 @@ static
 void
 dowritestress(const char *filesys)
 {
+	time_t secs1, secs2;
+	uint32_t nsecs1, nsecs2;
 	int i, err;
 
 	init_threadsem();
 
 	kprintf("*** Starting fs write stress test on %s:\n", filesys);
 
+	gettime(&secs1, &nsecs1);
 	for (i=0; i<NTHREADS; i++) {
 		err = thread_fork("writestress", NULL,
 				  writestress_thread, (char *)filesys, i);
@@ -397,6 +445,10 @@ dowritestress(const char *filesys)
 	for (i=0; i<NTHREADS; i++) {
 		P(threadsem);
 	}
+	gettime(&secs2, &nsecs2);
+	/* each thread writes its file and reads it back */
+	fstest_rate("writestress", 2 * NTHREADS * NCHUNKS * strlen(SLOGAN),
+		    secs1, nsecs1, secs2, nsecs2);
 
 	kprintf("*** fs write stress test done\n");
 }
@@ -537,6 +589,517 @@ docreatestress(const char *filesys)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * Measure how the cost of opening a file that is already open (and
+ * so already has a vnode loaded) changes as the number of open
+ * files grows. Holds 8, 16, ... MAXOPEN files open and at each level
+ * times NREOPENS open/close pairs on them.
+ */
+static
+void
+doopenstress(const char *filesys)
+{
+	struct vnode **held;
+	struct vnode *vn;
+	char name[32];
+	char numstr[16];
+	const char *fs = filesys;
+	const char *namesuffix = numstr;
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	uint64_t totalns;
+	int nheld, level, i, err;
+
+	kprintf("*** Starting fs open stress test on %s:\n", filesys);
+
+	held = kmalloc(MAXOPEN * sizeof(struct vnode *));
+	if (held == NULL) {
+		kprintf("*** openstress: Out of memory\n");
+		return;
+	}
+
+	nheld = 0;
+	for (level = 8; level <= MAXOPEN; level *= 2) {
+		/* Create and hold open files up to this level. */
+		for (; nheld < level; nheld++) {
+			snprintf(numstr, sizeof(numstr), "open-%d", nheld);
+			MAKENAME();
+			err = vfs_open(name, O_WRONLY|O_CREAT|O_TRUNC, 0664,
+				       &held[nheld]);
+			if (err) {
+				kprintf("Could not create file %d: %s\n",
+					nheld, strerror(err));
+				goto out;
+			}
+		}
+
+		/* Reopen them round-robin. */
+		gettime(&secs1, &nsecs1);
+		for (i=0; i<NREOPENS; i++) {
+			snprintf(numstr, sizeof(numstr), "open-%d", i % level);
+			MAKENAME();
+			err = vfs_open(name, O_RDONLY, 0664, &vn);
+			if (err) {
+				kprintf("Could not reopen file %d: %s\n",
+					i % level, strerror(err));
+				goto out;
+			}
+			vfs_close(vn);
+		}
+		gettime(&secs2, &nsecs2);
+		getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+		totalns = (uint64_t)secs * 1000000000 + nsecs;
+		kprintf("%4d files open: %d opens in %lu.%09lu seconds "
+			"(%lu ns/open)\n", level, NREOPENS,
+			(unsigned long)secs, (unsigned long)nsecs,
+			(unsigned long)(totalns / NREOPENS));
+	}
+
+ out:
+	for (i=0; i<nheld; i++) {
+		vfs_close(held[i]);
+		snprintf(numstr, sizeof(numstr), "open-%d", i);
+		fstest_remove(filesys, numstr);
+	}
+	kfree(held);
+
+	kprintf("*** fs open stress test done\n");
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Move all of file VN (TPUTSIZE bytes) in direction RW, IOSIZE bytes
+ * per VOP_READ/VOP_WRITE call.
+ */
+static
+int
+throughput_pass(struct vnode *vn, char *buf, size_t iosize, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio ku;
+	off_t pos;
+	int err;
+
+	for (pos = 0; pos < TPUTSIZE; pos += iosize) {
+		uio_kinit(&iov, &ku, buf, iosize, pos, rw);
+		err = (rw == UIO_READ) ? VOP_READ(vn, &ku) : VOP_WRITE(vn, &ku);
+		if (err) {
+			kprintf("throughput: %s error: %s\n",
+				rw == UIO_READ ? "Read" : "Write",
+				strerror(err));
+			return -1;
+		}
+		if (ku.uio_resid > 0) {
+			kprintf("throughput: Short %s: %lu bytes left over\n",
+				rw == UIO_READ ? "read" : "write",
+				(unsigned long) ku.uio_resid);
+			return -1;
+		}
+	}
+	if (rw == UIO_WRITE) {
+		/* Count getting it to disk, not just into the cache */
+		err = VOP_FSYNC(vn);
+		if (err) {
+			kprintf("throughput: fsync: %s\n", strerror(err));
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Measure sequential read and write bandwidth of one file for
+ * transfer sizes from one block up, to show what the file system
+ * gains from doing large transfers in few device requests.
+ *
+ * Before each timed read the file is rewritten in TPUTMAXIO-sized
+ * pieces; large transfers bypass the buffer cache and drop whatever
+ * it holds of the file, so the reads come from the disk.
+ */
+static
+void
+dothroughput(const char *filesys)
+{
+	static const size_t iosizes[] = { 512, 4096, TPUTMAXIO };
+	struct vnode *vn;
+	char name[32];
+	char what[32];
+	const char *fs = filesys;
+	const char *namesuffix = "tput";
+	char *buf;
+	time_t secs1, secs2;
+	uint32_t nsecs1, nsecs2;
+	unsigned i;
+	int err;
+
+	kprintf("*** Starting fs throughput test on %s:\n", filesys);
+
+	buf = kmalloc(TPUTMAXIO);
+	if (buf == NULL) {
+		kprintf("*** throughput: Out of memory\n");
+		return;
+	}
+	for (i=0; i<TPUTMAXIO; i++) {
+		buf[i] = 'a' + i % 26;
+	}
+
+	MAKENAME();
+	err = vfs_open(name, O_RDWR|O_CREAT|O_TRUNC, 0664, &vn);
+	if (err) {
+		kprintf("Could not create test file: %s\n", strerror(err));
+		kfree(buf);
+		return;
+	}
+
+	for (i=0; i<sizeof(iosizes)/sizeof(iosizes[0]); i++) {
+		gettime(&secs1, &nsecs1);
+		err = throughput_pass(vn, buf, iosizes[i], UIO_WRITE);
+		gettime(&secs2, &nsecs2);
+		if (err) {
+			goto out;
+		}
+		snprintf(what, sizeof(what), "write %5lu",
+			 (unsigned long)iosizes[i]);
+		fstest_rate(what, TPUTSIZE, secs1, nsecs1, secs2, nsecs2);
+
+		if (throughput_pass(vn, buf, TPUTMAXIO, UIO_WRITE)) {
+			goto out;
+		}
+
+		gettime(&secs1, &nsecs1);
+		err = throughput_pass(vn, buf, iosizes[i], UIO_READ);
+		gettime(&secs2, &nsecs2);
+		if (err) {
+			goto out;
+		}
+		snprintf(what, sizeof(what), "read  %5lu",
+			 (unsigned long)iosizes[i]);
+		fstest_rate(what, TPUTSIZE, secs1, nsecs1, secs2, nsecs2);
+	}
+
+ out:
+	vfs_close(vn);
+	fstest_remove(filesys, namesuffix);
+	kfree(buf);
+
+	kprintf("*** fs throughput test done\n");
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Measure the latency of reading random blocks of a file big enough
+ * that most of it is reached through double indirect blocks. Each
+ * block of the file starts with its own block number, which the
+ * reads check.
+ */
+static
+void
+dorandread(const char *filesys)
+{
+	struct vnode *vn;
+	struct iovec iov;
+	struct uio ku;
+	char name[32];
+	const char *fs = filesys;
+	const char *namesuffix = "rand";
+	uint32_t *buf;
+	uint32_t nblocks, block, i, j;
+	time_t secs1, secs2, secs;
+	uint32_t nsecs1, nsecs2, nsecs;
+	uint64_t totalns;
+	int err;
+
+	kprintf("*** Starting fs random read test on %s:\n", filesys);
+
+	buf = kmalloc(TPUTMAXIO);
+	if (buf == NULL) {
+		kprintf("*** randread: Out of memory\n");
+		return;
+	}
+
+	MAKENAME();
+	err = vfs_open(name, O_RDWR|O_CREAT|O_TRUNC, 0664, &vn);
+	if (err) {
+		kprintf("Could not create test file: %s\n", strerror(err));
+		kfree(buf);
+		return;
+	}
+
+	/* Write it out in large pieces, stamping each block */
+	nblocks = RANDSIZE / RANDBLK;
+	for (block = 0; block < nblocks; block += TPUTMAXIO / RANDBLK) {
+		for (j=0; j < TPUTMAXIO / RANDBLK; j++) {
+			buf[j * RANDBLK / sizeof(uint32_t)] = block + j;
+		}
+		uio_kinit(&iov, &ku, buf, TPUTMAXIO,
+			  (off_t)block * RANDBLK, UIO_WRITE);
+		err = VOP_WRITE(vn, &ku);
+		if (err || ku.uio_resid > 0) {
+			kprintf("randread: Write error at block %u: %s\n",
+				block, err ? strerror(err) : "short write");
+			goto out;
+		}
+	}
+	err = VOP_FSYNC(vn);
+	if (err) {
+		kprintf("randread: fsync: %s\n", strerror(err));
+		goto out;
+	}
+	kprintf("randread: %lu byte file written\n",
+		(unsigned long)RANDSIZE);
+
+	gettime(&secs1, &nsecs1);
+	for (i=0; i<NRANDREADS; i++) {
+		block = random() % nblocks;
+		uio_kinit(&iov, &ku, buf, RANDBLK,
+			  (off_t)block * RANDBLK, UIO_READ);
+		err = VOP_READ(vn, &ku);
+		if (err || ku.uio_resid > 0) {
+			kprintf("randread: Read error at block %u: %s\n",
+				block, err ? strerror(err) : "short read");
+			goto out;
+		}
+		if (buf[0] != block) {
+			kprintf("randread: Block %u has stamp %u\n",
+				block, buf[0]);
+			goto out;
+		}
+	}
+	gettime(&secs2, &nsecs2);
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	totalns = (uint64_t)secs * 1000000000 + nsecs;
+	kprintf("randread: %d reads in %lu.%09lu seconds (%lu us/read)\n",
+		NRANDREADS, (unsigned long)secs, (unsigned long)nsecs,
+		(unsigned long)(totalns / NRANDREADS / 1000));
+
+ out:
+	vfs_close(vn);
+	fstest_remove(filesys, namesuffix);
+	kfree(buf);
+
+	kprintf("*** fs random read test done\n");
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Add up the words of file VN (MAPSIZE bytes) by reading it a page
+ * at a time, as a read() loop would.
+ */
+static
+int
+mapscan_read(struct vnode *vn, uint32_t *buf, uint32_t *sum)
+{
+	struct iovec iov;
+	struct uio ku;
+	off_t pos;
+	unsigned i;
+	int err;
+
+	*sum = 0;
+	for (pos = 0; pos < MAPSIZE; pos += PAGE_SIZE) {
+		uio_kinit(&iov, &ku, buf, PAGE_SIZE, pos, UIO_READ);
+		err = VOP_READ(vn, &ku);
+		if (err || ku.uio_resid > 0) {
+			kprintf("mapscan: Read error at %lu: %s\n",
+				(unsigned long)pos,
+				err ? strerror(err) : "short read");
+			return -1;
+		}
+		for (i=0; i<PAGE_SIZE / sizeof(uint32_t); i++) {
+			*sum += buf[i];
+		}
+	}
+	return 0;
+}
+
+/*
+ * Same, through a mapping of the file at BASE. Touching each page
+ * faults it in from the file the first time.
+ */
+static
+void
+mapscan_mapped(vaddr_t base, uint32_t *sum)
+{
+	const uint32_t *words = (const uint32_t *)base;
+	unsigned i;
+
+	*sum = 0;
+	for (i=0; i<MAPSIZE / sizeof(uint32_t); i++) {
+		*sum += words[i];
+	}
+}
+
+/*
+ * Compare scanning a file through read() with scanning a mapping of
+ * it. The file is much bigger than the buffer cache, so every read
+ * pass goes to the disk; the first mapped pass does too, faulting
+ * the pages in, and later ones find them already mapped.
+ *
+ * The mapping lives in a scratch address space that this thread
+ * takes on for the duration, and is read directly from the kernel.
+ * Before the scan, one page of the file is written back to itself
+ * from the (not yet faulted in) mapping, which must not deadlock on
+ * the file's own lock, and another is copied in outside the file
+ * system, which must read it in. Then a write to the file checks
+ * that the mapping sees it.
+ */
+static
+void
+domapscan(const char *filesys)
+{
+	struct vnode *vn;
+	struct iovec iov;
+	struct uio ku;
+	struct addrspace *as, *oldas;
+	char name[32];
+	const char *fs = filesys;
+	const char *namesuffix = "map";
+	uint32_t *buf;
+	uint32_t readsum, mapsum, word;
+	vaddr_t base;
+	time_t secs1, secs2;
+	uint32_t nsecs1, nsecs2;
+	off_t pos;
+	unsigned i;
+	int err;
+
+	kprintf("*** Starting fs mmap scan test on %s:\n", filesys);
+
+	buf = kmalloc(PAGE_SIZE);
+	if (buf == NULL) {
+		kprintf("*** mapscan: Out of memory\n");
+		return;
+	}
+
+	MAKENAME();
+	err = vfs_open(name, O_RDWR|O_CREAT|O_TRUNC, 0664, &vn);
+	if (err) {
+		kprintf("Could not create test file: %s\n", strerror(err));
+		kfree(buf);
+		return;
+	}
+
+	/* Each word holds its own index */
+	for (pos = 0; pos < MAPSIZE; pos += PAGE_SIZE) {
+		for (i=0; i<PAGE_SIZE / sizeof(uint32_t); i++) {
+			buf[i] = pos / sizeof(uint32_t) + i;
+		}
+		uio_kinit(&iov, &ku, buf, PAGE_SIZE, pos, UIO_WRITE);
+		err = VOP_WRITE(vn, &ku);
+		if (err || ku.uio_resid > 0) {
+			kprintf("mapscan: Write error at %lu: %s\n",
+				(unsigned long)pos,
+				err ? strerror(err) : "short write");
+			goto out;
+		}
+	}
+	err = VOP_FSYNC(vn);
+	if (err) {
+		kprintf("mapscan: fsync: %s\n", strerror(err));
+		goto out;
+	}
+
+	gettime(&secs1, &nsecs1);
+	err = mapscan_read(vn, buf, &readsum);
+	gettime(&secs2, &nsecs2);
+	if (err) {
+		goto out;
+	}
+	fstest_rate("read  4096 ", MAPSIZE, secs1, nsecs1, secs2, nsecs2);
+
+	as = as_create();
+	if (as == NULL) {
+		kprintf("mapscan: Out of memory\n");
+		goto out;
+	}
+	oldas = curproc_setas(as);
+	as_activate();
+
+	err = as_map(as, MAPSIZE, vn, 0, &base);
+	if (err) {
+		kprintf("mapscan: as_map: %s\n", strerror(err));
+		goto unmapped;
+	}
+
+	/* Same bytes, so the sums don't change */
+	iov.iov_ubase = (userptr_t)(base + PAGE_SIZE);
+	iov.iov_len = PAGE_SIZE;
+	ku.uio_iov = &iov;
+	ku.uio_iovcnt = 1;
+	ku.uio_offset = PAGE_SIZE;
+	ku.uio_resid = PAGE_SIZE;
+	ku.uio_segflg = UIO_USERSPACE;
+	ku.uio_rw = UIO_WRITE;
+	ku.uio_space = as;
+	err = VOP_WRITE(vn, &ku);
+	if (err || ku.uio_resid > 0) {
+		kprintf("mapscan: Write from mapping: %s\n",
+			err ? strerror(err) : "short write");
+		goto unmap;
+	}
+
+	/* As a read() to the console would, with no file locked */
+	err = copyin((const_userptr_t)(base + 2*PAGE_SIZE), buf, PAGE_SIZE);
+	if (err) {
+		kprintf("mapscan: copyin from mapping: %s\n", strerror(err));
+		goto unmap;
+	}
+	if (buf[0] != 2*PAGE_SIZE / sizeof(uint32_t)) {
+		kprintf("mapscan: copyin from mapping got %u\n", buf[0]);
+		goto unmap;
+	}
+
+	gettime(&secs1, &nsecs1);
+	mapscan_mapped(base, &mapsum);
+	gettime(&secs2, &nsecs2);
+	fstest_rate("mmap first ", MAPSIZE, secs1, nsecs1, secs2, nsecs2);
+	if (mapsum != readsum) {
+		kprintf("mapscan: Mapped sum %u, read sum %u\n",
+			mapsum, readsum);
+		goto unmap;
+	}
+
+	gettime(&secs1, &nsecs1);
+	mapscan_mapped(base, &mapsum);
+	gettime(&secs2, &nsecs2);
+	fstest_rate("mmap again ", MAPSIZE, secs1, nsecs1, secs2, nsecs2);
+
+	/* Writes must show through */
+	word = 0xdeadbeef;
+	pos = MAPSIZE / 2 + sizeof(uint32_t);
+	uio_kinit(&iov, &ku, &word, sizeof(word), pos, UIO_WRITE);
+	err = VOP_WRITE(vn, &ku);
+	if (err) {
+		kprintf("mapscan: Write error: %s\n", strerror(err));
+		goto unmap;
+	}
+	if (((const uint32_t *)base)[pos / sizeof(uint32_t)] != word) {
+		kprintf("mapscan: Mapping doesn't see a write\n");
+	}
+
+ unmap:
+	err = as_unmap(as, base, MAPSIZE);
+	if (err) {
+		kprintf("mapscan: as_unmap: %s\n", strerror(err));
+	}
+ unmapped:
+	curproc_setas(oldas);
+	as_activate();
+	as_destroy(as);
+
+ out:
+	vfs_close(vn);
+	fstest_remove(filesys, namesuffix);
+	kfree(buf);
+
+	kprintf("*** fs mmap scan test done\n");
+}
+
+////////////////////////////////////////////////////////////
+
 static
 int
 checkfilesystem(int nargs, char **args)
@@ -544,7 +1107,7 @@ checkfilesystem(int nargs, char **args)
 	char *device;
 
 	if (nargs != 2) {
-		kprintf("Usage: fs[12345] filesystem:\n");
+		kprintf("Usage: fs[123456789] filesystem:\n");
 		return EINVAL;
 	}
 
@@ -576,6 +1139,10 @@ DEFTEST(readstress);
 DEFTEST(writestress);
 DEFTEST(writestress2);
 DEFTEST(createstress);
+DEFTEST(openstress);
+DEFTEST(throughput);
+DEFTEST(randread);
+DEFTEST(mapscan);
 
 ////////////////////////////////////////////////////////////
 
@@ -68,6 +68,11 @@ cleanitems(void)
 	lock_destroy(testlock);
 	cv_destroy(testcv);
 	sem_destroy(donesem);
+	/* so inititems recreates them and the tests can be run again */
+	testsem = NULL;
+	testlock = NULL;
+	testcv = NULL;
+	donesem = NULL;
 	}
 #endif
 
@@ -105,6 +110,29 @@ inititems(void)
 	}
 }
 
+/*
+ * Report how long a timed test took, overall and per operation, so
+ * sy2 and sy3 double as benchmarks for the lock and CV paths.
+ */
+static
+void
+report_time(const char *what, unsigned long nops,
+	    time_t secs1, uint32_t nsecs1)
+{
+	time_t secs2, secs;
+	uint32_t nsecs2, nsecs;
+	uint64_t totalns;
+
+	gettime(&secs2, &nsecs2);
+	getinterval(secs1, nsecs1, secs2, nsecs2, &secs, &nsecs);
+	totalns = (uint64_t)secs * 1000000000 + nsecs;
+
+	kprintf("%s: %lu operations in %lu.%09lu seconds "
+		"(%lu ns/operation)\n", what, nops,
+		(unsigned long)secs, (unsigned long)nsecs,
+		(unsigned long)(totalns / nops));
+}
+
 static
 void
 semtestthread(void *junk, unsigned long num)
@@ -229,12 +257,15 @@ int
 locktest(int nargs, char **args)
 {
 	int i, result;
+	time_t secs;
+	uint32_t nsecs;
 
 	(void)nargs;
 	(void)args;
 
 	inititems();
 	kprintf("Starting lock test...\n");
+	gettime(&secs, &nsecs);
 
 	for (i=0; i<NTHREADS; i++) {
 		result = thread_fork("synchtest", NULL, locktestthread,
@@ -247,6 +278,7 @@ locktest(int nargs, char **args)
 	for (i=0; i<NTHREADS; i++) {
 		P(donesem);
 	}
+	report_time("Lock test", NTHREADS * NLOCKLOOPS, secs, nsecs);
 
 #ifdef UW
   cleanitems();
@@ -315,6 +347,8 @@ cvtest(int nargs, char **args)
 {
 
 	int i, result;
+	time_t secs;
+	uint32_t nsecs;
 
 	(void)nargs;
 	(void)args;
@@ -328,6 +362,7 @@ cvtest(int nargs, char **args)
 #endif
 
 	testval1 = NTHREADS-1;
+	gettime(&secs, &nsecs);
 
 	for (i=0; i<NTHREADS; i++) {
 		result = thread_fork("synchtest", NULL, cvtestthread, NULL, i);
@@ -339,6 +374,7 @@ cvtest(int nargs, char **args)
 	for (i=0; i<NTHREADS; i++) {
 		P(donesem);
 	}
+	report_time("CV test", NTHREADS * NCVLOOPS, secs, nsecs);
 
 #ifdef UW
   cleanitems();
@@ -35,6 +35,8 @@
 #include <thread.h>
 #include <lamebus/ltimer.h>
 #include <current.h>
+#include <vfs.h>
+#include <workqueue.h>
 
 /*
  * Time handling.
@@ -73,6 +75,25 @@ static struct wchan *minibolt;
  */
 static int minicount;
 
+/*
+ * Every SYNCER_SECONDS, write back dirty file system state from a
+ * worker thread, so data doesn't sit in memory until somebody
+ * happens to call sync.
+ */
+#define SYNCER_SECONDS	30
+static int synccount;
+static struct work syncwork;
+
+static
+void
+syncer(void *unused1, unsigned long unused2)
+{
+	(void)unused1;
+	(void)unused2;
+
+	vfs_sync();
+}
+
 /*
  * Setup.
  */
@@ -90,6 +111,8 @@ hardclock_bootstrap(void)
 	minicount = MINI_PER_SECOND;
 	/* we assume MINI_PER_SECOND > 0 */
 	KASSERT(minicount > 0);
+	synccount = SYNCER_SECONDS;
+	work_init(&syncwork, syncer, NULL, 0);
 }
 
 /*
@@ -105,6 +128,11 @@ timerclock(void)
 	if (--minicount <= 0) {
 	  minicount = MINI_PER_SECOND;
 	  wchan_wakeall(lbolt);
+	  /* Kick the syncer; if one is still pending, skip this round */
+	  if (--synccount <= 0) {
+	    synccount = SYNCER_SECONDS;
+	    workqueue_queue(&syncwork);
+	  }
 	}
 }
 
@@ -64,14 +64,16 @@ sem_create(const char *name, int initial_count)
                 return NULL;
         }
 
-	sem->sem_wchan = wchan_create(sem->sem_name);
+	spinlock_init(&sem->sem_lock);
+	sem->sem_wchan = wchan_create_interlocked(sem->sem_name,
+						  &sem->sem_lock);
 	if (sem->sem_wchan == NULL) {
+		spinlock_cleanup(&sem->sem_lock);
 		kfree(sem->sem_name);
 		kfree(sem);
 		return NULL;
 	}
 
-	spinlock_init(&sem->sem_lock);
         sem->sem_count = initial_count;
 
         return sem;
@@ -83,8 +85,8 @@ sem_destroy(struct semaphore *sem)
         KASSERT(sem != NULL);
 
 	/* wchan_cleanup will assert if anyone's waiting on it */
-	spinlock_cleanup(&sem->sem_lock);
 	wchan_destroy(sem->sem_wchan);
+	spinlock_cleanup(&sem->sem_lock);
         kfree(sem->sem_name);
         kfree(sem);
 }
@@ -105,10 +107,11 @@ P(struct semaphore *sem)
 	spinlock_acquire(&sem->sem_lock);
         while (sem->sem_count == 0) {
 		/*
-		 * Bridge to the wchan lock, so if someone else comes
-		 * along in V right this instant the wakeup can't go
-		 * through on the wchan until we've finished going to
-		 * sleep. Note that wchan_sleep unlocks the wchan.
+		 * The wchan is interlocked with sem_lock, so holding
+		 * it into wchan_sleep means a V coming along right
+		 * this instant can't post its wakeup until we've
+		 * finished going to sleep. Note that wchan_sleep
+		 * unlocks it.
 		 *
 		 * Note that we don't maintain strict FIFO ordering of
 		 * threads going through the semaphore; that is, we
@@ -120,8 +123,6 @@ P(struct semaphore *sem)
 		 * Exercise: how would you implement strict FIFO
 		 * ordering?
 		 */
-            wchan_lock(sem->sem_wchan);
-            spinlock_release(&sem->sem_lock);
             wchan_sleep(sem->sem_wchan);
 
             spinlock_acquire(&sem->sem_lock);
@@ -140,6 +141,7 @@ V(struct semaphore *sem)
 
         sem->sem_count++;
         KASSERT(sem->sem_count > 0);
+	/* sem_lock is the wchan interlock; free if nobody's waiting */
 	wchan_wakeone(sem->sem_wchan);
 
 	spinlock_release(&sem->sem_lock);
@@ -168,14 +170,15 @@ lock_create(const char *name)
                 return NULL;
         }
         
-        lock->wchan = wchan_create(lock->lk_name);
+        spinlock_init(&lock->spl);
+        lock->wchan = wchan_create_interlocked(lock->lk_name, &lock->spl);
         if (lock->wchan == NULL){
+            spinlock_cleanup(&lock->spl);
             kfree(lock->lk_name);
             kfree(lock);
             return NULL;
         }
         
-        spinlock_init(&lock->spl);
         return lock;
 }
 
@@ -184,8 +187,8 @@ lock_destroy(struct lock *lock)
 {
         KASSERT(lock != NULL);
         
-        spinlock_cleanup(&lock->spl);
         wchan_destroy(lock->wchan);
+        spinlock_cleanup(&lock->spl);
         
         kfree(lock->lk_name);
         kfree(lock);
@@ -198,9 +201,7 @@ lock_acquire(struct lock *lock)
        
        spinlock_acquire(&lock->spl);
        while (lock->held){
-           wchan_lock(lock->wchan);
-           
-           spinlock_release(&lock->spl);
+           /* lock->spl is the wchan interlock; wchan_sleep drops it */
            wchan_sleep(lock->wchan);
            spinlock_acquire(&lock->spl);
        }
@@ -223,7 +224,10 @@ lock_release(struct lock *lock)
         lock->held = false;
         lock->current_thread = NULL;
         
-        wchan_wakeone(lock->wchan);
+        /* Fast path: no sleepers means no wakeup work at all. */
+        if (wchan_nwaiters(lock->wchan) > 0) {
+            wchan_wakeone(lock->wchan);
+        }
         spinlock_release(&(lock->spl));
 }
 
@@ -258,8 +262,10 @@ cv_create(const char *name)
                 return NULL;
         }
         
-        cv->wchan = wchan_create(cv->cv_name);
+        spinlock_init(&cv->cv_lock);
+        cv->wchan = wchan_create_interlocked(cv->cv_name, &cv->cv_lock);
         if (cv->wchan==NULL){
+            spinlock_cleanup(&cv->cv_lock);
             kfree(cv->cv_name);
             kfree(cv);
             return NULL;
@@ -276,6 +282,7 @@ cv_destroy(struct cv *cv)
         // add stuff here as needed
         kfree(cv->cv_name);
         wchan_destroy(cv->wchan);
+        spinlock_cleanup(&cv->cv_lock);
         kfree(cv);
 }
 
@@ -285,7 +292,11 @@ cv_wait(struct cv *cv, struct lock *lock)
     KASSERT( cv != NULL);
     KASSERT( lock != NULL);
     
-    wchan_lock(cv->wchan);
+    /*
+     * Take the interlock before dropping LOCK so a signal sent in
+     * between can't find the channel empty.
+     */
+    spinlock_acquire(&cv->cv_lock);
     lock_release(lock);
     wchan_sleep(cv->wchan);
     lock_acquire(lock);
@@ -298,7 +309,9 @@ cv_signal(struct cv *cv, struct lock *lock)
     
     KASSERT(cv != NULL);
     KASSERT(lock_do_i_hold(lock));
+    spinlock_acquire(&cv->cv_lock);
     wchan_wakeone(cv->wchan);
+    spinlock_release(&cv->cv_lock);
 }
 
 void
@@ -308,5 +321,7 @@ cv_broadcast(struct cv *cv, struct lock *lock)
     
     KASSERT(cv != NULL);
     KASSERT(lock_do_i_hold(lock));
+    spinlock_acquire(&cv->cv_lock);
     wchan_wakeall(cv->wchan);
+    spinlock_release(&cv->cv_lock);
 }
@@ -50,6 +50,7 @@
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <workqueue.h>
 
 #include "opt-synchprobs.h"
 
@@ -57,13 +58,20 @@
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
+/* Max number of dead threads each cpu keeps around for reuse. */
+#define THREAD_CACHE_MAX 16
+
 /* Wait channel. */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
 	struct threadlist wc_threads;	/* list of waiting threads */
 	struct spinlock wc_lock;	/* lock for mutual exclusion */
+	struct spinlock *wc_lockp;	/* &wc_lock, or caller's interlock */
 };
 
+/* True if the channel borrows its owner's spinlock. */
+#define WCHAN_INTERLOCKED(wc) ((wc)->wc_lockp != &(wc)->wc_lock)
+
 /* Master array of CPUs. */
 DECLARRAY(cpu);
 DEFARRAY(cpu, /*no inline*/ );
@@ -72,6 +80,14 @@ static struct cpuarray allcpus;
 /* Used to wait for secondary CPUs to come online. */
 static struct semaphore *cpu_startup_sem;
 
+/*
+ * Dead threads that didn't fit in a thread cache, waiting for a
+ * worker to destroy them off the context switch path.
+ */
+static struct threadlist reaplist;
+static struct spinlock reaplist_lock;
+static struct work reapwork;
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -111,6 +127,35 @@ thread_checkstack(struct thread *thread)
 	}
 }
 
+/*
+ * Initialize the fields of a new (or recycled) thread, other than
+ * the name and the stack.
+ */
+static
+void
+thread_initfields(struct thread *thread)
+{
+	thread->t_wchan_name = "NEW";
+	thread->t_state = S_READY;
+
+	/* Thread subsystem fields */
+	thread_machdep_init(&thread->t_machdep);
+	threadlistnode_init(&thread->t_listnode, thread);
+	thread->t_context = NULL;
+	thread->t_cpu = NULL;
+	thread->t_proc = NULL;
+
+	/* Interrupt state fields */
+	thread->t_in_interrupt = false;
+	thread->t_curspl = IPL_HIGH;
+	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
+
+	/* Public fields */
+	thread->t_nomapfill = 0;
+
+	/* If you add to struct thread, be sure to initialize here */
+}
+
 /*
  * Create a thread. This is used both to create a first thread
  * for each CPU and to create subsequent forked threads.
@@ -133,23 +178,8 @@ thread_create(const char *name)
 		kfree(thread);
 		return NULL;
 	}
-	thread->t_wchan_name = "NEW";
-	thread->t_state = S_READY;
-
-	/* Thread subsystem fields */
-	thread_machdep_init(&thread->t_machdep);
-	threadlistnode_init(&thread->t_listnode, thread);
 	thread->t_stack = NULL;
-	thread->t_context = NULL;
-	thread->t_cpu = NULL;
-	thread->t_proc = NULL;
-
-	/* Interrupt state fields */
-	thread->t_in_interrupt = false;
-	thread->t_curspl = IPL_HIGH;
-	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
-
-	/* If you add to struct thread, be sure to initialize here */
+	thread_initfields(thread);
 
 	return thread;
 }
@@ -181,6 +211,10 @@ cpu_create(unsigned hardware_number)
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
 
+	threadlist_init(&c->c_threadcache);
+	c->c_threadcache_hits = 0;
+	c->c_threadcache_misses = 0;
+
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
 	spinlock_init(&c->c_runqueue_lock);
@@ -227,6 +261,15 @@ cpu_create(unsigned hardware_number)
 	return c;
 }
 
+/*
+ * Return the number of cpus.
+ */
+unsigned
+cpu_count(void)
+{
+	return cpuarray_num(&allcpus);
+}
+
 /*
  * Destroy a thread.
  *
@@ -262,9 +305,137 @@ thread_destroy(struct thread *thread)
 	kfree(thread);
 }
 
+/*
+ * Destroy the threads on the reap list. Normally run by a worker
+ * thread via reapwork.
+ */
+static
+void
+thread_reap(void *unused1, unsigned long unused2)
+{
+	struct thread *z;
+
+	(void)unused1;
+	(void)unused2;
+
+	while (1) {
+		spinlock_acquire(&reaplist_lock);
+		z = threadlist_remhead(&reaplist);
+		spinlock_release(&reaplist_lock);
+		if (z == NULL) {
+			break;
+		}
+		thread_destroy(z);
+	}
+}
+
+/*
+ * Put a dead thread in this cpu's thread cache so thread_fork can
+ * reuse it, stack and all, instead of going back to kmalloc for a
+ * fresh struct thread and STACK_SIZE of contiguous memory. If the
+ * cache is full, or the thread has no stack we own, queue it to be
+ * destroyed.
+ *
+ * Must be called at splhigh.
+ */
+static
+void
+thread_recycle(struct thread *thread)
+{
+	KASSERT(curthread->t_curspl > 0);
+	KASSERT(thread->t_proc == NULL);
+
+	if (thread->t_stack == NULL ||
+	    curcpu->c_threadcache.tl_count >= THREAD_CACHE_MAX) {
+		/*
+		 * Hand it to a worker to free. If the work queues
+		 * aren't running yet, do it ourselves.
+		 */
+		spinlock_acquire(&reaplist_lock);
+		threadlist_addtail(&reaplist, thread);
+		spinlock_release(&reaplist_lock);
+		if (!workqueue_queue(&reapwork) && !reapwork.w_pending) {
+			thread_reap(NULL, 0);
+		}
+		return;
+	}
+
+	/*
+	 * The stack guard words from thread_checkstack_init are still
+	 * in place unless the thread overflowed, which this catches.
+	 */
+	thread_checkstack(thread);
+
+	kfree(thread->t_name);
+	thread->t_name = NULL;
+	thread->t_wchan_name = "CACHED";
+
+	/* LIFO, so the most recently used stack is reused first. */
+	threadlist_addhead(&curcpu->c_threadcache, thread);
+}
+
+/*
+ * Take a thread from this cpu's cache, if there is one, and give it
+ * name NAME. The result has its stack attached and guarded, and is
+ * otherwise initialized as by thread_create. Returns NULL on a miss
+ * (or if out of memory for the name).
+ */
+static
+struct thread *
+thread_cache_get(const char *name)
+{
+	struct thread *thread;
+	int spl;
+
+	/* Interrupts off so a context switch can't exorcise into the list. */
+	spl = splhigh();
+	thread = threadlist_remhead(&curcpu->c_threadcache);
+	if (thread != NULL) {
+		curcpu->c_threadcache_hits++;
+	}
+	else {
+		curcpu->c_threadcache_misses++;
+	}
+	splx(spl);
+
+	if (thread == NULL) {
+		return NULL;
+	}
+
+	thread->t_name = kstrdup(name);
+	if (thread->t_name == NULL) {
+		thread_destroy(thread);
+		return NULL;
+	}
+	thread_machdep_cleanup(&thread->t_machdep);
+	threadlistnode_cleanup(&thread->t_listnode);
+	thread_initfields(thread);
+	return thread;
+}
+
+/*
+ * Print thread cache statistics for each cpu.
+ */
+void
+thread_cache_printstats(void)
+{
+	unsigned i, total;
+	struct cpu *c;
+
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		total = c->c_threadcache_hits + c->c_threadcache_misses;
+		kprintf("cpu%u: thread cache: %u cached, %u hits, "
+			"%u misses (%u%% hit rate)\n",
+			c->c_number, c->c_threadcache.tl_count,
+			c->c_threadcache_hits, c->c_threadcache_misses,
+			total == 0 ? 0 : c->c_threadcache_hits * 100 / total);
+	}
+}
+
 /*
  * Clean up zombies. (Zombies are threads that have exited but still
- * need to have thread_destroy called on them.)
+ * need to be recycled or have thread_destroy called on them.)
  *
  * The list of zombies is per-cpu.
  */
@@ -277,7 +448,7 @@ exorcise(void)
 	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
 		KASSERT(z != curthread);
 		KASSERT(z->t_state == S_ZOMBIE);
-		thread_destroy(z);
+		thread_recycle(z);
 	}
 }
 
@@ -351,6 +522,10 @@ thread_bootstrap(void)
 
 	cpuarray_init(&allcpus);
 
+	threadlist_init(&reaplist);
+	spinlock_init(&reaplist_lock);
+	work_init(&reapwork, thread_reap, NULL, 0);
+
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
 	 * currently running on. Assume the hardware number is 0; that
@@ -487,18 +662,22 @@ thread_fork(const char *name,
 	DEBUG(DB_THREADS,"Forking thread: %s\n",name);
 #endif // UW
 
-	newthread = thread_create(name);
+	/* Reuse a dead thread and its stack if this cpu has one. */
+	newthread = thread_cache_get(name);
 	if (newthread == NULL) {
-		return ENOMEM;
-	}
+		newthread = thread_create(name);
+		if (newthread == NULL) {
+			return ENOMEM;
+		}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		/* Allocate a stack */
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
+		thread_checkstack_init(newthread);
 	}
-	thread_checkstack_init(newthread);
 
 	/*
 	 * Now we clone various fields from the parent thread.
@@ -981,11 +1160,30 @@ wchan_create(const char *name)
 		return NULL;
 	}
 	spinlock_init(&wc->wc_lock);
+	wc->wc_lockp = &wc->wc_lock;
 	threadlist_init(&wc->wc_threads);
 	wc->wc_name = name;
 	return wc;
 }
 
+/*
+ * Create a wait channel protected by the caller's spinlock LK.
+ */
+struct wchan *
+wchan_create_interlocked(const char *name, struct spinlock *lk)
+{
+	struct wchan *wc;
+
+	KASSERT(lk != NULL);
+
+	wc = wchan_create(name);
+	if (wc == NULL) {
+		return NULL;
+	}
+	wc->wc_lockp = lk;
+	return wc;
+}
+
 /*
  * Destroy a wait channel. Must be empty and unlocked.
  * (The corresponding cleanup functions require this.)
@@ -1004,13 +1202,30 @@ wchan_destroy(struct wchan *wc)
 void
 wchan_lock(struct wchan *wc)
 {
-	spinlock_acquire(&wc->wc_lock);
+	spinlock_acquire(wc->wc_lockp);
 }
 
 void
 wchan_unlock(struct wchan *wc)
 {
-	spinlock_release(&wc->wc_lock);
+	spinlock_release(wc->wc_lockp);
+}
+
+/*
+ * Get the channel locked for a wakeup. Interlocked channels come to
+ * us already locked by the caller; others we lock here. Returns true
+ * if we took the lock and so have to drop it again.
+ */
+static
+bool
+wchan_wakelock(struct wchan *wc)
+{
+	if (WCHAN_INTERLOCKED(wc)) {
+		KASSERT(spinlock_do_i_hold(wc->wc_lockp));
+		return false;
+	}
+	spinlock_acquire(&wc->wc_lock);
+	return true;
 }
 
 /*
@@ -1035,15 +1250,22 @@ void
 wchan_wakeone(struct wchan *wc)
 {
 	struct thread *target;
+	bool unlock;
 
-	/* Lock the channel and grab a thread from it */
-	spinlock_acquire(&wc->wc_lock);
+	/*
+	 * Lock the channel and grab a thread from it. (For an
+	 * interlocked channel the caller already holds the lock, so if
+	 * nobody is waiting this costs no locking at all.)
+	 */
+	unlock = wchan_wakelock(wc);
 	target = threadlist_remhead(&wc->wc_threads);
 	/*
 	 * Nobody else can wake up this thread now, so we don't need
 	 * to hang onto the lock.
 	 */
-	spinlock_release(&wc->wc_lock);
+	if (unlock) {
+		spinlock_release(&wc->wc_lock);
+	}
 
 	if (target == NULL) {
 		/* Nobody was sleeping. */
@@ -1061,6 +1283,7 @@ wchan_wakeall(struct wchan *wc)
 {
 	struct thread *target;
 	struct threadlist list;
+	bool unlock;
 
 	threadlist_init(&list);
 
@@ -1068,7 +1291,7 @@ wchan_wakeall(struct wchan *wc)
 	 * Lock the channel and grab all the threads, moving them to a
 	 * private list.
 	 */
-	spinlock_acquire(&wc->wc_lock);
+	unlock = wchan_wakelock(wc);
 	while ((target = threadlist_remhead(&wc->wc_threads)) != NULL) {
 		threadlist_addtail(&list, target);
 	}
@@ -1076,7 +1299,9 @@ wchan_wakeall(struct wchan *wc)
 	 * Nobody else can wake up these threads now, so we don't need
 	 * to hang onto the lock.
 	 */
-	spinlock_release(&wc->wc_lock);
+	if (unlock) {
+		spinlock_release(&wc->wc_lock);
+	}
 
 	/*
 	 * We could conceivably sort by cpu first to cause fewer lock
@@ -1097,15 +1322,29 @@ wchan_wakeall(struct wchan *wc)
 bool
 wchan_isempty(struct wchan *wc)
 {
-	bool ret;
+	bool ret, unlock;
 
-	spinlock_acquire(&wc->wc_lock);
+	unlock = wchan_wakelock(wc);
 	ret = threadlist_isempty(&wc->wc_threads);
-	spinlock_release(&wc->wc_lock);
+	if (unlock) {
+		spinlock_release(&wc->wc_lock);
+	}
 
 	return ret;
 }
 
+/*
+ * Return the number of threads sleeping on the channel.
+ */
+unsigned
+wchan_nwaiters(struct wchan *wc)
+{
+	if (WCHAN_INTERLOCKED(wc)) {
+		KASSERT(spinlock_do_i_hold(wc->wc_lockp));
+	}
+	return wc->wc_threads.tl_count;
+}
+
 ////////////////////////////////////////////////////////////
 
 /*
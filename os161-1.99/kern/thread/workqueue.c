@@ -0,0 +1,199 @@
+/*
+ * Kernel work queues. See workqueue.h for the interface.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <current.h>
+#include <workqueue.h>
+
+struct workqueue {
+	struct spinlock wq_lock;	/* protects the list */
+	struct wchan *wq_wchan;		/* worker sleeps here; interlocked */
+	struct work *wq_head;		/* next item to run */
+	struct work *wq_tail;		/* last item queued */
+};
+
+/* One queue per cpu, indexed by cpu number. */
+static struct workqueue *workqueues;
+static unsigned nworkqueues;
+
+/*
+ * Worker thread: run items from queue WQ forever.
+ */
+static
+void
+workqueue_worker(void *data1, unsigned long data2)
+{
+	struct workqueue *wq = data1;
+	struct work *w;
+	void (*func)(void *, unsigned long);
+	void *wdata1;
+	unsigned long wdata2;
+	bool allocated;
+
+	(void)data2;
+
+	spinlock_acquire(&wq->wq_lock);
+	while (1) {
+		while (wq->wq_head == NULL) {
+			/* wq_lock is the interlock; this drops it */
+			wchan_sleep(wq->wq_wchan);
+			spinlock_acquire(&wq->wq_lock);
+		}
+
+		w = wq->wq_head;
+		wq->wq_head = w->w_next;
+		if (wq->wq_head == NULL) {
+			wq->wq_tail = NULL;
+		}
+		w->w_next = NULL;
+		w->w_pending = false;
+
+		/*
+		 * Once it's off the queue a caller-owned item may be
+		 * queued again (or reused) by somebody else, so take
+		 * what we need out of it before unlocking.
+		 */
+		func = w->w_func;
+		wdata1 = w->w_data1;
+		wdata2 = w->w_data2;
+		allocated = w->w_allocated;
+		spinlock_release(&wq->wq_lock);
+
+		func(wdata1, wdata2);
+		if (allocated) {
+			kfree(w);
+		}
+
+		spinlock_acquire(&wq->wq_lock);
+	}
+}
+
+/*
+ * Create a queue and start a worker for each cpu.
+ */
+void
+workqueue_bootstrap(void)
+{
+	struct workqueue *wq;
+	unsigned i, n;
+	char name[16];
+	int result;
+
+	n = cpu_count();
+	wq = kmalloc(n * sizeof(*wq));
+	if (wq == NULL) {
+		panic("workqueue_bootstrap: Out of memory\n");
+	}
+
+	for (i=0; i<n; i++) {
+		spinlock_init(&wq[i].wq_lock);
+		wq[i].wq_wchan = wchan_create_interlocked("workqueue",
+							  &wq[i].wq_lock);
+		if (wq[i].wq_wchan == NULL) {
+			panic("workqueue_bootstrap: wchan_create failed\n");
+		}
+		wq[i].wq_head = wq[i].wq_tail = NULL;
+	}
+
+	/* Publish before starting workers or letting anyone submit. */
+	workqueues = wq;
+	nworkqueues = n;
+
+	for (i=0; i<n; i++) {
+		snprintf(name, sizeof(name), "worker/%u", i);
+		result = thread_fork(name, NULL, workqueue_worker, &wq[i], 0);
+		if (result) {
+			panic("workqueue_bootstrap: thread_fork: %s\n",
+			      strerror(result));
+		}
+	}
+}
+
+void
+work_init(struct work *w, void (*func)(void *, unsigned long),
+	  void *data1, unsigned long data2)
+{
+	w->w_func = func;
+	w->w_data1 = data1;
+	w->w_data2 = data2;
+	w->w_next = NULL;
+	w->w_pending = false;
+	w->w_allocated = false;
+}
+
+/*
+ * Add W to queue WQ, unless it's already pending.
+ */
+static
+bool
+workqueue_add(struct workqueue *wq, struct work *w)
+{
+	spinlock_acquire(&wq->wq_lock);
+	if (w->w_pending) {
+		spinlock_release(&wq->wq_lock);
+		return false;
+	}
+	w->w_pending = true;
+	w->w_next = NULL;
+	if (wq->wq_tail == NULL) {
+		wq->wq_head = w;
+	}
+	else {
+		wq->wq_tail->w_next = w;
+	}
+	wq->wq_tail = w;
+	wchan_wakeone(wq->wq_wchan);
+	spinlock_release(&wq->wq_lock);
+
+	return true;
+}
+
+bool
+workqueue_queue(struct work *w)
+{
+	unsigned index;
+
+	if (nworkqueues == 0) {
+		/* Too early in boot; caller does it itself. */
+		return false;
+	}
+
+	/*
+	 * A caller-owned item may be queued from any cpu, and
+	 * w_pending is only meaningful under the lock of the queue it
+	 * is on. So always send a given item to the same queue,
+	 * picked by its address.
+	 */
+	index = ((uintptr_t)w / sizeof(struct work)) % nworkqueues;
+	return workqueue_add(&workqueues[index], w);
+}
+
+int
+workqueue_submit(void (*func)(void *, unsigned long),
+		 void *data1, unsigned long data2)
+{
+	struct work *w;
+
+	if (nworkqueues == 0) {
+		return ENXIO;
+	}
+
+	w = kmalloc(sizeof(*w));
+	if (w == NULL) {
+		return ENOMEM;
+	}
+	work_init(w, func, data1, data2);
+	w->w_allocated = true;
+
+	/* Nobody else can see this item, so use this cpu's queue. */
+	KASSERT(curcpu->c_number < nworkqueues);
+	workqueue_add(&workqueues[curcpu->c_number], w);
+	return 0;
+}
@@ -241,15 +241,18 @@ null_fsync(struct vnode *v)
 }
 
 /*
- * For mmap. If you want this to do anything, you have to write it
- * yourself. Some devices may not make sense to map. Others do.
+ * For mmap. No device can be mapped yet. (A framebuffer, say, could
+ * be.)
  */
 static
 int
-dev_mmap(struct vnode *v  /* add stuff as needed */)
+dev_mmap(struct vnode *v, off_t offset, bool fill, paddr_t *ret)
 {
 	(void)v;
-	return EUNIMP;
+	(void)offset;
+	(void)fill;
+	(void)ret;
+	return ENODEV;
 }
 
 /*
@@ -441,6 +444,33 @@ static const struct vnode_ops dev_vnode_ops = {
 	dev_lookparent,
 };
 
+/*
+ * Start asynchronous transfer AIO on device D. For devices without
+ * d_aio, do the transfer right away with d_io and report completion
+ * before returning. Returns an error (and da_done is not called) if
+ * the transfer couldn't be started at all.
+ */
+int
+dev_aio(struct device *d, struct device_aio *aio)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	if (d->d_aio != NULL) {
+		return d->d_aio(d, aio);
+	}
+
+	uio_kinit(&iov, &ku, aio->da_buf, aio->da_len, aio->da_offset,
+		  aio->da_write ? UIO_WRITE : UIO_READ);
+	result = d->d_io(d, &ku);
+	if (result == 0 && ku.uio_resid > 0) {
+		result = EIO;
+	}
+	aio->da_done(aio, result);
+	return 0;
+}
+
 /*
  * Function to create a vnode for a VFS device.
  */
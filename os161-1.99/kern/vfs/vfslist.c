@@ -60,6 +60,10 @@
  * kd_fs      - Filesystem object mounted on, or associated with, this
  *              device. NULL if there is no filesystem. 
  *
+ * kd_claimed - True if the device has been taken over by another
+ *              device built on top of it (see vfs_claimdev), and so
+ *              can't be mounted.
+ *
  * A filesystem can be associated with a device without having been
  * mounted if the device was created that way. In this case,
  * kd_rawname is NULL (prohibiting mount/unmount), and, as there is
@@ -80,6 +84,7 @@ struct knowndev {
 	struct device *kd_device;
 	struct vnode *kd_vnode;
 	struct fs *kd_fs;
+	bool kd_claimed;
 };
 
 DECLARRAY(knowndev);
@@ -109,6 +114,8 @@ vfs_bootstrap(void)
 	}
 	vfs_biglock_depth = 0;
 
+	vfs_namecache_bootstrap();
+
 	devnull_create();
 }
 
@@ -406,6 +413,7 @@ vfs_doadd(const char *dname, int mountable, struct device *dev, struct fs *fs)
 	kd->kd_device = dev;
 	kd->kd_vnode = vnode;
 	kd->kd_fs = fs;
+	kd->kd_claimed = false;
 
 	if (fs!=NULL) {
 		volname = FSOP_GETVOLNAME(fs);
@@ -522,7 +530,7 @@ vfs_mount(const char *devname, void *data,
 		return result;
 	}
 
-	if (kd->kd_fs != NULL) {
+	if (kd->kd_fs != NULL || kd->kd_claimed) {
 		vfs_biglock_release();
 		return EBUSY;
 	}
@@ -547,6 +555,57 @@ vfs_mount(const char *devname, void *data,
 	return 0;
 }
 
+/*
+ * Take over the mountable device DEVNAME, which must not be mounted or
+ * already claimed, for use underneath another device, and return it.
+ * It can't be mounted until released with vfs_unclaimdev.
+ */
+int
+vfs_claimdev(const char *devname, struct device **ret)
+{
+	struct knowndev *kd;
+	int result;
+
+	vfs_biglock_acquire();
+
+	result = findmount(devname, &kd);
+	if (result) {
+		vfs_biglock_release();
+		return result;
+	}
+
+	if (kd->kd_fs != NULL || kd->kd_claimed) {
+		vfs_biglock_release();
+		return EBUSY;
+	}
+	KASSERT(kd->kd_device != NULL);
+
+	kd->kd_claimed = true;
+	*ret = kd->kd_device;
+
+	vfs_biglock_release();
+	return 0;
+}
+
+/*
+ * Give back a device taken with vfs_claimdev.
+ */
+void
+vfs_unclaimdev(const char *devname)
+{
+	struct knowndev *kd;
+	int result;
+
+	vfs_biglock_acquire();
+
+	result = findmount(devname, &kd);
+	KASSERT(result == 0);
+	KASSERT(kd->kd_claimed);
+	kd->kd_claimed = false;
+
+	vfs_biglock_release();
+}
+
 /*
  * Unmount a filesystem/device by name.
  * First calls FSOP_SYNC on the filesystem; then calls FSOP_UNMOUNT.
@@ -571,6 +630,9 @@ vfs_unmount(const char *devname)
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
+	/* The name cache holds vnode references; drop them */
+	vfs_namecache_purgefs(kd->kd_fs);
+
 	result = FSOP_SYNC(kd->kd_fs);
 	if (result) {
 		goto fail;
@@ -619,6 +681,8 @@ vfs_unmountall(void)
 
 		kprintf("vfs: Unmounting %s:\n", dev->kd_name);
 
+		vfs_namecache_purgefs(dev->kd_fs);
+
 		result = FSOP_SYNC(dev->kd_fs);
 		if (result) {
 			kprintf("vfs: Warning: sync failed for %s: %s, trying "
@@ -228,6 +228,50 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
  * (In BSD, both of these are subsumed by namei().)
  */
 
+/*
+ * Do VOP_LOOKPARENT on PATH relative to STARTVN, resolving all but
+ * the last component through the name cache so the file system only
+ * sees the last component. Trailing slashes stay with the last
+ * component, so the file system still rejects them as before.
+ */
+static
+int
+lookparent_cached(struct vnode *startvn, char *path, struct vnode **retval,
+		  char *buf, size_t buflen)
+{
+	struct vnode *dir;
+	char *last, *s;
+	char save;
+	int result;
+
+	/* Find the start of the last component, ignoring trailing slashes */
+	s = path + strlen(path);
+	while (s > path && s[-1] == '/') {
+		s--;
+	}
+	while (s > path && s[-1] != '/') {
+		s--;
+	}
+	last = s;
+
+	if (last == path) {
+		return VOP_LOOKPARENT(startvn, path, retval, buf, buflen);
+	}
+
+	/* Temporarily cut the path before the last component */
+	save = *last;
+	*last = 0;
+	result = vfs_namecache_walk(startvn, path, &dir);
+	*last = save;
+	if (result) {
+		return result;
+	}
+
+	result = VOP_LOOKPARENT(dir, last, retval, buf, buflen);
+	VOP_DECREF(dir);
+	return result;
+}
+
 int
 vfs_lookparent(char *path, struct vnode **retval,
 	       char *buf, size_t buflen)
@@ -238,11 +282,16 @@ vfs_lookparent(char *path, struct vnode **retval,
 	vfs_biglock_acquire();
 
 	result = getdevice(path, &path, &startvn);
+	vfs_biglock_release();
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
+	/*
+	 * The big lock only protects the device list and current
+	 * directory; the file system does its own locking.
+	 */
+
 	if (strlen(path)==0) {
 		/*
 		 * It does not make sense to use just a device name in
@@ -252,12 +301,11 @@ vfs_lookparent(char *path, struct vnode **retval,
 		result = EINVAL;
 	}
 	else {
-		result = VOP_LOOKPARENT(startvn, path, retval, buf, buflen);
+		result = lookparent_cached(startvn, path, retval, buf, buflen);
 	}
 
 	VOP_DECREF(startvn);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -270,20 +318,18 @@ vfs_lookup(char *path, struct vnode **retval)
 	vfs_biglock_acquire();
 
 	result = getdevice(path, &path, &startvn);
+	vfs_biglock_release();
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	if (strlen(path)==0) {
 		*retval = startvn;
-		vfs_biglock_release();
 		return 0;
 	}
 
-	result = VOP_LOOKUP(startvn, path, retval);
+	result = vfs_namecache_walk(startvn, path, retval);
 
 	VOP_DECREF(startvn);
-	vfs_biglock_release();
 	return result;
 }
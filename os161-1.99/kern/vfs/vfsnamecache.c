@@ -0,0 +1,527 @@
+/*
+ * VFS name cache.
+ *
+ * Remembers the result of looking up one pathname component in a
+ * directory: (directory vnode, name) -> vnode, or -> "no such file"
+ * (a negative entry). vfs_lookup and vfs_lookparent walk paths one
+ * component at a time through this cache, so repeatedly resolving
+ * the same paths doesn't call VOP_LOOKUP, and hence doesn't touch
+ * directory blocks, at all.
+ *
+ * Each entry holds a reference to its directory (so the pointer used
+ * as the key can't be recycled for another vnode) and to the vnode
+ * it maps to. The cache is small and entries are recycled in LRU
+ * order, so this pins at most a bounded number of vnodes.
+ *
+ * Invalidation: after an operation that changes names (create,
+ * remove, rename, link, mkdir, rmdir, symlink) succeeds, the entries
+ * for the names it changed are dropped; a create enters its result
+ * instead, so reopening an existing file with O_CREAT costs nothing.
+ * A rename may move a directory, changing its "..", so it drops the
+ * ".." entries of the file system too. That only works if a file
+ * has just the one vnode (fs_uniquevnodes): emufs makes a fresh vnode
+ * for each host open, so an entry can't be found by the directory
+ * vnode a change went through, and a change there drops every entry
+ * for the file system instead. Unmount drops them all as well, so
+ * the references don't keep the file system busy.
+ *
+ * Changes made behind the VFS layer's back (e.g. to the host files
+ * under emufs) are not noticed.
+ *
+ * Locking: the table is protected by nc_lock, a spinlock, which is
+ * never held across VOP_LOOKUP or while dropping a vnode reference
+ * (either may sleep). Taking a reference (VOP_INCREF) only needs the
+ * vnode's count spinlock, so it's fine under nc_lock. Because the
+ * lock is dropped around VOP_LOOKUP, an invalidation can happen
+ * while a lookup is in progress; nc_gen counts invalidations, and a
+ * lookup only enters its result if none happened since it started.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <limits.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vfs.h>
+#include <fs.h>
+#include <vnode.h>
+
+/* Number of entries */
+#define NC_SIZE		64
+
+/* Number of hash chains; must be a power of 2 */
+#define NC_HASHSIZE	32
+
+/* Longest name cached; longer ones always go to the file system */
+#define NC_NAMELEN	31
+
+struct ncentry {
+	struct vnode *nc_dir;		/* directory, or NULL if unused */
+	struct vnode *nc_vn;		/* what NAME is, or NULL if absent */
+	char nc_name[NC_NAMELEN+1];
+	size_t nc_len;
+	unsigned nc_hash;
+	struct ncentry *nc_hashnext;
+	struct ncentry *nc_lruprev;	/* LRU list (all entries) */
+	struct ncentry *nc_lrunext;
+};
+
+static struct spinlock nc_lock = SPINLOCK_INITIALIZER;
+static unsigned nc_gen;			/* bumped on every invalidation */
+static struct ncentry nc_entries[NC_SIZE];
+static struct ncentry *nc_hashtab[NC_HASHSIZE];
+static struct ncentry *nc_lruhead;	/* least recently used */
+static struct ncentry *nc_lrutail;	/* most recently used */
+
+static
+unsigned
+nc_hashfunc(struct vnode *dir, const char *name, size_t len)
+{
+	unsigned h = (uintptr_t)dir >> 4;
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		h = h*33 + (unsigned char)name[i];
+	}
+	return h;
+}
+
+static
+void
+nc_lruremove(struct ncentry *e)
+{
+	if (e->nc_lruprev) {
+		e->nc_lruprev->nc_lrunext = e->nc_lrunext;
+	}
+	else {
+		nc_lruhead = e->nc_lrunext;
+	}
+	if (e->nc_lrunext) {
+		e->nc_lrunext->nc_lruprev = e->nc_lruprev;
+	}
+	else {
+		nc_lrutail = e->nc_lruprev;
+	}
+}
+
+/* Put E at the most-recently-used end, or the other end if ATHEAD. */
+static
+void
+nc_lruinsert(struct ncentry *e, bool athead)
+{
+	if (athead) {
+		e->nc_lruprev = NULL;
+		e->nc_lrunext = nc_lruhead;
+		if (nc_lruhead) {
+			nc_lruhead->nc_lruprev = e;
+		}
+		else {
+			nc_lrutail = e;
+		}
+		nc_lruhead = e;
+	}
+	else {
+		e->nc_lrunext = NULL;
+		e->nc_lruprev = nc_lrutail;
+		if (nc_lrutail) {
+			nc_lrutail->nc_lrunext = e;
+		}
+		else {
+			nc_lruhead = e;
+		}
+		nc_lrutail = e;
+	}
+}
+
+/*
+ * Empty out entry E (which must be in use) and make it the next one
+ * recycled. The references it held are handed back in DIR and VN
+ * for the caller to drop once nc_lock is released.
+ */
+static
+void
+nc_clear(struct ncentry *e, struct vnode **dir, struct vnode **vn)
+{
+	struct ncentry **pp;
+
+	KASSERT(spinlock_do_i_hold(&nc_lock));
+	KASSERT(e->nc_dir != NULL);
+
+	pp = &nc_hashtab[e->nc_hash & (NC_HASHSIZE-1)];
+	while (*pp != e) {
+		KASSERT(*pp != NULL);
+		pp = &(*pp)->nc_hashnext;
+	}
+	*pp = e->nc_hashnext;
+	e->nc_hashnext = NULL;
+
+	*dir = e->nc_dir;
+	*vn = e->nc_vn;
+	e->nc_dir = NULL;
+	e->nc_vn = NULL;
+
+	nc_lruremove(e);
+	nc_lruinsert(e, true);
+}
+
+/*
+ * Drop the references nc_clear handed back. This may reclaim the
+ * vnodes, so nc_lock must not be held.
+ */
+static
+void
+nc_drop(struct vnode *dir, struct vnode *vn)
+{
+	KASSERT(!spinlock_do_i_hold(&nc_lock));
+
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+	if (dir != NULL) {
+		VOP_DECREF(dir);
+	}
+}
+
+/*
+ * Look up name NAME (LEN chars, not necessarily null-terminated) in
+ * directory DIR. Returns the entry, or NULL if there isn't one.
+ */
+static
+struct ncentry *
+nc_find(struct vnode *dir, const char *name, size_t len, unsigned hash)
+{
+	struct ncentry *e;
+	size_t i;
+
+	KASSERT(spinlock_do_i_hold(&nc_lock));
+
+	for (e = nc_hashtab[hash & (NC_HASHSIZE-1)]; e; e = e->nc_hashnext) {
+		if (e->nc_hash != hash || e->nc_dir != dir ||
+		    e->nc_len != len) {
+			continue;
+		}
+		for (i=0; i<len && e->nc_name[i] == name[i]; i++) {
+			/* nothing */
+		}
+		if (i == len) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Record that NAME in DIR is VN (or doesn't exist, if VN is NULL),
+ * provided nothing has been invalidated since generation GEN. Another
+ * thread may have entered the same name meanwhile; that's fine too.
+ */
+static
+void
+nc_enter(struct vnode *dir, const char *name, size_t len, unsigned hash,
+	 struct vnode *vn, unsigned gen)
+{
+	struct ncentry *e;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+
+	KASSERT(len <= NC_NAMELEN);
+
+	spinlock_acquire(&nc_lock);
+	if (gen != nc_gen || nc_find(dir, name, len, hash) != NULL) {
+		spinlock_release(&nc_lock);
+		return;
+	}
+
+	e = nc_lruhead;
+	KASSERT(e != NULL);
+	if (e->nc_dir != NULL) {
+		nc_clear(e, &olddir, &oldvn);
+		KASSERT(nc_lruhead == e);
+	}
+
+	VOP_INCREF(dir);
+	e->nc_dir = dir;
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	e->nc_vn = vn;
+	memcpy(e->nc_name, name, len);
+	e->nc_name[len] = 0;
+	e->nc_len = len;
+	e->nc_hash = hash;
+	e->nc_hashnext = nc_hashtab[hash & (NC_HASHSIZE-1)];
+	nc_hashtab[hash & (NC_HASHSIZE-1)] = e;
+
+	nc_lruremove(e);
+	nc_lruinsert(e, false);
+	spinlock_release(&nc_lock);
+
+	nc_drop(olddir, oldvn);
+}
+
+/*
+ * Look up a single component NAME (LEN chars) in directory DIR,
+ * through the cache.
+ */
+static
+int
+vfs_lookonce(struct vnode *dir, const char *name, size_t len,
+	     struct vnode **ret)
+{
+	char buf[NAME_MAX+1];
+	struct ncentry *e;
+	unsigned hash, gen;
+	bool cacheable;
+	int result;
+
+	if (len > NAME_MAX) {
+		return ENAMETOOLONG;
+	}
+
+	/* Devices (and anything else not on a file system) aren't cached */
+	cacheable = dir->vn_fs != NULL && len <= NC_NAMELEN;
+
+	hash = gen = 0;
+	if (cacheable) {
+		hash = nc_hashfunc(dir, name, len);
+		spinlock_acquire(&nc_lock);
+		e = nc_find(dir, name, len, hash);
+		if (e != NULL) {
+			nc_lruremove(e);
+			nc_lruinsert(e, false);
+			if (e->nc_vn == NULL) {
+				spinlock_release(&nc_lock);
+				return ENOENT;
+			}
+			VOP_INCREF(e->nc_vn);
+			*ret = e->nc_vn;
+			spinlock_release(&nc_lock);
+			return 0;
+		}
+		gen = nc_gen;
+		spinlock_release(&nc_lock);
+	}
+
+	/* VOP_LOOKUP may scribble on the name; give it a copy */
+	memcpy(buf, name, len);
+	buf[len] = 0;
+	result = VOP_LOOKUP(dir, buf, ret);
+
+	if (cacheable) {
+		if (result == 0) {
+			nc_enter(dir, name, len, hash, *ret, gen);
+		}
+		else if (result == ENOENT) {
+			nc_enter(dir, name, len, hash, NULL, gen);
+		}
+	}
+	return result;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+/*
+ * Translate PATH relative to STARTVN, one component at a time.
+ * Empty components (repeated or trailing slashes) are skipped.
+ * Does not consume the caller's reference to STARTVN.
+ */
+int
+vfs_namecache_walk(struct vnode *startvn, char *path, struct vnode **ret)
+{
+	struct vnode *cur, *next;
+	size_t len;
+	int result;
+
+	VOP_INCREF(startvn);
+	cur = startvn;
+
+	while (1) {
+		while (*path == '/') {
+			path++;
+		}
+		if (*path == 0) {
+			break;
+		}
+		for (len=0; path[len] != 0 && path[len] != '/'; len++) {
+			/* nothing */
+		}
+
+		result = vfs_lookonce(cur, path, len, &next);
+		VOP_DECREF(cur);
+		if (result) {
+			return result;
+		}
+		cur = next;
+		path += len;
+	}
+
+	*ret = cur;
+	return 0;
+}
+
+/*
+ * Drop the entries for file system FS: all of them, or if NAME isn't
+ * NULL, those for NAME in any directory.
+ */
+static
+void
+nc_purge(struct fs *fs, const char *name)
+{
+	struct vnode *dir, *vn;
+	unsigned i;
+
+	spinlock_acquire(&nc_lock);
+	nc_gen++;
+	for (i=0; i<NC_SIZE; i++) {
+		if (nc_entries[i].nc_dir != NULL &&
+		    nc_entries[i].nc_dir->vn_fs == fs &&
+		    (name == NULL || !strcmp(nc_entries[i].nc_name, name))) {
+			nc_clear(&nc_entries[i], &dir, &vn);
+
+			/* Can't drop references under the spinlock */
+			spinlock_release(&nc_lock);
+			nc_drop(dir, vn);
+			spinlock_acquire(&nc_lock);
+		}
+	}
+	spinlock_release(&nc_lock);
+}
+
+/*
+ * Drop the entry for NAME in directory DIR, if there is one.
+ */
+static
+void
+nc_remove(struct vnode *dir, const char *name)
+{
+	struct ncentry *e;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+	size_t len;
+	unsigned hash;
+
+	len = strlen(name);
+	if (len > NC_NAMELEN) {
+		/* never cached */
+		return;
+	}
+	hash = nc_hashfunc(dir, name, len);
+
+	spinlock_acquire(&nc_lock);
+	nc_gen++;
+	e = nc_find(dir, name, len, hash);
+	if (e != NULL) {
+		nc_clear(e, &olddir, &oldvn);
+	}
+	spinlock_release(&nc_lock);
+
+	nc_drop(olddir, oldvn);
+}
+
+/*
+ * NAME in DIR has been created or removed.
+ */
+void
+vfs_namecache_changed(struct vnode *dir, const char *name)
+{
+	if (dir->vn_fs == NULL) {
+		/* not cached */
+		return;
+	}
+	if (!dir->vn_fs->fs_uniquevnodes) {
+		nc_purge(dir->vn_fs, NULL);
+		return;
+	}
+	nc_remove(dir, name);
+}
+
+/*
+ * NAME in DIR is VN, whether it was already or has just been created.
+ */
+void
+vfs_namecache_created(struct vnode *dir, const char *name, struct vnode *vn)
+{
+	struct ncentry *e;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+	size_t len;
+	unsigned hash, gen;
+
+	if (dir->vn_fs == NULL) {
+		return;
+	}
+	if (!dir->vn_fs->fs_uniquevnodes) {
+		nc_purge(dir->vn_fs, NULL);
+		return;
+	}
+	len = strlen(name);
+	if (len > NC_NAMELEN) {
+		return;
+	}
+	hash = nc_hashfunc(dir, name, len);
+
+	spinlock_acquire(&nc_lock);
+	e = nc_find(dir, name, len, hash);
+	if (e != NULL && e->nc_vn == vn) {
+		/* It was there, and we knew */
+		spinlock_release(&nc_lock);
+		return;
+	}
+	gen = ++nc_gen;
+	if (e != NULL) {
+		nc_clear(e, &olddir, &oldvn);
+	}
+	spinlock_release(&nc_lock);
+	nc_drop(olddir, oldvn);
+
+	nc_enter(dir, name, len, hash, vn, gen);
+}
+
+/*
+ * OLDNAME in OLDDIR is now NEWNAME in NEWDIR.
+ */
+void
+vfs_namecache_renamed(struct vnode *olddir, const char *oldname,
+		      struct vnode *newdir, const char *newname)
+{
+	KASSERT(olddir->vn_fs == newdir->vn_fs);
+
+	if (olddir->vn_fs == NULL) {
+		return;
+	}
+	if (!olddir->vn_fs->fs_uniquevnodes) {
+		nc_purge(olddir->vn_fs, NULL);
+		return;
+	}
+	nc_remove(olddir, oldname);
+	nc_remove(newdir, newname);
+	/* If it's a directory, its parent changed */
+	nc_purge(olddir->vn_fs, "..");
+}
+
+/*
+ * Forget everything about names on file system FS.
+ */
+void
+vfs_namecache_purgefs(struct fs *fs)
+{
+	nc_purge(fs, NULL);
+}
+
+/*
+ * Set up the (empty) cache.
+ */
+void
+vfs_namecache_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<NC_SIZE; i++) {
+		nc_entries[i].nc_dir = NULL;
+		nc_entries[i].nc_vn = NULL;
+		nc_entries[i].nc_hashnext = NULL;
+		nc_lruinsert(&nc_entries[i], false);
+	}
+	for (i=0; i<NC_HASHSIZE; i++) {
+		nc_hashtab[i] = NULL;
+	}
+}
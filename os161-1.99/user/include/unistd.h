@@ -39,6 +39,7 @@
  */
 #include <kern/fcntl.h>
 #include <kern/ioctl.h>
+#include <kern/mman.h>
 #include <kern/reboot.h>
 #include <kern/seek.h>
 #include <kern/time.h>
@@ -46,6 +47,9 @@
 #include <kern/wait.h>
 
 
+/* What mmap returns on error */
+#define MAP_FAILED ((void *)-1)
+
 /*
  * Prototypes for OS/161 system calls.
  *
@@ -154,6 +158,11 @@ int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 time_t __time(time_t *seconds, unsigned long *nanoseconds);
 int __getcwd(char *buf, size_t buflen);
+int futex_wait(volatile int *addr, int val);
+int futex_wake(volatile int *addr, int nwake);
+void *mmap(void *addr, size_t len, int prot, int flags, int filehandle,
+	   off_t offset);
+int munmap(void *addr, size_t len);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
 
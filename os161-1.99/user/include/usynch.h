@@ -0,0 +1,39 @@
+#ifndef _USYNCH_H_
+#define _USYNCH_H_
+
+/*
+ * User-level mutexes and condition variables for multi-threaded
+ * programs, built on the futex_wait/futex_wake system calls.
+ *
+ * Uncontended lock and unlock are done entirely at user level with
+ * atomic instructions; the kernel is only entered to sleep when the
+ * mutex is held by someone else or to wake a sleeper on release.
+ *
+ * Both structures may be statically initialized with the
+ * corresponding _INITIALIZER macro instead of calling _init.
+ */
+
+struct umutex {
+	/* 0 = unlocked, 1 = locked, 2 = locked and maybe contended */
+	volatile int um_state;
+};
+
+struct ucond {
+	/* bumped on every signal/broadcast */
+	volatile int uc_seq;
+};
+
+#define UMUTEX_INITIALIZER	{ 0 }
+#define UCOND_INITIALIZER	{ 0 }
+
+void umutex_init(struct umutex *m);
+void umutex_lock(struct umutex *m);
+int umutex_trylock(struct umutex *m);
+void umutex_unlock(struct umutex *m);
+
+void ucond_init(struct ucond *c);
+void ucond_wait(struct ucond *c, struct umutex *m);
+void ucond_signal(struct ucond *c);
+void ucond_broadcast(struct ucond *c);
+
+#endif /* _USYNCH_H_ */
@@ -0,0 +1,186 @@
+#include <unistd.h>
+#include <usynch.h>
+
+/*
+ * User-level mutex and condition variable on top of futexes.
+ *
+ * The mutex is the usual three-state futex mutex: 0 is unlocked, 1 is
+ * locked with nobody waiting, 2 is locked with (possibly) somebody
+ * asleep in the kernel. Locking 0 -> 1 and unlocking 1 -> 0 never
+ * make a system call. Anyone who has to wait marks the word 2 first,
+ * so the unlocker knows it has to call futex_wake.
+ *
+ * The condition variable is a sequence number. A waiter samples it
+ * before dropping the mutex and sleeps only if it hasn't changed
+ * since, so a signal between the unlock and the futex_wait is never
+ * lost.
+ */
+
+/* Wake count for broadcast: more threads than any process can have. */
+#define WAKE_ALL	0x7fffffff
+
+/*
+ * Atomic compare-and-swap using LL/SC: if *p == old, store new.
+ * Returns the value *p held before.
+ */
+static
+int
+atomic_cas(volatile int *p, int old, int new)
+{
+	int x, y;
+
+	/*
+	 * Retry the LL/SC pair until the SC goes through or the value
+	 * turns out not to match. The comparison has to sit between
+	 * the LL and the SC, so this is all one asm block.
+	 */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 instructions */
+		".set noreorder;"	/* we fill our own delay slots */
+		".set volatile;"	/* avoid unwanted optimization */
+		"1: ll %0, 0(%2);"	/*   x = *p */
+		"bne %0, %3, 2f;"	/*   if (x != old) give up */
+		"move %1, %4;"		/*   (delay slot) y = new */
+		"sc %1, 0(%2);"		/*   *p = y; y = success? */
+		"beq %1, $0, 1b;"	/*   retry if the SC failed */
+		"nop;"			/*   (delay slot) */
+		"2: .set pop"		/* restore assembler mode */
+		: "=&r" (x), "=&r" (y)
+		: "r" (p), "r" (old), "r" (new)
+		: "memory");
+
+	return x;
+}
+
+/*
+ * Atomically store NEW into *P and return the previous value.
+ */
+static
+int
+atomic_xchg(volatile int *p, int new)
+{
+	int x, y;
+
+	do {
+		y = new;
+		__asm volatile(
+			".set push;"
+			".set mips32;"
+			".set volatile;"
+			"ll %0, 0(%2);"		/*   x = *p */
+			"sc %1, 0(%2);"		/*   *p = y; y = success? */
+			".set pop"
+			: "=&r" (x), "+r" (y) : "r" (p) : "memory");
+	} while (y == 0);
+
+	return x;
+}
+
+/*
+ * Atomically add 1 to *P.
+ */
+static
+void
+atomic_inc(volatile int *p)
+{
+	int old;
+
+	do {
+		old = *p;
+	} while (atomic_cas(p, old, old + 1) != old);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Mutex.
+
+void
+umutex_init(struct umutex *m)
+{
+	m->um_state = 0;
+}
+
+int
+umutex_trylock(struct umutex *m)
+{
+	return atomic_cas(&m->um_state, 0, 1) == 0;
+}
+
+void
+umutex_lock(struct umutex *m)
+{
+	int c;
+
+	/* Fast path: unlocked -> locked, no kernel entry. */
+	c = atomic_cas(&m->um_state, 0, 1);
+	if (c == 0) {
+		return;
+	}
+
+	/*
+	 * Contended. Mark the mutex as having waiters and sleep until
+	 * we manage to grab it. We take it in state 2 (not 1) since we
+	 * can't tell whether others are still asleep behind us.
+	 */
+	if (c != 2) {
+		c = atomic_xchg(&m->um_state, 2);
+	}
+	while (c != 0) {
+		futex_wait(&m->um_state, 2);
+		c = atomic_xchg(&m->um_state, 2);
+	}
+}
+
+void
+umutex_unlock(struct umutex *m)
+{
+	/* Fast path: nobody was waiting, so nobody needs waking. */
+	if (atomic_xchg(&m->um_state, 0) == 2) {
+		futex_wake(&m->um_state, 1);
+	}
+}
+
+////////////////////////////////////////////////////////////
+//
+// CV.
+
+void
+ucond_init(struct ucond *c)
+{
+	c->uc_seq = 0;
+}
+
+void
+ucond_wait(struct ucond *c, struct umutex *m)
+{
+	int seq;
+
+	seq = c->uc_seq;
+	umutex_unlock(m);
+
+	/* Returns at once (EAGAIN) if a signal already bumped uc_seq. */
+	futex_wait(&c->uc_seq, seq);
+
+	/*
+	 * Reacquire in the contended state: other threads woken by a
+	 * broadcast may be piling up behind us on the mutex.
+	 */
+	while (atomic_xchg(&m->um_state, 2) != 0) {
+		futex_wait(&m->um_state, 2);
+	}
+}
+
+void
+ucond_signal(struct ucond *c)
+{
+	atomic_inc(&c->uc_seq);
+	futex_wake(&c->uc_seq, 1);
+}
+
+void
+ucond_broadcast(struct ucond *c)
+{
+	atomic_inc(&c->uc_seq);
+	futex_wake(&c->uc_seq, WAKE_ALL);
+}
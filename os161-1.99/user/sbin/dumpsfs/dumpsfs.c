@@ -68,6 +68,7 @@ dumpsb(void)
 	sp.sp_volname[sizeof(sp.sp_volname)-1] = 0;
 	printf("Volume name: %-40s  %u blocks\n", sp.sp_volname, 
 	       SWAPL(sp.sp_nblocks));
+	printf("Free blocks: %u\n", SWAPL(sp.sp_nfree));
 
 	return SWAPL(sp.sp_nblocks);
 }
@@ -85,7 +86,11 @@ dodirblock(uint32_t block)
 	printf("    [block %u]\n", block);
 	for (i=0; i<nsds; i++) {
 		uint32_t ino = SWAPL(sds[i].sfd_ino);
-		if (ino==SFS_NOINO) {
+		if (ino==SFS_NOINO &&
+		    sds[i].sfd_name[1] == SFS_DIR_TOMBSTONE) {
+			printf("        [deleted entry]\n");
+		}
+		else if (ino==SFS_NOINO) {
 			printf("        [free entry]\n");
 		}
 		else {
@@ -95,12 +100,42 @@ dodirblock(uint32_t block)
 	}
 }
 
+/*
+ * Dump the directory blocks under indirect block IBLOCK, which has
+ * LEVEL levels of indirect blocks (counting itself) above the data.
+ */
+static
+void
+dodirindirect(uint32_t iblock, int level, uint32_t *nblocks)
+{
+	uint32_t ib[SFS_DBPERIDB];
+	uint32_t block;
+	int i;
+
+	if (iblock == 0) {
+		return;
+	}
+	diskread(&ib, iblock);
+	for (i=0; i<SFS_DBPERIDB; i++) {
+		block = SWAPL(ib[i]);
+		if (block == 0) {
+			continue;
+		}
+		if (level > 1) {
+			dodirindirect(block, level-1, nblocks);
+		}
+		else {
+			dodirblock(block);
+			(*nblocks)++;
+		}
+	}
+}
+
 static
 void
 dumpdir(uint32_t ino)
 {
 	struct sfs_inode sfi;
-	uint32_t ib[SFS_DBPERIDB];
 	int nentries, i;
 	uint32_t block, nblocks=0;
 
@@ -111,6 +146,9 @@ dumpdir(uint32_t ino)
 		warnx("Warning: dir size is not a multiple of dir entry size");
 	}
 	printf("Directory %u: %d entries\n", ino, nentries);
+	if (SWAPL(sfi.sfi_dirhash)) {
+		printf("    hashed, %u buckets\n", SWAPL(sfi.sfi_dirhash));
+	}
 
 	for (i=0; i<SFS_NDIRECT; i++) {
 		block = SWAPL(sfi.sfi_direct[i]);
@@ -119,16 +157,9 @@ dumpdir(uint32_t ino)
 			nblocks++;
 		}
 	}
-	if (SWAPL(sfi.sfi_indirect)) {
-		diskread(&ib, SWAPL(sfi.sfi_indirect));
-		for (i=0; i<SFS_DBPERIDB; i++) {
-			block = SWAPL(ib[i]);
-			if (block) {
-				dodirblock(block);
-				nblocks++;
-			}
-		}
-	}
+	dodirindirect(SWAPL(sfi.sfi_indirect), 1, &nblocks);
+	dodirindirect(SWAPL(sfi.sfi_dindirect), 2, &nblocks);
+	dodirindirect(SWAPL(sfi.sfi_tindirect), 3, &nblocks);
 	printf("    %u blocks in directory\n", nblocks);
 }
 
@@ -63,7 +63,9 @@ check(void)
 {
 	assert(sizeof(struct sfs_super)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_inode)==SFS_BLOCKSIZE);
+	assert(SFS_DBPERIDB * sizeof(uint32_t) == SFS_BLOCKSIZE);
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
+	assert(SFS_DIRPERBLOCK * sizeof(struct sfs_dir) == SFS_BLOCKSIZE);
 }
 
 static
@@ -82,20 +84,38 @@ writesuper(const char *volname, uint32_t nblocks)
 	sp.sp_nblocks = SWAPL(nblocks);
 	strcpy(sp.sp_volname, volname);
 
+	/* Everything but the superblock, root inode, and bitmap */
+	sp.sp_nfree = SWAPL(nblocks - 2 - SFS_BITBLOCKS(nblocks));
+
 	diskwrite(&sp, SFS_SB_LOCATION);
 }
 
+/*
+ * Write the root directory inode. Unless LINEAR is set, the root is
+ * a hashed directory (see kern/sfs.h); its buckets start out as
+ * holes, so they take no space until used.
+ */
 static
 void
-writerootdir(void)
+writerootdir(int linear)
 {
 	struct sfs_inode sfi;
 
 	bzero((void *)&sfi, sizeof(sfi));
 
-	sfi.sfi_size = SWAPL(0);
+	if (linear) {
+		sfi.sfi_size = SWAPL(0);
+		sfi.sfi_dirhash = SWAPL(0);
+	}
+	else {
+		sfi.sfi_size = SWAPL(SFS_DIRHASH_NBUCKETS * SFS_BLOCKSIZE);
+		sfi.sfi_dirhash = SWAPL(SFS_DIRHASH_NBUCKETS);
+	}
 	sfi.sfi_type = SWAPS(SFS_TYPE_DIR);
 	sfi.sfi_linkcount = SWAPS(1);
+	sfi.sfi_indirect = SWAPL(0);
+	sfi.sfi_dindirect = SWAPL(0);
+	sfi.sfi_tindirect = SWAPL(0);
 
 	diskwrite(&sfi, SFS_ROOT_LOCATION);
 }
@@ -148,13 +168,21 @@ main(int argc, char **argv)
 {
 	uint32_t size, blocksize;
 	char *volname, *s;
+	int linear = 0;
 
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
+	/* -l: make an old-style (linear) root directory */
+	if (argc==4 && !strcmp(argv[1], "-l")) {
+		linear = 1;
+		argc--;
+		argv++;
+	}
+
 	if (argc!=3) {
-		errx(1, "Usage: mksfs device/diskfile volume-name");
+		errx(1, "Usage: mksfs [-l] device/diskfile volume-name");
 	}
 
 	check();
@@ -186,7 +214,7 @@ main(int argc, char **argv)
 	size = diskblocks();
 
 	writesuper(volname, size);
-	writerootdir();
+	writerootdir(linear);
 	writebitmap(size);
 
 	closedisk();
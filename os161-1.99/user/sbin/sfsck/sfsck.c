@@ -83,6 +83,7 @@ swapsb(struct sfs_super *sp)
 {
 	sp->sp_magic = SWAPL(sp->sp_magic);
 	sp->sp_nblocks = SWAPL(sp->sp_nblocks);
+	sp->sp_nfree = SWAPL(sp->sp_nfree);
 }
 
 static
@@ -126,6 +127,8 @@ swapinode(struct sfs_inode *sfi)
 	sfi->sfi_tindirect = SWAPL(sfi->sfi_tindirect);
 #endif
 #endif
+
+	sfi->sfi_dirhash = SWAPL(sfi->sfi_dirhash);
 }
 
 static
@@ -371,6 +374,31 @@ check_bitmap(void)
 	}
 }
 
+/*
+ * Make the superblock's free block count match the (now correct)
+ * bitmap. Blocks past the end of the volume don't count either way.
+ */
+static
+void
+check_nfree(void)
+{
+	struct sfs_super sp;
+	uint32_t nfree;
+
+	diskread(&sp, SFS_SB_LOCATION);
+	swapsb(&sp);
+
+	nfree = nblocks - count_blocks;
+	if (sp.sp_nfree != nfree) {
+		warnx("Superblock free block count %lu should be %lu (fixed)",
+		      (unsigned long) sp.sp_nfree, (unsigned long) nfree);
+		setbadness(EXIT_RECOV);
+		sp.sp_nfree = nfree;
+		swapsb(&sp);
+		diskwrite(&sp, SFS_SB_LOCATION);
+	}
+}
+
 ////////////////////////////////////////////////////////////
 
 struct inodememory {
@@ -567,17 +595,22 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 	uint32_t entries[SFS_DBPERIDB];
 	uint32_t i, ct;
 
-	if (*ientry !=0) {
-		diskread(entries, *ientry);
-		swapindir(entries);
-		bitmap_mark(*ientry, B_IBLOCK, ino);
-	}
-	else {
-		for (i=0; i<SFS_DBPERIDB; i++) {
-			entries[i] = 0;
+	if (*ientry == 0) {
+		/*
+		 * Nothing under here; just skip its range of the file
+		 * (which for a triple indirect block is large).
+		 */
+		for (ct=1, i=0; i<(uint32_t)indirection; i++) {
+			ct *= SFS_DBPERIDB;
 		}
+		*blockp += ct;
+		return;
 	}
 
+	diskread(entries, *ientry);
+	swapindir(entries);
+	bitmap_mark(*ientry, B_IBLOCK, ino);
+
 	if (indirection > 1) {
 		for (i=0; i<SFS_DBPERIDB; i++) {
 			check_indirect_block(ino, &entries[i], 
@@ -602,8 +635,7 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 				if (entries[i] != 0) {
 					(*badcountp)++;
 					bitmap_mark(entries[i],
-						    isdir ? B_DIRDATA : B_DATA,
-						    ino);
+						    B_TOFREE, 0);
 					entries[i] = 0;
 				}
 			}
@@ -616,14 +648,11 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 		if (entries[i]!=0) ct++;
 	}
 	if (ct==0) {
-		if (*ientry != 0) {
-			(*badcountp)++;
-			bitmap_mark(*ientry, B_TOFREE, 0);
-			*ientry = 0;
-		}
+		(*badcountp)++;
+		bitmap_mark(*ientry, B_TOFREE, 0);
+		*ientry = 0;
 	}
 	else {
-		assert(*ientry != 0);
 		if (*badcountp > 0) {
 			swapindir(entries);
 			diskwrite(entries, *ientry);
@@ -820,7 +849,10 @@ dirread(struct sfs_inode *sfi, struct sfs_dir *d, unsigned nd)
 			}
 		}
 		else {
-			warnx("Warning: sparse directory found");
+			/* Unused hash buckets are normally holes */
+			if (i >= sfi->sfi_dirhash) {
+				warnx("Warning: sparse directory found");
+			}
 			bzero(d + i*atonce, SFS_BLOCKSIZE);
 		}
 	}
@@ -918,6 +950,156 @@ dir_tryadd(struct sfs_dir *d, int nd, const char *name, uint32_t ino)
 	return -1;
 }
 
+////////////////////////////////////////////////////////////
+// hashed directories (see kern/sfs.h)
+
+static
+uint32_t
+dir_hash(const char *name)
+{
+	uint32_t h = SFS_DIRHASH_INIT;
+
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= SFS_DIRHASH_MULT;
+	}
+	return h;
+}
+
+/* returns nonzero if bucket B has an entry that was never used */
+static
+int
+dir_bucket_neverused(const struct sfs_dir *d, uint32_t b)
+{
+	uint32_t j;
+
+	for (j=0; j<SFS_DIRPERBLOCK; j++) {
+		if (d[b*SFS_DIRPERBLOCK+j].sfd_ino == SFS_NOINO &&
+		    d[b*SFS_DIRPERBLOCK+j].sfd_name[1] != SFS_DIR_TOMBSTONE) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* returns nonzero if a search for the name in slot SLOT would find it */
+static
+int
+dir_hash_reachable(const struct sfs_dir *d, uint32_t nbuckets, uint32_t slot)
+{
+	uint32_t bucket = slot / SFS_DIRPERBLOCK;
+	uint32_t b, k;
+
+	b = dir_hash(d[slot].sfd_name) % nbuckets;
+	for (k=0; k<nbuckets; k++) {
+		if (b == bucket) {
+			return 1;
+		}
+		if (dir_bucket_neverused(d, b)) {
+			return 0;
+		}
+		b = (b+1) % nbuckets;
+	}
+	/* searched all the buckets; that reaches the overflow area */
+	return bucket >= nbuckets;
+}
+
+/*
+ * Put NAME in the slot of a hashed directory where the kernel would.
+ * Fails (returns -1) if that's in a bucket that has no disk block,
+ * since we can't allocate one, or if all buckets are full.
+ */
+static
+int
+dir_hash_add(const struct sfs_inode *sfi, struct sfs_dir *d,
+	     const char *name, uint32_t ino)
+{
+	uint32_t nbuckets = sfi->sfi_dirhash;
+	uint32_t b, j, k;
+
+	b = dir_hash(name) % nbuckets;
+	for (k=0; k<nbuckets; k++) {
+		for (j=0; j<SFS_DIRPERBLOCK; j++) {
+			struct sfs_dir *sfd = &d[b*SFS_DIRPERBLOCK+j];
+
+			if (sfd->sfd_ino == SFS_NOINO) {
+				if (dobmap(sfi, b) == 0) {
+					return -1;
+				}
+				sfd->sfd_ino = ino;
+				assert(strlen(name) < sizeof(sfd->sfd_name));
+				strcpy(sfd->sfd_name, name);
+				return 0;
+			}
+		}
+		b = (b+1) % nbuckets;
+	}
+	return -1;
+}
+
+/*
+ * Make sure every name in a hashed directory is where a search for
+ * it will look, moving the ones that aren't. If that can't be done,
+ * make the directory linear, which is always valid.
+ * Returns nonzero if the directory entries were changed; sets
+ * *ICHANGED if the inode was.
+ */
+static
+int
+check_dir_hash(const char *pathsofar, struct sfs_inode *sfi,
+	       struct sfs_dir *d, uint32_t nd, int *ichanged)
+{
+	uint32_t nbuckets = sfi->sfi_dirhash;
+	struct sfs_dir save;
+	uint32_t i;
+	int dchanged = 0;
+
+	if (nbuckets == 0) {
+		return 0;
+	}
+
+	if (nd < nbuckets * SFS_DIRPERBLOCK) {
+		setbadness(EXIT_RECOV);
+		warnx("Directory /%s: Too short for its %lu hash buckets "
+		      "(made linear)", pathsofar, (unsigned long) nbuckets);
+		sfi->sfi_dirhash = 0;
+		*ichanged = 1;
+		return 0;
+	}
+
+	for (i=0; i<nd; i++) {
+		if (d[i].sfd_ino == SFS_NOINO ||
+		    dir_hash_reachable(d, nbuckets, i)) {
+			continue;
+		}
+
+		/* Take it out, leaving a tombstone, and put it back */
+		save = d[i];
+		bzero(&d[i], sizeof(d[i]));
+		if (i < nbuckets * SFS_DIRPERBLOCK) {
+			d[i].sfd_name[1] = SFS_DIR_TOMBSTONE;
+		}
+		if (dir_hash_add(sfi, d, save.sfd_name, save.sfd_ino) == 0) {
+			setbadness(EXIT_RECOV);
+			warnx("Directory /%s: Entry %s in wrong hash bucket "
+			      "(moved)", pathsofar, save.sfd_name);
+			dchanged = 1;
+			continue;
+		}
+
+		d[i] = save;
+		setbadness(EXIT_RECOV);
+		warnx("Directory /%s: Entry %s in wrong hash bucket "
+		      "(directory made linear)", pathsofar, save.sfd_name);
+		sfi->sfi_dirhash = 0;
+		*ichanged = 1;
+		break;
+	}
+	return dchanged;
+}
+
+////////////////////////////////////////////////////////////
+
 static
 int
 check_dir_entry(const char *pathsofar, uint32_t index, struct sfs_dir *sfd)
@@ -1194,6 +1376,11 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 		ichanged = 1;
 	}
 
+	if (check_dir_hash(pathsofar, &sfi, direntries, ndirentries,
+			   &ichanged)) {
+		dchanged = 1;
+	}
+
 	if (dchanged) {
 		dirwrite(&sfi, direntries, ndirentries);
 	}
@@ -1260,6 +1447,7 @@ main(int argc, char **argv)
 	check_sb();
 	check_root_dir();
 	check_bitmap();
+	check_nfree();
 	adjust_filelinks();
 
 	closedisk();